@@ -0,0 +1,48 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+
+// Bump allocator for things that all die together: a parse tree, or the
+// arrays of a finished program. Blocks are at least `block_size` bytes and
+// chained, so arena_release() is one pass over a short list.
+
+#define ARENA_ALIGN 16
+
+void arena_init(arena_t *a, size_t block_size) {
+    a->head = NULL;
+    a->block_size = block_size;
+    a->bytes = 0;
+}
+
+void *arena_alloc(arena_t *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    arena_block_t *b = a->head;
+    if (b == NULL || b->size - b->used < size) {
+        size_t data_size = size > a->block_size ? size : a->block_size;
+        // the header is padded so the data after it stays aligned
+        size_t header = (sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+        b = (arena_block_t*) malloc(header + data_size);
+        b->prev = a->head;
+        b->data = (char*) b + header;
+        b->size = data_size;
+        b->used = 0;
+        a->head = b;
+        a->bytes += header + data_size;
+    }
+
+    void *res = b->data + b->used;
+    b->used += size;
+    return res;
+}
+
+void arena_release(arena_t *a) {
+    arena_block_t *b = a->head;
+    while (b != NULL) {
+        arena_block_t *prev = b->prev;
+        free(b);
+        b = prev;
+    }
+    a->head = NULL;
+    a->bytes = 0;
+}
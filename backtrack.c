@@ -0,0 +1,99 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Backtracking over prog->code with a bit per (pc, position): a pc is never
+// run twice at the same position, so a match costs at most
+// insts_length * (len + 1) steps, same as the thompson vm, without the
+// thread lists. Like vm_run_code it goes between consuming instructions with
+// the epsilon closures, so only those (and matches) get bits. Clearing the
+// bitmap is the per-string cost, which is why it's only for short inputs,
+// see BACKTRACK_FITS.
+
+typedef struct {
+    int pc;
+    int pos;
+} backtrack_job_t;
+
+backtrack_scratch_t *backtrack_scratch_new(vm_program_t *prog) {
+    backtrack_scratch_t *s = (backtrack_scratch_t*) malloc(sizeof(backtrack_scratch_t));
+    s->prog = prog;
+    s->visited = (uint64_t*) malloc(BACKTRACK_MAX_BITS / 8);
+    s->stack_capacity = 64;
+    s->stack = malloc(s->stack_capacity * sizeof(backtrack_job_t));
+    return s;
+}
+
+void backtrack_scratch_free(backtrack_scratch_t *s) {
+    free(s->visited);
+    free(s->stack);
+    free(s);
+}
+
+// false if the bit was set already, sets it either way
+bool backtrack_visit(uint64_t *visited, size_t bit) {
+    uint64_t was = visited[bit / 64];
+    visited[bit / 64] = was | (1ULL << (bit % 64));
+    return !(was & (1ULL << (bit % 64)));
+}
+
+void backtrack_push(backtrack_scratch_t *s, int *sp, int pc, int pos) {
+    if (*sp == s->stack_capacity) {
+        s->stack_capacity *= 2;
+        s->stack = realloc(s->stack, s->stack_capacity * sizeof(backtrack_job_t));
+    }
+    ((backtrack_job_t*) s->stack)[(*sp)++] = (backtrack_job_t) {.pc = pc, .pos = pos};
+}
+
+// full match of data[0, len), which has to be BACKTRACK_FITS
+bool backtrack_run(backtrack_scratch_t *s, const char *data, size_t len) {
+    vm_program_t *prog = s->prog;
+    const vm_code_t *code = prog->code;
+    const int *eps = prog->eps, *eps_offsets = prog->eps_offsets;
+    uint64_t *visited = s->visited;
+    int sp = 0;
+
+    int width = (int) len + 1;
+    size_t bits = (size_t) prog->insts_length * width;
+    memset(visited, 0, (bits + 63) / 64 * sizeof(uint64_t));
+
+    // every job on the stack was marked when pushed, so there are never
+    // more of them than bits
+    for (int k = eps_offsets[1] - 1; k >= eps_offsets[0]; k--) {
+        backtrack_visit(visited, (size_t) eps[k] * width);
+        backtrack_push(s, &sp, eps[k], 0);
+    }
+
+    while (sp > 0) {
+        backtrack_job_t job = ((backtrack_job_t*) s->stack)[--sp];
+        int pc = job.pc, pos = job.pos;
+
+        // run one thread until it fails: after each byte it goes on to the
+        // first unvisited pc of the closure, and the rest of it is pushed
+        for (;;) {
+            const vm_code_t *inst = &code[pc];
+            if (inst->op == OP_MATCH) {
+                if ((size_t) pos == len) return true;
+                break;
+            }
+            if ((size_t) pos == len) break;
+            uint8_t c = (uint8_t) data[pos];
+            if (inst->op == OP_LITERAL ? inst->c != c :
+                inst->op == OP_CLASS && !CHAR_CLASS_HAS(&prog->classes[inst->x], c))
+                break;
+            pos++;
+
+            int next = -1;
+            for (int k = eps_offsets[pc + 2] - 1; k >= eps_offsets[pc + 1]; k--) {
+                if (!backtrack_visit(visited, (size_t) eps[k] * width + pos)) continue;
+                if (next >= 0) backtrack_push(s, &sp, next, pos);
+                next = eps[k];
+            }
+            if (next < 0) break;
+            pc = next;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,162 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Matching lots of short strings against one program.
+//
+// Every worker starts with an equal slice of the batch and eats it from the
+// front, BATCH_GRAIN strings at a time. A worker whose slice is empty steals
+// the back half of someone else's, so a slice full of long strings doesn't
+// hold up the rest. Strings go to the JIT code when the caller passes some,
+// then a one word bitnfa, then the VM. Each worker has its own vm_scratch_t (and
+// backtrack_scratch_t, for the strings short enough) for all of its strings;
+// the program and the JIT code are only read.
+
+#define BATCH_GRAIN 256
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next; // strings [next, end) are left
+    size_t end;
+    char pad[64]; // keep the queues on separate cache lines
+} batch_queue_t;
+
+typedef struct {
+    vm_program_t *prog;
+    match_len_fn_t jit; // NULL to use the VM
+    const char **strs;
+    const size_t *lens;
+    bool *results;
+
+    batch_queue_t *queues;
+    int nthreads;
+} batch_job_t;
+
+typedef struct {
+    batch_job_t *job;
+    int id;
+} batch_worker_t;
+
+// take up to BATCH_GRAIN strings from our own queue
+bool batch_take(batch_queue_t *q, size_t *lo, size_t *hi) {
+    pthread_mutex_lock(&q->lock);
+    bool found = q->next < q->end;
+    if (found) {
+        *lo = q->next;
+        *hi = q->end - q->next > BATCH_GRAIN ? q->next + BATCH_GRAIN : q->end;
+        q->next = *hi;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+// move the back half of someone's queue into ours
+bool batch_steal(batch_job_t *job, int id) {
+    for (int i = 1; i < job->nthreads; i++) {
+        batch_queue_t *victim = &job->queues[(id + i) % job->nthreads];
+
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->end - victim->next;
+        size_t lo = 0, hi = 0;
+        if (left > 0) {
+            lo = victim->next + left / 2;
+            hi = victim->end;
+            victim->end = lo;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (hi > lo) {
+            batch_queue_t *q = &job->queues[id];
+            pthread_mutex_lock(&q->lock);
+            q->next = lo;
+            q->end = hi;
+            pthread_mutex_unlock(&q->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+void *batch_worker(void *arg) {
+    batch_job_t *job = ((batch_worker_t*) arg)->job;
+    int id = ((batch_worker_t*) arg)->id;
+
+    // the caller's JIT code if there is any, else a one word bitnfa
+    const bitnfa_t *bitnfa = job->jit == NULL && BITNFA_PREFERRED(job->prog) ? job->prog->bitnfa : NULL;
+    vm_scratch_t *scratch = job->jit == NULL && bitnfa == NULL ? vm_scratch_new(job->prog) : NULL;
+    backtrack_scratch_t *bt = scratch != NULL && job->prog->eps != NULL ? backtrack_scratch_new(job->prog) : NULL;
+
+    size_t lo, hi;
+    while (true) {
+        if (!batch_take(&job->queues[id], &lo, &hi)) {
+            if (!batch_steal(job, id)) break;
+            continue;
+        }
+
+        if (bitnfa != NULL) {
+            for (size_t i = lo; i < hi; i++)
+                job->results[i] = bitnfa_run_len(bitnfa, job->strs[i], job->lens[i]);
+        } else if (job->jit != NULL) {
+            for (size_t i = lo; i < hi; i++)
+                job->results[i] = job->jit(job->strs[i], job->lens[i]);
+        } else {
+            for (size_t i = lo; i < hi; i++) {
+                if (bt != NULL && BACKTRACK_FITS(job->prog, job->lens[i]))
+                    job->results[i] = backtrack_run(bt, job->strs[i], job->lens[i]);
+                else
+                    job->results[i] = vm_run_code(scratch, job->strs[i], job->lens[i]);
+            }
+        }
+    }
+
+    if (scratch != NULL) vm_scratch_free(scratch);
+    if (bt != NULL) backtrack_scratch_free(bt);
+    return NULL;
+}
+
+void rjit_match_batch_threads(vm_program_t *prog, match_len_fn_t jit,
+                              const char **strs, const size_t *lens,
+                              size_t count, bool *results, int nthreads) {
+    if (nthreads < 1) nthreads = 1;
+    if ((size_t) nthreads > count / BATCH_GRAIN + 1) nthreads = count / BATCH_GRAIN + 1;
+
+    batch_job_t job;
+    job.prog = prog;
+    job.jit = jit;
+    job.strs = strs;
+    job.lens = lens;
+    job.results = results;
+    job.nthreads = nthreads;
+    job.queues = (batch_queue_t*) malloc(nthreads * sizeof(batch_queue_t));
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&job.queues[i].lock, NULL);
+        job.queues[i].next = count * i / nthreads;
+        job.queues[i].end = count * (i + 1) / nthreads;
+    }
+
+    batch_worker_t *workers = (batch_worker_t*) malloc(nthreads * sizeof(batch_worker_t));
+    pthread_t *threads = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++) {
+        workers[i] = (batch_worker_t){.job = &job, .id = i};
+        // the calling thread is worker 0
+        if (i > 0) pthread_create(&threads[i], NULL, batch_worker, &workers[i]);
+    }
+    batch_worker(&workers[0]);
+    for (int i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_mutex_destroy(&job.queues[i].lock);
+    free(job.queues);
+    free(workers);
+    free(threads);
+}
+
+void rjit_match_batch(vm_program_t *prog, const char **strs, const size_t *lens,
+                      size_t count, bool *results) {
+    int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    rjit_match_batch_threads(prog, NULL, strs, lens, count, results, nthreads);
+}
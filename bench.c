@@ -0,0 +1,405 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <re2/re2.h>
+
+// rjit-bench: every engine, and RE2, over a matrix of patterns and corpora.
+//
+// A corpus is a set of strings and a cell is one pattern fully matched
+// against every string of one corpus. In each cell RE2 goes first, then each
+// rjit engine forced with RJIT_FORCE (and the plan's own pick, "auto"). An
+// engine that isn't there for the pattern, or for the corpus's longest
+// string, sits the cell out.
+//
+// An engine runs the corpus once to warm up (JIT code paged in, the lazy
+// DFA's states built) and has its results checked against RE2's. Then it
+// runs again until BENCH_MIN_REPS passes and the -t time are both done, and
+// the median pass is what's reported. Compile latency is the time for
+// rjit_regex_compile and rjit_scratch_new (the RE2 constructor for RE2),
+// averaged over as many as fit in BENCH_COMPILE_TIME.
+//
+// The JSON goes to stdout or -o, with a line per cell on stderr while it runs.
+
+#define BENCH_MIN_REPS 3
+#define BENCH_MAX_REPS 1000
+#define BENCH_COMPILE_TIME 0.02
+
+typedef struct {
+    const char *name;
+    const char *kind; // literal, alternation, class or pathological
+    const char *pattern;
+} bench_pattern_t;
+
+bench_pattern_t bench_patterns[] = {
+    {"refused", "literal", ".*connection refused.*"},
+    {"get-api", "literal", "GET /api/.*"},
+    {"severity", "alternation", ".*(error|warn|fatal|panic|timeout|refused|denied|killed).*"},
+    {"methods", "alternation", ".*(GET|POST|PUT|DELETE|PATCH|HEAD) /[a-z0-9/]* .*"},
+    {"ipv4", "class", ".*[0-9]+\\.[0-9]+\\.[0-9]+\\.[0-9]+.*"},
+    {"tokens", "class", "[a-z0-9_]+( [a-z0-9_]+)*"},
+    {"word", "class", "\\w+"},
+    {"nested-star", "pathological", "(a*)*b"},
+    {"a-or-aa", "pathological", "(a|aa)*c"},
+    {"nested-plus", "pathological", "(x+x+)+y"},
+};
+
+typedef struct {
+    const char *name;
+    char *data;
+    size_t *offsets; // string i is data[offsets[i], offsets[i+1])
+    int count;
+    int capacity;
+    size_t bytes;
+    size_t max_len;
+} bench_corpus_t;
+
+void bench_corpus_init(bench_corpus_t *c, const char *name, size_t bytes) {
+    c->name = name;
+    c->data = (char*) malloc(bytes + 4096);
+    c->capacity = 1024;
+    c->offsets = (size_t*) malloc(c->capacity * sizeof(size_t));
+    c->offsets[0] = 0;
+    c->count = 0;
+    c->bytes = 0;
+    c->max_len = 0;
+}
+
+void bench_corpus_add(bench_corpus_t *c, const char *str, size_t len) {
+    if (c->count + 1 == c->capacity) {
+        c->capacity *= 2;
+        c->offsets = (size_t*) realloc(c->offsets, c->capacity * sizeof(size_t));
+    }
+    memcpy(c->data + c->bytes, str, len);
+    c->bytes += len;
+    c->offsets[++c->count] = c->bytes;
+    if (len > c->max_len) c->max_len = len;
+}
+
+void bench_corpus_free(bench_corpus_t *c) {
+    free(c->data);
+    free(c->offsets);
+}
+
+const char *bench_pick(const char **words, int n) {
+    return words[rand() % n];
+}
+
+// lines of words from a small vocabulary
+void bench_corpus_synthetic(bench_corpus_t *c, size_t bytes) {
+    const char *words[] = {"hello", "world", "foo", "bar", "baz", "quux", "lorem", "ipsum",
+                           "dolor", "sit", "amet", "alpha", "beta", "gamma", "delta", "error"};
+    bench_corpus_init(c, "synthetic", bytes);
+    char line[256];
+    while (c->bytes < bytes) {
+        int len = 0, target = 40 + rand() % 80;
+        while (len < target) {
+            if (len > 0) line[len++] = ' ';
+            const char *w = bench_pick(words, 16);
+            memcpy(line + len, w, strlen(w));
+            len += strlen(w);
+        }
+        bench_corpus_add(c, line, len);
+    }
+}
+
+// web server log lines, a few of them errors
+void bench_corpus_log(bench_corpus_t *c, size_t bytes) {
+    const char *methods[] = {"GET", "GET", "GET", "POST", "PUT", "DELETE"};
+    const char *paths[] = {"/api/users", "/api/orders", "/static/app.js", "/index.html", "/api/items/history"};
+    const char *levels[] = {"INFO", "INFO", "INFO", "INFO", "WARN", "ERROR"};
+    const char *tails[] = {"ok", "ok", "ok", "slow response", "connection refused", "upstream timeout"};
+    bench_corpus_init(c, "log", bytes);
+    char line[256];
+    while (c->bytes < bytes) {
+        int i = rand() % 6;
+        int len = snprintf(line, sizeof(line), "2024-05-%02d 12:%02d:%02d [%s] %s %s/%d HTTP/1.1 from 10.%d.%d.%d in %dms %s",
+                           1 + rand() % 28, rand() % 60, rand() % 60, levels[i], bench_pick(methods, 6),
+                           bench_pick(paths, 5), rand() % 10000, rand() % 256, rand() % 256, rand() % 256,
+                           rand() % 2000, tails[i]);
+        bench_corpus_add(c, line, len);
+    }
+}
+
+// any bytes, '\0' and '\n' included
+void bench_corpus_random(bench_corpus_t *c, size_t bytes) {
+    bench_corpus_init(c, "random", bytes);
+    char buf[1024];
+    while (c->bytes < bytes) {
+        int len = 64 + rand() % 960;
+        for (int i = 0; i < len; i++) buf[i] = (char) (rand() & 255);
+        bench_corpus_add(c, buf, len);
+    }
+}
+
+// tokens and headers, 4 to 32 bytes
+void bench_corpus_short(bench_corpus_t *c, size_t bytes) {
+    const char *alphabet = "abcdefghijklmnopqrstuvwxyz0123456789_";
+    bench_corpus_init(c, "short", bytes);
+    char buf[32];
+    while (c->bytes < bytes) {
+        int len = 4 + rand() % 29;
+        for (int i = 0; i < len; i++) buf[i] = i > 0 && rand() % 8 == 0 ? ' ' : alphabet[rand() % 37];
+        bench_corpus_add(c, buf, len);
+    }
+}
+
+// runs of a or x, sometimes ending the way the pathological patterns want
+void bench_corpus_runs(bench_corpus_t *c, size_t bytes) {
+    bench_corpus_init(c, "runs", bytes);
+    char buf[256];
+    while (c->bytes < bytes) {
+        int len = 16 + rand() % 240;
+        char fill = rand() % 2 ? 'a' : 'x';
+        memset(buf, fill, len);
+        if (rand() % 4 == 0) buf[len - 1] = "bcy"[rand() % 3];
+        bench_corpus_add(c, buf, len);
+    }
+}
+
+double bench_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int bench_compare(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+void bench_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (const char *p = str; *p; p++) {
+        if (*p == '"' || *p == '\\') fputc('\\', out);
+        fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+// one engine's numbers for a cell
+typedef struct {
+    double compile_us;
+    double pass; // median, seconds
+    int reps;
+    long matches; // in one pass
+    long mismatches; // strings where it disagreed with RE2
+    rjit_engine_t picked; // for "auto", what the plan had come to at the end
+    const char *why;
+} bench_result_t;
+
+// engine -1 is RE2
+typedef struct {
+    const bench_pattern_t *pattern;
+    const bench_corpus_t *corpus;
+    const bool *expected; // RE2's answers, by string
+    double min_time;
+    rjit_engine_t engine;
+
+    rjit_regex_t *re;
+    rjit_scratch_t *scratch;
+    re2::RE2 *re2;
+} bench_cell_t;
+
+long bench_pass(bench_cell_t *cell, bool *results) {
+    const bench_corpus_t *c = cell->corpus;
+    long matches = 0;
+    for (int i = 0; i < c->count; i++) {
+        const char *str = c->data + c->offsets[i];
+        size_t len = c->offsets[i + 1] - c->offsets[i];
+        bool m = cell->re2 != NULL ? re2::RE2::FullMatch(re2::StringPiece(str, len), *cell->re2)
+                                   : rjit_match(cell->re, cell->scratch, str, len);
+        matches += m;
+        if (results != NULL) results[i] = m;
+    }
+    return matches;
+}
+
+re2::RE2::Options bench_re2_options() {
+    // bytes, like rjit, and . takes \n too
+    re2::RE2::Options opt;
+    opt.set_encoding(re2::RE2::Options::EncodingLatin1);
+    opt.set_dot_nl(true);
+    opt.set_log_errors(false);
+    return opt;
+}
+
+// false if the engine isn't there for this cell
+bool bench_run(bench_cell_t *cell, bench_result_t *res, bool *results) {
+    const char *pattern = cell->pattern->pattern;
+    bool is_re2 = (int) cell->engine < 0;
+    int flags = is_re2 ? 0 : RJIT_FORCE(cell->engine);
+
+    int compiles = 0;
+    double start = bench_time(), t;
+    do {
+        if (is_re2) {
+            delete new re2::RE2(pattern, bench_re2_options());
+        } else {
+            rjit_regex_t *re = rjit_regex_compile(pattern, flags);
+            rjit_scratch_free(rjit_scratch_new(re));
+            rjit_regex_free(re);
+        }
+        compiles++;
+        t = bench_time() - start;
+    } while (t < BENCH_COMPILE_TIME);
+    res->compile_us = t / compiles * 1e6;
+
+    cell->re = NULL;
+    cell->scratch = NULL;
+    cell->re2 = NULL;
+    if (is_re2) {
+        cell->re2 = new re2::RE2(pattern, bench_re2_options());
+    } else {
+        cell->re = rjit_regex_compile(pattern, flags);
+        cell->scratch = rjit_scratch_new(cell->re);
+        if (cell->engine != RJIT_ENGINE_AUTO &&
+            rjit_plan(cell->re, cell->scratch, cell->corpus->max_len, NULL) != cell->engine) {
+            rjit_scratch_free(cell->scratch);
+            rjit_regex_free(cell->re);
+            return false;
+        }
+    }
+
+    // warm up, and check
+    res->matches = bench_pass(cell, results);
+    res->mismatches = 0;
+    if (cell->expected != NULL) {
+        for (int i = 0; i < cell->corpus->count; i++)
+            res->mismatches += results[i] != cell->expected[i];
+    }
+
+    double *times = (double*) malloc(BENCH_MAX_REPS * sizeof(double));
+    double total = 0;
+    res->reps = 0;
+    while ((res->reps < BENCH_MIN_REPS || total < cell->min_time) && res->reps < BENCH_MAX_REPS) {
+        start = bench_time();
+        bench_pass(cell, NULL);
+        times[res->reps] = bench_time() - start;
+        total += times[res->reps++];
+    }
+    qsort(times, res->reps, sizeof(double), bench_compare);
+    res->pass = times[res->reps / 2];
+    free(times);
+
+    if (is_re2) {
+        delete cell->re2;
+    } else {
+        res->picked = rjit_plan(cell->re, cell->scratch, cell->corpus->max_len, &res->why);
+        rjit_scratch_free(cell->scratch);
+        rjit_regex_free(cell->re);
+    }
+    return true;
+}
+
+void usage() {
+    fprintf(stderr, "usage: rjit-bench [-o file] [-s MB] [-t seconds] [name]\n"
+                    "  -o  write the JSON here instead of stdout\n"
+                    "  -s  bytes in each corpus, in MB (default 2)\n"
+                    "  -t  time to keep repeating each measurement (default 0.1)\n"
+                    "  name  only the patterns, corpora or engines with this name\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    double corpus_mb = 2, min_time = 0.1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:s:t:")) != -1) {
+        if (opt == 'o') path = optarg;
+        else if (opt == 's') corpus_mb = atof(optarg);
+        else if (opt == 't') min_time = atof(optarg);
+        else usage();
+    }
+    if (argc - optind > 1 || corpus_mb <= 0 || min_time < 0) usage();
+    const char *only = optind < argc ? argv[optind] : NULL;
+
+    FILE *out = stdout;
+    if (path != NULL && (out = fopen(path, "w")) == NULL) {
+        perror(path);
+        return 2;
+    }
+
+    size_t bytes = (size_t) (corpus_mb * (1 << 20));
+    bench_corpus_t corpora[5];
+    srand(1);
+    bench_corpus_synthetic(&corpora[0], bytes);
+    bench_corpus_log(&corpora[1], bytes);
+    bench_corpus_random(&corpora[2], bytes);
+    bench_corpus_short(&corpora[3], bytes);
+    bench_corpus_runs(&corpora[4], bytes);
+    int ncorpora = sizeof(corpora) / sizeof(corpora[0]);
+    int npatterns = sizeof(bench_patterns) / sizeof(bench_patterns[0]);
+
+    fprintf(out, "{\n  \"min_time\": %g,\n  \"corpora\": [\n", min_time);
+    for (int c = 0; c < ncorpora; c++) {
+        fprintf(out, "    {\"name\": \"%s\", \"strings\": %d, \"bytes\": %zu, \"max_len\": %zu}%s\n",
+                corpora[c].name, corpora[c].count, corpora[c].bytes, corpora[c].max_len,
+                c + 1 < ncorpora ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"results\": [");
+
+    bool first = true;
+    for (int p = 0; p < npatterns; p++) {
+        for (int c = 0; c < ncorpora; c++) {
+            bench_corpus_t *corpus = &corpora[c];
+            bool cell_named = only == NULL || strcmp(only, bench_patterns[p].name) == 0 ||
+                              strcmp(only, corpus->name) == 0;
+            bool engine_named = false;
+            for (int e = RJIT_ENGINE_AUTO; e <= RJIT_ENGINE_VM; e++)
+                engine_named |= only != NULL && strcmp(only, rjit_engine_name((rjit_engine_t) e)) == 0;
+            if (!cell_named && !engine_named && strcmp(only, "re2") != 0) continue;
+
+            bool *expected = (bool*) malloc(corpus->count * sizeof(bool));
+            bool *results = (bool*) malloc(corpus->count * sizeof(bool));
+            double re2_pass = 0;
+
+            fprintf(stderr, "%-12s %-10s", bench_patterns[p].name, corpus->name);
+            // RE2 always, its answers are what the others are checked against
+            for (int e = -1; e <= RJIT_ENGINE_VM; e++) {
+                const char *name = e < 0 ? "re2" : rjit_engine_name((rjit_engine_t) e);
+                if (e >= 0 && !cell_named && strcmp(only, name) != 0) continue;
+
+                bench_cell_t cell = {&bench_patterns[p], corpus, e < 0 ? NULL : expected, min_time,
+                                     (rjit_engine_t) e, NULL, NULL, NULL};
+                bench_result_t res;
+                if (!bench_run(&cell, &res, e < 0 ? expected : results)) continue;
+                if (e < 0) re2_pass = res.pass;
+
+                double mb = corpus->bytes / res.pass / 1e6;
+                fprintf(stderr, " %s %.0f", name, mb);
+                if (res.mismatches > 0) fprintf(stderr, " (%ld wrong!)", res.mismatches);
+
+                fprintf(out, "%s\n    {\"pattern\": ", first ? "" : ",");
+                bench_json_string(out, bench_patterns[p].pattern);
+                fprintf(out, ", \"name\": \"%s\", \"kind\": \"%s\", \"corpus\": \"%s\", \"engine\": \"%s\",",
+                        bench_patterns[p].name, bench_patterns[p].kind, corpus->name, name);
+                fprintf(out, " \"compile_us\": %.2f, \"mb_per_sec\": %.2f, \"matches_per_sec\": %.0f,",
+                        res.compile_us, mb, res.matches / res.pass);
+                fprintf(out, " \"strings_per_sec\": %.0f, \"matches\": %ld, \"mismatches\": %ld, \"reps\": %d",
+                        corpus->count / res.pass, res.matches, res.mismatches, res.reps);
+                if (e >= 0 && re2_pass > 0) fprintf(out, ", \"vs_re2\": %.3f", re2_pass / res.pass);
+                if (e == RJIT_ENGINE_AUTO) {
+                    fprintf(out, ", \"picked\": \"%s\", \"why\": ", rjit_engine_name(res.picked));
+                    bench_json_string(out, res.why);
+                }
+                fprintf(out, "}");
+                first = false;
+            }
+            fprintf(stderr, "\n");
+            free(expected);
+            free(results);
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) fclose(out);
+    for (int c = 0; c < ncorpora; c++)
+        bench_corpus_free(&corpora[c]);
+    return 0;
+}
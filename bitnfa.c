@@ -0,0 +1,302 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Bit-parallel Glushkov automaton. Every consuming atom of the pattern is a
+// position (0 is the start), and the state after a byte is the set of
+// positions that could have consumed it, one bit each. There are no
+// epsilons in a Glushkov automaton, so a step is
+//
+//   state = follow(state) & masks[c]
+//
+// where masks[c] has the positions that take c, and follow() is the union
+// of the follow sets of the positions in the state.
+//
+// Most positions, like the bytes of a literal, are only followed by the
+// next one, and for those follow() is a shift as in Shift-And. The rest are
+// looked up a byte of the state at a time: follow[i][v] is the union of the
+// follow sets of the positions in byte chunks[i] of the state having the
+// bits of v, or nothing for the ones the shift takes care of. So a step is
+// a shift and one lookup per chunk, however many threads are live.
+//
+// Up to 64 positions the state is a word, past that it's 4 and the steps
+// use AVX2 when the CPU has it. The 4 word one loses to the JIT while few
+// threads are live, like (\w{1,100} )+, but on something like
+// (a|b)*a(a|b){40} dozens are, the DFA runs out of states, and it's several
+// times faster than the vm and the JIT (benchmark_bitnfa). That's when
+// rjit_plan picks it.
+
+typedef struct {
+    uint64_t w[4];
+} bitnfa_set_t;
+
+// first and last positions of a node, and whether it can be empty
+typedef struct {
+    bitnfa_set_t first;
+    bitnfa_set_t last;
+    bool nullable;
+} bitnfa_info_t;
+
+typedef struct {
+    int npositions;
+    bool overflow;
+    bitnfa_set_t follow[BITNFA_MAX_POSITIONS];
+    char_class_t bytes[BITNFA_MAX_POSITIONS];
+} bitnfa_builder_t;
+
+void bitnfa_set_or(bitnfa_set_t *a, const bitnfa_set_t *b) {
+    for (int i = 0; i < 4; i++) a->w[i] |= b->w[i];
+}
+
+// every position in `from` can be followed by every position in `to`
+void bitnfa_link(bitnfa_builder_t *b, const bitnfa_set_t *from, const bitnfa_set_t *to) {
+    for (int i = 0; i < 4; i++)
+        for (uint64_t x = from->w[i]; x != 0; x &= x - 1)
+            bitnfa_set_or(&b->follow[64 * i + __builtin_ctzll(x)], to);
+}
+
+void bitnfa_position(bitnfa_builder_t *b, const char_class_t *cls, bitnfa_info_t *out) {
+    memset(out, 0, sizeof(bitnfa_info_t));
+    if (b->npositions == BITNFA_MAX_POSITIONS) {
+        b->overflow = true;
+        return;
+    }
+    int p = b->npositions++;
+    b->bytes[p] = *cls;
+    out->first.w[p / 64] = out->last.w[p / 64] = (uint64_t) 1 << (p % 64);
+}
+
+// acc = acc followed by next
+void bitnfa_concat(bitnfa_builder_t *b, bitnfa_info_t *acc, const bitnfa_info_t *next) {
+    bitnfa_link(b, &acc->last, &next->first);
+    if (acc->nullable) bitnfa_set_or(&acc->first, &next->first);
+    if (next->nullable) bitnfa_set_or(&acc->last, &next->last);
+    else acc->last = next->last;
+    acc->nullable = acc->nullable && next->nullable;
+}
+
+void bitnfa_node(bitnfa_builder_t *b, regex_node_t *node, bitnfa_info_t *out) {
+    memset(out, 0, sizeof(bitnfa_info_t));
+    out->nullable = true;
+    if (b->overflow) return;
+
+    bitnfa_info_t el;
+    char_class_t cls;
+    if (node->tag == NODE_LITERAL) {
+        for (int i = 0; i < node->literal.length; i++) {
+            uint8_t c = node->literal.str[i];
+            memset(&cls, 0, sizeof(cls));
+            cls.bits[c >> 5] = (uint32_t) 1 << (c & 31);
+            bitnfa_position(b, &cls, &el);
+            bitnfa_concat(b, out, &el);
+        }
+
+    } else if (node->tag == NODE_ANY) {
+        memset(&cls, 0xff, sizeof(cls));
+        bitnfa_position(b, &cls, out);
+
+    } else if (node->tag == NODE_CHAR_CLASS || node->tag == NODE_SPECIAL_LITERAL) {
+        regex_node_class(node, &cls);
+        bitnfa_position(b, &cls, out);
+
+    } else if (node->tag == NODE_SEQUENCE) {
+        for (int i = 0; i < node->sequence.length; i++) {
+            bitnfa_node(b, node->sequence.list[i], &el);
+            bitnfa_concat(b, out, &el);
+        }
+
+    } else if (node->tag == NODE_ALTERNATE) {
+        out->nullable = false;
+        for (int i = 0; i < node->sequence.length; i++) {
+            bitnfa_node(b, node->sequence.list[i], &el);
+            bitnfa_set_or(&out->first, &el.first);
+            bitnfa_set_or(&out->last, &el.last);
+            out->nullable = out->nullable || el.nullable;
+        }
+
+    } else if (node->tag == NODE_GROUP) {
+        bitnfa_node(b, node->group.el, out);
+
+    } else if (node->tag == NODE_REPEAT) {
+        // like emit_node: copies for the counts, the last one loops if
+        // there's no upper bound. Only the language matters here, so the
+        // optional copies can just follow each other
+        int min = node->repeat.min, max = node->repeat.max;
+        int copies = max == -1 ? (min > 0 ? min : 1) : max;
+        for (int i = 0; i < copies && !b->overflow; i++) {
+            bitnfa_node(b, node->repeat.el, &el);
+            if (i == copies - 1 && max == -1) bitnfa_link(b, &el.last, &el.first);
+            if (i >= min) el.nullable = true;
+            bitnfa_concat(b, out, &el);
+        }
+    }
+}
+
+// NULL if the pattern has more than BITNFA_MAX_POSITIONS positions
+bitnfa_t *bitnfa_build(regex_node_t *node) {
+    bitnfa_builder_t *b = (bitnfa_builder_t*) calloc(1, sizeof(bitnfa_builder_t));
+    b->npositions = 1; // the start
+
+    bitnfa_info_t root;
+    bitnfa_node(b, node, &root);
+    if (b->overflow) {
+        free(b);
+        return NULL;
+    }
+    b->follow[0] = root.first;
+
+    bitnfa_t *nfa = (bitnfa_t*) calloc(1, sizeof(bitnfa_t));
+    int n = b->npositions;
+    int W = n <= 64 ? 1 : 4;
+    nfa->npositions = n;
+    nfa->nwords = W;
+
+    memcpy(nfa->accept, root.last.w, sizeof(nfa->accept));
+    if (root.nullable) nfa->accept[0] |= 1;
+
+    nfa->masks = (uint64_t*) calloc(256 * W, sizeof(uint64_t));
+    for (int p = 1; p < n; p++)
+        for (int c = 0; c < 256; c++)
+            if (CHAR_CLASS_HAS(&b->bytes[p], c)) nfa->masks[c * W + p / 64] |= (uint64_t) 1 << (p % 64);
+
+    // which positions the shift covers, and which bytes need a table.
+    // Positions nothing follows need neither
+    bool *lookup = (bool*) calloc(n, sizeof(bool));
+    bitnfa_set_t none;
+    memset(&none, 0, sizeof(none));
+    for (int p = 0; p < n; p++) {
+        bitnfa_set_t next = none;
+        if (p + 1 < n) next.w[(p + 1) / 64] = (uint64_t) 1 << ((p + 1) % 64);
+        if (memcmp(&b->follow[p], &none, sizeof(none)) == 0) {
+            continue;
+        } else if (memcmp(&b->follow[p], &next, sizeof(next)) == 0) {
+            nfa->shift[p / 64] |= (uint64_t) 1 << (p % 64);
+        } else {
+            lookup[p] = true;
+            if (nfa->nchunks == 0 || nfa->chunks[nfa->nchunks - 1] != p / 8)
+                nfa->chunks[nfa->nchunks++] = p / 8;
+        }
+    }
+
+    // each entry is the one without its lowest bit, plus that bit's position
+    nfa->follow = (uint64_t*) calloc(nfa->nchunks * 256 * W, sizeof(uint64_t));
+    for (int i = 0; i < nfa->nchunks; i++) {
+        for (int v = 1; v < 256; v++) {
+            uint64_t *entry = nfa->follow + (i * 256 + v) * W;
+            memcpy(entry, nfa->follow + (i * 256 + (v & (v - 1))) * W, W * sizeof(uint64_t));
+            int p = 8 * nfa->chunks[i] + __builtin_ctz(v);
+            if (p >= n || !lookup[p]) continue;
+            for (int j = 0; j < W; j++) entry[j] |= b->follow[p].w[j];
+        }
+    }
+
+    free(lookup);
+    free(b);
+    return nfa;
+}
+
+void bitnfa_free(bitnfa_t *nfa) {
+    free(nfa->masks);
+    free(nfa->follow);
+    free(nfa);
+}
+
+size_t bitnfa_size(const bitnfa_t *nfa) {
+    return sizeof(bitnfa_t) + (1 + nfa->nchunks) * 256 * nfa->nwords * sizeof(uint64_t);
+}
+
+bool bitnfa_run_word(const bitnfa_t *nfa, const uint8_t *p, const uint8_t *end) {
+    const uint64_t *follow = nfa->follow, *masks = nfa->masks;
+    const int *chunks = nfa->chunks;
+    int nchunks = nfa->nchunks;
+    uint64_t shift = nfa->shift[0];
+    uint64_t d = 1;
+    for (; p < end; p++) {
+        uint64_t f = (d & shift) << 1;
+        for (int i = 0; i < nchunks; i++)
+            f |= follow[i * 256 + ((d >> (8 * chunks[i])) & 255)];
+        d = f & masks[*p];
+        if (d == 0) return false;
+    }
+    return (d & nfa->accept[0]) != 0;
+}
+
+bool bitnfa_run_words(const bitnfa_t *nfa, const uint8_t *p, const uint8_t *end) {
+    const int W = 4;
+    uint64_t d[4] = {1, 0, 0, 0};
+    for (; p < end; p++) {
+        uint64_t f[4], carry = 0;
+        for (int j = 0; j < W; j++) {
+            uint64_t s = d[j] & nfa->shift[j];
+            f[j] = s << 1 | carry;
+            carry = s >> 63;
+        }
+        for (int i = 0; i < nfa->nchunks; i++) {
+            int k = nfa->chunks[i];
+            const uint64_t *entry = nfa->follow + (i * 256 + ((d[k / 8] >> (8 * (k % 8))) & 255)) * W;
+            for (int j = 0; j < W; j++) f[j] |= entry[j];
+        }
+        uint64_t any = 0;
+        for (int j = 0; j < W; j++) {
+            d[j] = f[j] & nfa->masks[*p * W + j];
+            any |= d[j];
+        }
+        if (any == 0) return false;
+    }
+    uint64_t acc = 0;
+    for (int j = 0; j < W; j++) acc |= d[j] & nfa->accept[j];
+    return acc != 0;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+bool bitnfa_run_avx2(const bitnfa_t *nfa, const uint8_t *p, const uint8_t *end) {
+    const __m256i *follow = (const __m256i*) nfa->follow, *masks = (const __m256i*) nfa->masks;
+    int nchunks = nfa->nchunks;
+    __m256i shift = _mm256_loadu_si256((const __m256i*) nfa->shift);
+    __m256i zero = _mm256_setzero_si256();
+    // the state, also as bytes for the lookups
+    union {
+        uint64_t w[4];
+        uint8_t b[32];
+    } d = {{1, 0, 0, 0}};
+    for (; p < end; p++) {
+        // a 256 bit shift by one: each word by one, and the top bit of the
+        // word below it
+        __m256i s = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) d.w), shift);
+        __m256i below = _mm256_blend_epi32(_mm256_permute4x64_epi64(s, 0x93), zero, 0x03);
+        __m256i f = _mm256_or_si256(_mm256_slli_epi64(s, 1), _mm256_srli_epi64(below, 63));
+        for (int i = 0; i < nchunks; i++)
+            f = _mm256_or_si256(f, _mm256_loadu_si256(follow + i * 256 + d.b[nfa->chunks[i]]));
+        __m256i next = _mm256_and_si256(f, _mm256_loadu_si256(masks + *p));
+        if (_mm256_testz_si256(next, next)) return false;
+        _mm256_storeu_si256((__m256i*) d.w, next);
+    }
+    __m256i acc = _mm256_loadu_si256((const __m256i*) nfa->accept);
+    __m256i last = _mm256_loadu_si256((const __m256i*) d.w);
+    return !_mm256_testz_si256(acc, last);
+}
+
+#endif
+
+// full match of data[0, len)
+bool bitnfa_run_len(const bitnfa_t *nfa, const char *data, size_t len) {
+    const uint8_t *p = (const uint8_t*) data, *end = p + len;
+    if (nfa->nwords == 1) return bitnfa_run_word(nfa, p, end);
+#if defined(__x86_64__)
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) return bitnfa_run_avx2(nfa, p, end);
+#endif
+    return bitnfa_run_words(nfa, p, end);
+}
+
+bool bitnfa_run(const bitnfa_t *nfa, const char *str) {
+    return bitnfa_run_len(nfa, str, strlen(str));
+}
@@ -0,0 +1,165 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// A cache of compiled patterns, shared by threads. Entries are in a chained
+// hash table by (pattern, flags) and in a list from most to least recently
+// used; when the bytes of the entries go over the budget the least recently
+// used ones are dropped.
+//
+// Entries are reference counted, so dropping one only takes the cache's
+// reference away and the regex is freed by whoever lets go of it last.
+// Misses compile without holding the lock.
+
+uint32_t rjit_cache_hash(const char *pattern, int flags) {
+    uint32_t h = 2166136261u;
+    for (const char *p = pattern; *p != '\0'; p++) {
+        h ^= (uint8_t) *p;
+        h *= 16777619u;
+    }
+    h ^= (uint32_t) flags;
+    h *= 16777619u;
+    return h;
+}
+
+rjit_cache_t *rjit_cache_create(size_t budget) {
+    rjit_cache_t *cache = (rjit_cache_t*) malloc(sizeof(rjit_cache_t));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->nbuckets = 64;
+    cache->buckets = (rjit_cache_entry_t**) calloc(cache->nbuckets, sizeof(rjit_cache_entry_t*));
+    cache->count = 0;
+    cache->newest = NULL;
+    cache->oldest = NULL;
+    cache->budget = budget;
+    cache->bytes = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    return cache;
+}
+
+void rjit_cache_release(rjit_cache_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        rjit_regex_free(entry->re);
+        free(entry);
+    }
+}
+
+rjit_cache_entry_t *rjit_cache_find(rjit_cache_t *cache, const char *pattern, int flags, uint32_t hash) {
+    rjit_cache_entry_t *e = cache->buckets[hash & (cache->nbuckets - 1)];
+    for (; e != NULL; e = e->chain) {
+        if (e->hash == hash && e->re->flags == flags && strcmp(e->re->pattern, pattern) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+void rjit_cache_unlink_lru(rjit_cache_t *cache, rjit_cache_entry_t *e) {
+    if (e->newer != NULL) e->newer->older = e->older;
+    else cache->newest = e->older;
+    if (e->older != NULL) e->older->newer = e->newer;
+    else cache->oldest = e->newer;
+}
+
+void rjit_cache_push_lru(rjit_cache_t *cache, rjit_cache_entry_t *e) {
+    e->newer = NULL;
+    e->older = cache->newest;
+    if (cache->newest != NULL) cache->newest->newer = e;
+    cache->newest = e;
+    if (cache->oldest == NULL) cache->oldest = e;
+}
+
+// out of the table and the list, and the cache's reference with it
+void rjit_cache_remove(rjit_cache_t *cache, rjit_cache_entry_t *e) {
+    rjit_cache_entry_t **p = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+    while (*p != e) p = &(*p)->chain;
+    *p = e->chain;
+
+    rjit_cache_unlink_lru(cache, e);
+    cache->count--;
+    cache->bytes -= e->bytes;
+    rjit_cache_release(e);
+}
+
+void rjit_cache_grow(rjit_cache_t *cache) {
+    int nbuckets = 2 * cache->nbuckets;
+    rjit_cache_entry_t **buckets = (rjit_cache_entry_t**) calloc(nbuckets, sizeof(rjit_cache_entry_t*));
+    for (int i = 0; i < cache->nbuckets; i++) {
+        rjit_cache_entry_t *e = cache->buckets[i];
+        while (e != NULL) {
+            rjit_cache_entry_t *chain = e->chain;
+            e->chain = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+            e = chain;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+}
+
+// the compiled pattern, with a reference for the caller
+rjit_cache_entry_t *rjit_cache_get(rjit_cache_t *cache, const char *pattern, int flags) {
+    uint32_t hash = rjit_cache_hash(pattern, flags);
+
+    pthread_mutex_lock(&cache->lock);
+    rjit_cache_entry_t *e = rjit_cache_find(cache, pattern, flags, hash);
+    if (e != NULL) {
+        cache->hits++;
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        rjit_cache_unlink_lru(cache, e);
+        rjit_cache_push_lru(cache, e);
+        pthread_mutex_unlock(&cache->lock);
+        return e;
+    }
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    rjit_cache_entry_t *fresh = (rjit_cache_entry_t*) malloc(sizeof(rjit_cache_entry_t));
+    fresh->re = rjit_regex_compile(pattern, flags);
+    if (fresh->re == NULL) {
+        free(fresh);
+        return NULL;
+    }
+    fresh->hash = hash;
+    fresh->bytes = rjit_regex_bytes(fresh->re) + sizeof(rjit_cache_entry_t);
+    fresh->refs = 2; // the caller and the cache
+
+    pthread_mutex_lock(&cache->lock);
+    // someone else may have compiled it in the meantime
+    e = rjit_cache_find(cache, pattern, flags, hash);
+    if (e != NULL) {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&cache->lock);
+        rjit_regex_free(fresh->re);
+        free(fresh);
+        return e;
+    }
+
+    if (cache->count >= cache->nbuckets) rjit_cache_grow(cache);
+    rjit_cache_entry_t **bucket = &cache->buckets[hash & (cache->nbuckets - 1)];
+    fresh->chain = *bucket;
+    *bucket = fresh;
+    rjit_cache_push_lru(cache, fresh);
+    cache->count++;
+    cache->bytes += fresh->bytes;
+
+    // over budget: drop from the old end, but keep what we just added
+    while (cache->bytes > cache->budget && cache->oldest != fresh) {
+        rjit_cache_remove(cache, cache->oldest);
+        cache->evictions++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return fresh;
+}
+
+// handles still out keep their entries alive
+void rjit_cache_free(rjit_cache_t *cache) {
+    while (cache->oldest != NULL)
+        rjit_cache_remove(cache, cache->oldest);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
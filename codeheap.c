@@ -0,0 +1,189 @@
+#include "rjit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <libkern/OSCacheControl.h>
+#endif
+
+// Where JIT code lives. Code is packed into chunks of CODE_HEAP_CHUNK bytes
+// (or one chunk of its own if it's bigger), bump allocated. A chunk goes
+// back to the system once everything in it has been freed; space freed in
+// a chunk that's still in use isn't reused before then.
+//
+// No page is ever writable and executable at once:
+//   Linux: the chunk is a memfd mapped twice, once RW (for copying code in)
+//          and once RX (for running it), so code can be added to a chunk
+//          while other threads run what's already there.
+//   macOS: MAP_JIT pages, writable only on the thread that's installing
+//          (pthread_jit_write_protect_np).
+//   else:  RWX pages, as before.
+//
+// Each piece of code is preceded by a header pointing at its chunk, which is
+// how code_heap_free() finds it.
+//
+// If the system won't give us a chunk, code_heap_install() returns NULL and
+// the caller goes without JIT code.
+
+#define CODE_HEAP_CHUNK (64 * 1024)
+#define CODE_HEAP_ALIGN 16
+
+typedef struct code_chunk_t {
+    struct code_chunk_t *prev;
+    struct code_chunk_t *next;
+    uint8_t *exec; // what runs
+    uint8_t *write; // the same memory, writable (== exec without dual mapping)
+    size_t size;
+    size_t used;
+    int live; // installed and not yet freed
+} code_chunk_t;
+
+typedef struct {
+    code_chunk_t *chunk;
+    size_t size; // of the code, not counting this header
+} code_header_t;
+
+#define CODE_HEADER_SIZE ((sizeof(code_header_t) + CODE_HEAP_ALIGN - 1) & ~(size_t) (CODE_HEAP_ALIGN - 1))
+
+static pthread_mutex_t code_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static code_chunk_t *code_heap_chunks = NULL;
+static size_t code_heap_mapped = 0;
+static size_t code_heap_used = 0;
+
+// NULL, so the caller can go on without the chunk
+void *code_heap_oom(const char *what) {
+    fprintf(stderr, "code heap: %s failed: %s\n", what, strerror(errno));
+    return NULL;
+}
+
+// NULL if the system won't map it
+code_chunk_t *code_chunk_map(size_t size) {
+#if defined(__linux__)
+    int fd = memfd_create("rjit-code", MFD_CLOEXEC);
+    if (fd < 0) return (code_chunk_t*) code_heap_oom("memfd_create");
+    if (ftruncate(fd, size) < 0) {
+        code_heap_oom("ftruncate");
+        close(fd);
+        return NULL;
+    }
+    void *w = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void *x = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    close(fd); // the mappings keep it alive
+    if (w == MAP_FAILED || x == MAP_FAILED) {
+        code_heap_oom("mmap");
+        if (w != MAP_FAILED) munmap(w, size);
+        if (x != MAP_FAILED) munmap(x, size);
+        return NULL;
+    }
+#else
+    int flags = MAP_ANON | MAP_PRIVATE;
+#ifdef MAP_JIT
+    flags |= MAP_JIT;
+#endif
+    void *x = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, flags, -1, 0);
+    if (x == MAP_FAILED) return (code_chunk_t*) code_heap_oom("mmap");
+    void *w = x;
+#endif
+
+    code_chunk_t *chunk = (code_chunk_t*) malloc(sizeof(code_chunk_t));
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->live = 0;
+    chunk->write = (uint8_t*) w;
+    chunk->exec = (uint8_t*) x;
+
+    code_heap_mapped += size;
+    return chunk;
+}
+
+void code_chunk_unmap(code_chunk_t *chunk) {
+    if (chunk->write != chunk->exec) munmap(chunk->write, chunk->size);
+    munmap(chunk->exec, chunk->size);
+    code_heap_mapped -= chunk->size;
+    free(chunk);
+}
+
+void *code_heap_install(const void *code, size_t size) {
+    size_t need = (CODE_HEADER_SIZE + size + CODE_HEAP_ALIGN - 1) & ~(size_t) (CODE_HEAP_ALIGN - 1);
+
+    pthread_mutex_lock(&code_heap_lock);
+
+    code_chunk_t *chunk = code_heap_chunks;
+    while (chunk != NULL && chunk->size - chunk->used < need)
+        chunk = chunk->next;
+
+    if (chunk == NULL) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t chunk_size = need > CODE_HEAP_CHUNK ? (need + page - 1) / page * page : CODE_HEAP_CHUNK;
+        chunk = code_chunk_map(chunk_size);
+        if (chunk == NULL) {
+            pthread_mutex_unlock(&code_heap_lock);
+            return NULL;
+        }
+        chunk->prev = NULL;
+        chunk->next = code_heap_chunks;
+        if (code_heap_chunks != NULL) code_heap_chunks->prev = chunk;
+        code_heap_chunks = chunk;
+    }
+
+    size_t offset = chunk->used;
+    chunk->used += need;
+    chunk->live++;
+    code_heap_used += need;
+
+    pthread_mutex_unlock(&code_heap_lock);
+
+    // the range is ours now, nobody else writes to it
+    code_header_t header = {.chunk = chunk, .size = size};
+    uint8_t *w = chunk->write + offset;
+    uint8_t *x = chunk->exec + offset + CODE_HEADER_SIZE;
+#ifdef __APPLE__
+    pthread_jit_write_protect_np(false);
+#endif
+    memcpy(w, &header, sizeof(header));
+    memcpy(w + CODE_HEADER_SIZE, code, size);
+#ifdef __APPLE__
+    pthread_jit_write_protect_np(true);
+    sys_icache_invalidate(x, size);
+#else
+    __builtin___clear_cache((char*) x, (char*) x + size);
+#endif
+
+    return x;
+}
+
+void code_heap_free(void *code) {
+    code_header_t header;
+    memcpy(&header, (uint8_t*) code - CODE_HEADER_SIZE, sizeof(header));
+    code_chunk_t *chunk = header.chunk;
+
+    pthread_mutex_lock(&code_heap_lock);
+
+    code_heap_used -= (CODE_HEADER_SIZE + header.size + CODE_HEAP_ALIGN - 1) & ~(size_t) (CODE_HEAP_ALIGN - 1);
+    if (--chunk->live == 0) {
+        if (chunk->prev != NULL) chunk->prev->next = chunk->next;
+        else code_heap_chunks = chunk->next;
+        if (chunk->next != NULL) chunk->next->prev = chunk->prev;
+        code_chunk_unmap(chunk);
+    }
+
+    pthread_mutex_unlock(&code_heap_lock);
+}
+
+size_t code_heap_size(const void *code) {
+    code_header_t header;
+    memcpy(&header, (const uint8_t*) code - CODE_HEADER_SIZE, sizeof(header));
+    return header.size;
+}
+
+void code_heap_stats(size_t *mapped, size_t *used) {
+    pthread_mutex_lock(&code_heap_lock);
+    *mapped = code_heap_mapped;
+    *used = code_heap_used;
+    pthread_mutex_unlock(&code_heap_lock);
+}
@@ -0,0 +1,307 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Lazily built DFA on top of the bytecode. A state is the sorted set of pcs
+// that a Thompson simulation would have on its list (consuming instructions
+// and match only, epsilons already followed). Each state owns a 256 entry
+// transition row which is filled in the first time a byte is seen, so on
+// repetitive input matching is one table lookup per byte.
+//
+// Everything lives in memory counted against `budget`. When a new state
+// doesn't fit, the cache is flushed and rebuilt from the current state. If
+// that keeps happening without making progress we give up and run the NFA.
+
+#define DFA_UNKNOWN -1
+#define DFA_DEAD 0 // the empty set, always state 0
+
+// bail out to the NFA if a flush happens before this many bytes per state
+#define DFA_MIN_BYTES_PER_STATE 10
+
+int dfa_state_cost(int pcs_length) {
+    // the state, its row, its pcs and its hash slots
+    return sizeof(dfa_state_t) + 256 * sizeof(int) + pcs_length * sizeof(int) + 2 * sizeof(int);
+}
+
+uint32_t dfa_hash(const int *pcs, int length) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        h ^= (uint32_t) pcs[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void dfa_clear_table(dfa_cache_t *dfa) {
+    for (int i = 0; i < dfa->table_capacity; i++)
+        dfa->table[i] = -1;
+}
+
+void dfa_table_insert(dfa_cache_t *dfa, int state) {
+    int mask = dfa->table_capacity - 1;
+    int i = dfa->states[state].hash & mask;
+    while (dfa->table[i] != -1) i = (i + 1) & mask;
+    dfa->table[i] = state;
+}
+
+// add a state for the (sorted) pcs, returns -1 if the budget is used up
+int dfa_add_state(dfa_cache_t *dfa, const int *pcs, int length, uint32_t hash) {
+    int cost = dfa_state_cost(length);
+    if (dfa->states_length > 0 && dfa->used + cost > dfa->budget) return -1;
+    dfa->used += cost;
+
+    if (dfa->states_length == dfa->states_capacity) {
+        dfa->states_capacity *= 2;
+        dfa->states = (dfa_state_t*) realloc(dfa->states, dfa->states_capacity * sizeof(dfa_state_t));
+        dfa->trans = (int*) realloc(dfa->trans, dfa->states_capacity * 256 * sizeof(int));
+    }
+    if (dfa->pcs_length + length > dfa->pcs_capacity) {
+        while (dfa->pcs_length + length > dfa->pcs_capacity) dfa->pcs_capacity *= 2;
+        dfa->pcs = (int*) realloc(dfa->pcs, dfa->pcs_capacity * sizeof(int));
+    }
+
+    int state = dfa->states_length++;
+    dfa_state_t *st = &dfa->states[state];
+    st->pcs_offset = dfa->pcs_length;
+    st->pcs_length = length;
+    st->hash = hash;
+    st->match = false;
+    for (int i = 0; i < length; i++) {
+        dfa->pcs[dfa->pcs_length++] = pcs[i];
+        if (dfa->prog->insts[pcs[i]].op == OP_MATCH) st->match = true;
+    }
+
+    int *row = dfa->trans + state * 256;
+    for (int c = 0; c < 256; c++)
+        row[c] = DFA_UNKNOWN;
+
+    // keep the hash table at most half full
+    if (2 * dfa->states_length > dfa->table_capacity) {
+        dfa->table_capacity *= 2;
+        dfa->table = (int*) realloc(dfa->table, dfa->table_capacity * sizeof(int));
+        dfa_clear_table(dfa);
+        for (int i = 0; i < dfa->states_length; i++)
+            dfa_table_insert(dfa, i);
+    } else {
+        dfa_table_insert(dfa, state);
+    }
+
+    return state;
+}
+
+// find or add the state for the (sorted) pcs, returns -1 if it doesn't fit
+int dfa_find_state(dfa_cache_t *dfa, const int *pcs, int length) {
+    uint32_t hash = dfa_hash(pcs, length);
+    int mask = dfa->table_capacity - 1;
+    for (int i = hash & mask; dfa->table[i] != -1; i = (i + 1) & mask) {
+        dfa_state_t *st = &dfa->states[dfa->table[i]];
+        if (st->hash == hash && st->pcs_length == length &&
+            memcmp(dfa->pcs + st->pcs_offset, pcs, length * sizeof(int)) == 0)
+            return dfa->table[i];
+    }
+    return dfa_add_state(dfa, pcs, length, hash);
+}
+
+// drop every state, leaving only the dead state
+void dfa_flush(dfa_cache_t *dfa) {
+    if (dfa->states_length > 1) {
+        dfa->flushes++;
+        dfa->flushed_states = dfa->states_length;
+    }
+
+    dfa->states_length = 0;
+    dfa->pcs_length = 0;
+    dfa->used = 0;
+    dfa->start = -1;
+    dfa_clear_table(dfa);
+
+    int dead = dfa_add_state(dfa, NULL, 0, dfa_hash(NULL, 0));
+    for (int c = 0; c < 256; c++)
+        dfa->trans[dead * 256 + c] = DFA_DEAD;
+}
+
+// follow JMP and SPLIT from `in`, writes the sorted consuming pcs to dfa->closure
+int dfa_closure(dfa_cache_t *dfa, const int *in, int in_length) {
+    vm_program_t *prog = dfa->prog;
+    int gen = ++dfa->mark_gen;
+    int sp = 0;
+
+    for (int i = 0; i < in_length; i++)
+        dfa->stack[sp++] = in[i];
+
+    while (sp > 0) {
+        int pc = dfa->stack[--sp];
+        if (dfa->mark[pc] == gen) continue;
+        dfa->mark[pc] = gen;
+
+        vm_inst_t inst = prog->insts[pc];
+        if (inst.op == OP_JMP) {
+            dfa->stack[sp++] = prog->label_table[inst.jmp_label];
+        } else if (inst.op == OP_SPLIT) {
+            dfa->stack[sp++] = prog->label_table[inst.split.label_2];
+            dfa->stack[sp++] = prog->label_table[inst.split.label_1];
+        } else if (inst.op == OP_SAVE) {
+            dfa->stack[sp++] = pc + 1;
+        }
+    }
+
+    int length = 0;
+    for (int pc = 0; pc < prog->insts_length; pc++) {
+        if (dfa->mark[pc] != gen) continue;
+        vm_opcode_t op = prog->insts[pc].op;
+        if (op == OP_LITERAL || op == OP_ANY || op == OP_CLASS || op == OP_MATCH)
+            dfa->closure[length++] = pc;
+    }
+    return length;
+}
+
+int dfa_start_state(dfa_cache_t *dfa) {
+    if (dfa->start < 0) {
+        int zero = 0;
+        int length = dfa_closure(dfa, &zero, 1);
+        dfa->start = dfa_find_state(dfa, dfa->closure, length);
+    }
+    return dfa->start;
+}
+
+// compute (and cache) the transition of `state` on c.
+// returns -1 if the new state doesn't fit even in an empty cache
+int dfa_transition(dfa_cache_t *dfa, int state, uint8_t c) {
+    vm_program_t *prog = dfa->prog;
+    dfa_state_t *st = &dfa->states[state];
+
+    int succ_length = 0;
+    for (int i = 0; i < st->pcs_length; i++) {
+        int pc = dfa->pcs[st->pcs_offset + i];
+        vm_inst_t inst = prog->insts[pc];
+        if ((inst.op == OP_LITERAL && (uint8_t) inst.literal.str[0] == c) || inst.op == OP_ANY ||
+            (inst.op == OP_CLASS && CHAR_CLASS_HAS(&prog->classes[inst.class_index], c)))
+            dfa->succ[succ_length++] = pc + 1;
+    }
+
+    int length = dfa_closure(dfa, dfa->succ, succ_length);
+    int next = dfa_find_state(dfa, dfa->closure, length);
+    if (next >= 0) {
+        dfa->trans[state * 256 + c] = next;
+        return next;
+    }
+
+    // out of room: start over, the caller only needs the new state
+    dfa_flush(dfa);
+    return dfa_find_state(dfa, dfa->closure, length);
+}
+
+dfa_cache_t *dfa_cache_create(vm_program_t *prog, size_t budget) {
+    dfa_cache_t *dfa = (dfa_cache_t*) malloc(sizeof(dfa_cache_t));
+    dfa->prog = prog;
+    dfa->budget = budget;
+
+    dfa->states_capacity = 16;
+    dfa->states = (dfa_state_t*) malloc(dfa->states_capacity * sizeof(dfa_state_t));
+    dfa->trans = (int*) malloc(dfa->states_capacity * 256 * sizeof(int));
+    dfa->pcs_capacity = 64;
+    dfa->pcs = (int*) malloc(dfa->pcs_capacity * sizeof(int));
+    dfa->table_capacity = 64;
+    dfa->table = (int*) malloc(dfa->table_capacity * sizeof(int));
+
+    int N = prog->insts_length;
+    dfa->mark = (int*) calloc(N, sizeof(int));
+    dfa->mark_gen = 0;
+    dfa->stack = (int*) malloc(3 * N * sizeof(int));
+    dfa->closure = (int*) malloc(N * sizeof(int));
+    dfa->succ = (int*) malloc(N * sizeof(int));
+
+    dfa->flushes = 0;
+    dfa->flushed_states = 0;
+    dfa->nfa_fallbacks = 0;
+    dfa_flush(dfa);
+
+    return dfa;
+}
+
+void dfa_cache_free(dfa_cache_t *dfa) {
+    free(dfa->states);
+    free(dfa->trans);
+    free(dfa->pcs);
+    free(dfa->table);
+    free(dfa->mark);
+    free(dfa->stack);
+    free(dfa->closure);
+    free(dfa->succ);
+    free(dfa);
+}
+
+// run the DFA over data[0, len), returns the state at the end, DFA_DEAD, or
+// -1 if we had to give up on the cache
+int dfa_final_state(dfa_cache_t *dfa, const char *data, size_t len) {
+    int s = dfa_start_state(dfa);
+    if (s < 0) return -1;
+
+    const int *trans = dfa->trans;
+    const uint8_t *sp = (const uint8_t*) data;
+    const uint8_t *end = sp + len;
+    const uint8_t *last_flush = sp;
+
+    for (; sp < end; sp++) {
+        uint8_t c = *sp;
+        int next = trans[s * 256 + c];
+        if (next > DFA_DEAD) {
+            s = next;
+            continue;
+        }
+        if (next == DFA_DEAD) return DFA_DEAD;
+
+        int flushes = dfa->flushes;
+        next = dfa_transition(dfa, s, c);
+        if (dfa->flushes != flushes) {
+            // flushing too often, the NFA will be faster
+            if (sp - last_flush < DFA_MIN_BYTES_PER_STATE * dfa->flushed_states) next = -1;
+            last_flush = sp;
+        }
+        if (next < 0) return -1;
+        if (next == DFA_DEAD) return DFA_DEAD;
+
+        trans = dfa->trans;
+        s = next;
+    }
+
+    return s;
+}
+
+bool dfa_run_len(dfa_cache_t *dfa, const char *data, size_t len) {
+    int s = dfa_final_state(dfa, data, len);
+    if (s < 0) {
+        dfa->nfa_fallbacks++;
+        return vm_run_len(dfa->prog, data, len);
+    }
+    return dfa->states[s].match;
+}
+
+bool dfa_run(dfa_cache_t *dfa, const char *str) {
+    return dfa_run_len(dfa, str, strlen(str));
+}
+
+// like vm_run_set_len: the match pcs in the final state say which patterns matched
+bool dfa_run_set_len(dfa_cache_t *dfa, const char *data, size_t len, uint64_t *matched) {
+    int s = dfa_final_state(dfa, data, len);
+    if (s < 0) {
+        dfa->nfa_fallbacks++;
+        return vm_run_set_len(dfa->prog, data, len, matched);
+    }
+
+    for (int i = 0; i < SET_WORDS(dfa->prog->npatterns); i++)
+        matched[i] = 0;
+
+    dfa_state_t *st = &dfa->states[s];
+    for (int i = 0; i < st->pcs_length; i++) {
+        vm_inst_t inst = dfa->prog->insts[dfa->pcs[st->pcs_offset + i]];
+        if (inst.op == OP_MATCH)
+            matched[inst.match_id / 64] |= (uint64_t) 1 << (inst.match_id % 64);
+    }
+    return st->match;
+}
+
+bool dfa_run_set(dfa_cache_t *dfa, const char *str, uint64_t *matched) {
+    return dfa_run_set_len(dfa, str, strlen(str), matched);
+}
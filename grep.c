@@ -0,0 +1,251 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// rjit-grep: print the lines of a file that contain a match.
+//
+// The file is mmapped and cut into newline aligned chunks. Worker threads
+// take chunks in order from a shared counter and put the matching lines in
+// the chunk's own buffer, and the main thread prints the buffers in chunk
+// order as they complete. The program, its prefilter and the JIT code are
+// shared read-only; the lists and history a search needs are on the
+// worker's stack, so that's all the per-worker scratch there is.
+//
+// With a required literal, lines are only looked at if the literal scan
+// lands in them.
+
+#define GREP_CHUNK (4 << 20)
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+
+    size_t count; // matching lines
+    bool done;
+} grep_output_t;
+
+typedef struct {
+    vm_program_t *prog;
+    search_fn_t search; // NULL to use regex_search
+    const literal_set_t *filter; // NULL if there's no required literal
+    bool count_only;
+
+    const char *text;
+    size_t *bounds; // chunk i is [bounds[i], bounds[i+1])
+    int nchunks;
+    grep_output_t *outputs;
+
+    int next_chunk;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} grep_job_t;
+
+void grep_append(grep_output_t *out, const char *str, size_t length) {
+    if (out->length + length > out->capacity) {
+        while (out->length + length > out->capacity)
+            out->capacity = out->capacity == 0 ? 4096 : 2 * out->capacity;
+        out->data = (char*) realloc(out->data, out->capacity);
+    }
+    memcpy(out->data + out->length, str, length);
+    out->length += length;
+}
+
+bool grep_line(grep_job_t *job, const char *line, size_t length) {
+    if (job->search != NULL) return job->search(line, length, NULL, NULL);
+    return regex_search(job->prog, line, length, NULL, NULL);
+}
+
+void grep_chunk(grep_job_t *job, int chunk) {
+    grep_output_t *out = &job->outputs[chunk];
+    const char *p = job->text + job->bounds[chunk];
+    const char *end = job->text + job->bounds[chunk + 1];
+
+    while (p < end) {
+        if (job->filter != NULL) {
+            // skip to the line with the next candidate (literals never contain '\n')
+            const char *cand = literal_set_find(job->filter, p, end);
+            if (cand == NULL) break;
+            while (cand > p && cand[-1] != '\n') cand--;
+            p = cand;
+        }
+
+        const char *eol = (const char*) memchr(p, '\n', end - p);
+        const char *line_end = eol != NULL ? eol : end;
+
+        if (grep_line(job, p, line_end - p)) {
+            out->count++;
+            if (!job->count_only) {
+                grep_append(out, p, line_end - p);
+                grep_append(out, "\n", 1);
+            }
+        }
+
+        p = eol != NULL ? eol + 1 : end;
+    }
+}
+
+void *grep_worker(void *arg) {
+    grep_job_t *job = (grep_job_t*) arg;
+
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        int chunk = job->next_chunk++;
+        pthread_mutex_unlock(&job->lock);
+        if (chunk >= job->nchunks) break;
+
+        grep_chunk(job, chunk);
+
+        pthread_mutex_lock(&job->lock);
+        job->outputs[chunk].done = true;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    return NULL;
+}
+
+void usage() {
+    fprintf(stderr, "usage: rjit-grep [-c] [-j threads] [-V] pattern file\n"
+                    "  -c  only print the number of matching lines\n"
+                    "  -j  worker threads (default: one per core)\n"
+                    "  -V  use the VM instead of the JIT\n"
+                    "no ^ or $ anchors: a pattern with them is refused, \\^ and \\$ are the bytes\n");
+    exit(2);
+}
+
+// an unescaped ^ or $ outside a class. The parser would take them as bytes,
+// where grep -E anchors, so rather than quietly disagree we refuse them
+bool grep_has_anchor(const char *p) {
+    bool in_class = false;
+    for (; *p != '\0'; p++) {
+        if (*p == '\\') {
+            if (p[1] == '\0') break;
+            p++;
+        } else if (in_class) {
+            if (*p == ']') in_class = false;
+        } else if (*p == '[') {
+            in_class = true;
+            // a ']' right at the start (after any ^) is a byte
+            if (p[1] == '^') p++;
+            if (p[1] == ']') p++;
+        } else if (*p == '^' || *p == '$') {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    int nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    bool count_only = false, use_vm = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "cj:V")) != -1) {
+        if (opt == 'c') count_only = true;
+        else if (opt == 'j') nthreads = atoi(optarg);
+        else if (opt == 'V') use_vm = true;
+        else usage();
+    }
+    if (argc - optind != 2 || nthreads < 1) usage();
+    const char *pattern = argv[optind];
+    const char *path = argv[optind + 1];
+
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        fprintf(stderr, "rjit-grep: %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+
+    size_t len = sb.st_size;
+    const char *text = "";
+    if (len > 0) {
+        text = (const char*) mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED) {
+            fprintf(stderr, "rjit-grep: mmap failed: %s\n", strerror(errno));
+            return 2;
+        }
+        madvise((void*) text, len, MADV_SEQUENTIAL);
+    }
+
+    if (grep_has_anchor(pattern)) {
+        fprintf(stderr, "rjit-grep: bad pattern, ^ and $ anchors aren't supported\n");
+        return 2;
+    }
+
+    grep_job_t job;
+    job.prog = regex_compile_bytecode(pattern);
+    if (job.prog == NULL) {
+        fprintf(stderr, "rjit-grep: bad pattern, or too big\n");
+        return 2;
+    }
+    job.search = use_vm ? NULL : regex_compile_search_jit(job.prog);
+    job.filter = NULL;
+    if (job.prog->prefilter != NULL) {
+        prefilter_t *pf = job.prog->prefilter;
+        job.filter = pf->prefix.length > 0 ? &pf->prefix : &pf->inner;
+    }
+    job.count_only = count_only;
+    job.text = text;
+
+    // newline aligned chunks
+    int capacity = 16;
+    job.bounds = (size_t*) malloc(capacity * sizeof(size_t));
+    job.bounds[0] = 0;
+    job.nchunks = 0;
+    while (job.bounds[job.nchunks] < len) {
+        size_t b = job.bounds[job.nchunks] + GREP_CHUNK;
+        if (b >= len) {
+            b = len;
+        } else {
+            const char *nl = (const char*) memchr(text + b, '\n', len - b);
+            b = nl != NULL ? nl - text + 1 : len;
+        }
+
+        if (job.nchunks + 2 > capacity) {
+            capacity *= 2;
+            job.bounds = (size_t*) realloc(job.bounds, capacity * sizeof(size_t));
+        }
+        job.bounds[++job.nchunks] = b;
+    }
+
+    job.outputs = (grep_output_t*) calloc(job.nchunks + 1, sizeof(grep_output_t));
+    job.next_chunk = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    if (nthreads > job.nchunks) nthreads = job.nchunks > 0 ? job.nchunks : 1;
+    pthread_t *threads = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, grep_worker, &job);
+
+    // print in order as the chunks finish
+    size_t count = 0;
+    for (int i = 0; i < job.nchunks; i++) {
+        pthread_mutex_lock(&job.lock);
+        while (!job.outputs[i].done)
+            pthread_cond_wait(&job.cond, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+
+        grep_output_t *out = &job.outputs[i];
+        if (out->length > 0) fwrite(out->data, 1, out->length, stdout);
+        count += out->count;
+        free(out->data);
+    }
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    if (count_only) printf("%zu\n", count);
+
+    return count > 0 ? 0 : 1;
+}
@@ -0,0 +1,1081 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <re2/re2.h>
+
+// tests and benchmarks, the `rjit` binary
+
+void test(const char *pattern) {
+    printf("Test pattern: %s\n", pattern);
+    
+    const char *pat = pattern, *error = NULL;
+
+    arena_t tree;
+    arena_init(&tree, 4096);
+    regex_node_t *node = regex_parse(&tree, &pat, &error);
+    if (node == NULL) {
+        printf(" > Error: %s\n", error);
+        arena_release(&tree);
+        return;
+    }
+    node = eliminate_single_seqs(node);
+    compress_literals(node);
+    regex_number_groups(node, 0);
+
+    printf(" > Reconstructed: ");
+    print_node(node);
+    printf("\n");
+    print_node_tree(node, 0);
+
+    prefilter_t *pf = prefilter_build(node);
+    if (pf != NULL) {
+        printf(" > Required prefix: ");
+        print_literal_set(&pf->prefix);
+        printf("\n > Required inner: ");
+        print_literal_set(&pf->inner);
+        printf("\n > Required suffix: ");
+        print_literal_set(&pf->suffix);
+        printf("\n");
+        free(pf);
+    }
+
+    arena_release(&tree);
+}
+
+// syntax errors and counts past REGEX_MAX_REPEAT don't compile, at any level
+void test_errors() {
+    const char *bad[] = {"a{1001}", "a{2,1001}", "a{3,2}", "a[", "[z-a]", "(a", "a\\", "\\q", "*a", "a**", "a)b", ")"};
+    const char *good[] = {"a{1000}", "a{", "a{x}", "a{1,", "[]a]", "a\\*"};
+    int nbad = sizeof(bad) / sizeof(bad[0]), ngood = sizeof(good) / sizeof(good[0]);
+    int wrong = 0;
+
+    rjit_cache_t *cache = rjit_cache_create(1 << 20);
+    for (int i = 0; i < nbad + ngood; i++) {
+        const char *pattern = i < nbad ? bad[i] : good[i - nbad];
+        vm_program_t *prog = regex_compile_bytecode(pattern);
+        vm_program_t *set = regex_compile_set(&pattern, 1);
+        rjit_regex_t *re = rjit_regex_compile(pattern, 0);
+        rjit_cache_entry_t *e = rjit_cache_get(cache, pattern, 0);
+        bool compiled = i >= nbad;
+        if ((prog != NULL) != compiled || (set != NULL) != compiled ||
+            (re != NULL) != compiled || (e != NULL) != compiled) {
+            printf("errors: %s %s\n", pattern, compiled ? "didn't compile" : "compiled");
+            wrong++;
+        }
+        if (prog != NULL) vm_program_free(prog);
+        if (set != NULL) vm_program_free(set);
+        if (re != NULL) rjit_regex_free(re);
+        if (e != NULL) rjit_cache_release(e);
+    }
+    rjit_cache_free(cache);
+    if (regex_compile_set(NULL, 0) != NULL) {
+        printf("errors: empty set compiled\n");
+        wrong++;
+    }
+    printf("errors: %d wrong\n", wrong);
+}
+
+// one-pass captures have to be the pike vm's, whichever way the pattern went
+void test_onepass() {
+    const char *patterns[] = {"(a?)|b?", "(x?)?|a", "(x{0})?|a", "(a|b)c", "(a*)(b*)", "x(y?)z"};
+    const char *strs[] = {"", "a", "b", "ac", "aab", "xz", "xyz"};
+    int bad = 0;
+
+    for (int p = 0; p < 6; p++) {
+        vm_program_t *prog = regex_compile_bytecode(patterns[p]);
+        for (int s = 0; s < 7; s++) {
+            size_t pike[6], onepass[6];
+            bool expected = pike_run(prog, strs[s], pike, 6);
+            bool found = prog->onepass != NULL ? onepass_run(prog->onepass, strs[s], onepass, 6) : expected;
+            if (prog->onepass != NULL && (found != expected || (found && memcmp(pike, onepass, sizeof(pike)) != 0))) {
+                printf("onepass: %s on \"%s\" differs from pike\n", patterns[p], strs[s]);
+                bad++;
+            }
+        }
+        vm_program_free(prog);
+    }
+    printf("onepass vs pike: %d bad\n", bad);
+}
+
+// sets and captures over (data, len), with '\0' inside the records
+void test_len() {
+    const char *patterns[] = {"a.b", "x\\W*y", "[^z]*"};
+    const char *recs[] = {"a\0b", "x\0\0y", "a\0bz", ""};
+    size_t lens[] = {3, 4, 4, 0};
+    uint64_t expected[] = {5, 6, 0, 4};
+    int bad = 0;
+
+    vm_program_t *set = regex_compile_set(patterns, 3);
+    set_len_fn_t fn = regex_compile_set_len_jit(set);
+    dfa_cache_t *dfa = dfa_cache_create(set, DFA_DEFAULT_BUDGET);
+    for (int r = 0; r < 4; r++) {
+        uint64_t vm = 0, d = 0, jit = expected[r];
+        vm_run_set_len(set, recs[r], lens[r], &vm);
+        dfa_run_set_len(dfa, recs[r], lens[r], &d);
+        if (fn != NULL) fn(recs[r], lens[r], &jit);
+        if (vm != expected[r] || d != expected[r] || jit != expected[r]) {
+            printf("len: set on record %d: vm %d dfa %d jit %d\n", r, (int) vm, (int) d, (int) jit);
+            bad++;
+        }
+    }
+    dfa_cache_free(dfa);
+    if (fn != NULL) code_heap_free((void*) fn);
+    vm_program_free(set);
+
+    vm_program_t *prog = regex_compile_bytecode("(a.)(b*)");
+    size_t want[] = {0, 4, 0, 2, 2, 4};
+    size_t pike[6], onepass[6], captures[6];
+    bool ok = pike_run_len(prog, "a\0bb", 4, pike, 6) && memcmp(pike, want, sizeof(want)) == 0;
+    ok = ok && vm_run_captures_len(prog, "a\0bb", 4, captures, 6) && memcmp(captures, want, sizeof(want)) == 0;
+    if (prog->onepass != NULL)
+        ok = ok && onepass_run_len(prog->onepass, "a\0bb", 4, onepass, 6) && memcmp(onepass, want, sizeof(want)) == 0;
+    if (!ok) {
+        printf("len: captures of (a.)(b*) on \"a\\0bb\" are wrong\n");
+        bad++;
+    }
+    vm_program_free(prog);
+    printf("len: %d bad\n", bad);
+}
+
+// searching a log where almost nothing matches
+void benchmark_search(const char *pattern) {
+    const char *line = "GET /static/img/logo.png HTTP/1.1 200 1532\n";
+    int line_len = strlen(line);
+    int len = 50 * 1000 * 1024;
+    char *text = (char*) malloc(len);
+    for (int i = 0; i < len; i++)
+        text[i] = line[i % line_len];
+    memcpy(text + len - 100, "world2", 6);
+
+    vm_program_t *prog = regex_compile_bytecode(pattern);
+    prefilter_t *pf = prog->prefilter;
+    search_fn_t search = regex_compile_search_jit(prog);
+    prog->prefilter = NULL;
+    search_fn_t search_nopf = regex_compile_search_jit(prog);
+    re2::RE2 re(pattern);
+
+    int niters = 5;
+    for (int k = 0; k < 5; k++) {
+        const char *names[] = {"vm", "vm + prefilter", "jit", "jit + prefilter", "re2"};
+        if ((k == 2 || k == 3) && search == NULL) continue;
+
+        size_t start = 0, end = 0;
+        bool found = false;
+        double total = 0;
+        for (int iter = 0; iter < niters; iter++) {
+            double t0 = (double) clock() / CLOCKS_PER_SEC;
+            if (k == 0 || k == 1) {
+                prog->prefilter = k == 1 ? pf : NULL;
+                found = regex_search(prog, text, len, &start, &end);
+            } else if (k == 2) {
+                found = search_nopf(text, len, &start, &end);
+            } else if (k == 3) {
+                found = search(text, len, &start, &end);
+            } else {
+                re2::StringPiece m;
+                found = re2::RE2::PartialMatch(re2::StringPiece(text, len), re, &m);
+                if (found) {
+                    start = m.data() - text;
+                    end = start + m.size();
+                }
+            }
+            double t1 = (double) clock() / CLOCKS_PER_SEC;
+            total += (t1 - t0);
+        }
+
+        printf("search (%s): %d [%zu, %zu), avg %f\n", names[k], found, start, end, total / niters);
+    }
+
+    prog->prefilter = pf;
+    free(text);
+}
+
+// the benchmark string fed in socket sized pieces
+void benchmark_stream(const char *pattern, const char *str) {
+    size_t len = strlen(str);
+    size_t chunk = 64 * 1024;
+    vm_program_t *prog = regex_compile_bytecode(pattern);
+    stream_fn_t jit = regex_compile_stream_jit(prog);
+
+    int niters = 3;
+    for (int k = 0; k < 2; k++) {
+        if (k == 1 && jit == NULL) continue;
+
+        bool result = false;
+        double total = 0;
+        for (int iter = 0; iter < niters; iter++) {
+            double start = (double) clock() / CLOCKS_PER_SEC;
+            rjit_stream_t *st = rjit_stream_begin(prog, k == 1 ? jit : NULL);
+            for (size_t off = 0; off < len; off += chunk)
+                rjit_stream_feed(st, str + off, len - off < chunk ? len - off : chunk);
+            result = rjit_stream_finish(st);
+            double end = (double) clock() / CLOCKS_PER_SEC;
+
+            total += (end - start);
+        }
+
+        printf("stream (%s, %zu byte chunks): %d, avg %f\n", k == 1 ? "jit" : "vm", chunk, result, total / niters);
+    }
+}
+
+// N classifier patterns against many short records, one pass vs one run each
+void benchmark_set() {
+    int nrecords = 5000, reclen = 64;
+    char *records = (char*) malloc(nrecords * (reclen + 1));
+    srand(1);
+    for (int r = 0; r < nrecords; r++) {
+        char *rec = records + r * (reclen + 1);
+        for (int i = 0; i < reclen; i++)
+            rec[i] = "abcdefghijklmnopqrstuvwxyz   "[rand() % 29];
+        rec[reclen] = '\0';
+        if (r % 4 == 0) {
+            char word[16];
+            int n = snprintf(word, sizeof(word), "w%dx", rand() % 256);
+            memcpy(rec + rand() % (reclen - n), word, n);
+        }
+    }
+
+    char patterns[256][32];
+    const char *pats[256];
+    for (int i = 0; i < 256; i++) {
+        snprintf(patterns[i], sizeof(patterns[i]), ".*w%dx.*", i);
+        pats[i] = patterns[i];
+    }
+
+    for (int n = 1; n <= 256; n *= 4) {
+        vm_program_t *progs[256];
+        for (int i = 0; i < n; i++)
+            progs[i] = regex_compile_bytecode(pats[i]);
+        vm_program_t *set = regex_compile_set(pats, n);
+        set_fn_t fn = regex_compile_set_jit(set);
+        dfa_cache_t *dfa = dfa_cache_create(set, DFA_DEFAULT_BUDGET);
+        uint64_t matched[SET_WORDS(256)];
+
+        double times[4] = {0};
+        long hits[4] = {0};
+        for (int k = 0; k < 4; k++) {
+            if (k == 2 && fn == NULL) continue;
+            double start = (double) clock() / CLOCKS_PER_SEC;
+            for (int r = 0; r < nrecords; r++) {
+                const char *rec = records + r * (reclen + 1);
+                if (k == 0) {
+                    for (int i = 0; i < n; i++) hits[k] += vm_run(progs[i], rec);
+                    continue;
+                }
+                if (k == 1) vm_run_set(set, rec, matched);
+                if (k == 2) fn(rec, matched);
+                if (k == 3) dfa_run_set(dfa, rec, matched);
+                for (int w = 0; w < SET_WORDS(n); w++)
+                    hits[k] += __builtin_popcountll(matched[w]);
+            }
+            double end = (double) clock() / CLOCKS_PER_SEC;
+            times[k] = end - start;
+        }
+
+        printf("set of %3d: separate vm %f (%ld), vm %f (%ld), jit %f (%ld), lazy dfa %f (%ld)\n",
+            n, times[0], hits[0], times[1], hits[1], times[2], hits[2], times[3], hits[3]);
+        // what one pass costs next to the n separate runs
+        printf("set of %3d: vs separate, vm %.2fx, jit %.2fx, lazy dfa %.2fx\n",
+            n, times[1] / times[0], times[2] / times[0], times[3] / times[0]);
+        dfa_cache_free(dfa);
+    }
+
+    free(records);
+}
+
+// wall clock, clock() adds up the time of every thread
+double wall_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void benchmark_batch() {
+    const char *pattern = "https?...(www.)?(example|test)(0|1|2|3).com.*(login|logout)";
+    const char *hosts[] = {"example", "test", "sample"};
+    const char *paths[] = {"login", "logout", "index", "search?q=abc", "static/app.js"};
+
+    int count = 1000000;
+    char *data = (char*) malloc(count * 64);
+    const char **strs = (const char**) malloc(count * sizeof(char*));
+    size_t *lens = (size_t*) malloc(count * sizeof(size_t));
+    bool *results = (bool*) malloc(count * sizeof(bool));
+
+    srand(1);
+    for (int i = 0; i < count; i++) {
+        char *s = data + i * 64;
+        int n = snprintf(s, 64, "http%s://%s%s%d.com/%s/%s",
+                         rand() % 2 ? "s" : "", rand() % 2 ? "www." : "",
+                         hosts[rand() % 3], rand() % 5, paths[rand() % 5], paths[rand() % 5]);
+        strs[i] = s;
+        lens[i] = n < 64 ? n : 63;
+    }
+
+    vm_program_t *prog = regex_compile_bytecode(pattern);
+    match_len_fn_t jit = regex_compile_len_jit(prog);
+
+    // one call per string, the old way
+    double start = wall_time();
+    long hits = 0;
+    for (int i = 0; i < count; i++) hits += vm_run_len(prog, strs[i], lens[i]);
+    double single = wall_time() - start;
+    printf("batch: vm_run_len per string %f (%ld), %.1f M/s\n", single, hits, count / single / 1e6);
+
+    // the same through a compiled regex and one scratch, no allocation per string
+    rjit_regex_t *re = rjit_regex_compile(pattern, 0);
+    rjit_scratch_t *scratch = rjit_scratch_new(re);
+    start = wall_time();
+    hits = 0;
+    for (int i = 0; i < count; i++) hits += rjit_match(re, scratch, strs[i], lens[i]);
+    double reused = wall_time() - start;
+    printf("batch: rjit_match with scratch %f (%ld), %.1f M/s\n", reused, hits, count / reused / 1e6);
+    rjit_scratch_free(scratch);
+    rjit_regex_free(re);
+
+    // thread count sweep, speed-up against one thread
+    const char *engine = BITNFA_PREFERRED(prog) ? "bitnfa" : "vm";
+    for (int k = 0; k < 2; k++) {
+        if (k == 1 && jit == NULL) continue;
+        double one = 0;
+        for (int nthreads = 1; nthreads <= 64; nthreads *= 2) {
+            start = wall_time();
+            rjit_match_batch_threads(prog, k == 0 ? NULL : jit, strs, lens, count, results, nthreads);
+            double t = wall_time() - start;
+            if (nthreads == 1) one = t;
+
+            hits = 0;
+            for (int i = 0; i < count; i++) hits += results[i];
+            printf("batch %-6s %2d threads: %f (%ld), %.1f M/s, %.2fx\n",
+                   k == 0 ? engine : "jit", nthreads, t, hits, count / t / 1e6, one / t);
+        }
+    }
+
+    free(data);
+    free(strs);
+    free(lens);
+    free(results);
+}
+
+// identifiers with a class against the alternation it replaces
+void benchmark_class() {
+    const char *patterns[] = {
+        "[a-z0-9_]+( [a-z0-9_]+)*",
+        "(a|b|c|d|e|f|g|h|i|j|k|l|m|n|o|p|q|r|s|t|u|v|w|x|y|z|0|1|2|3|4|5|6|7|8|9|_)+"
+        "( (a|b|c|d|e|f|g|h|i|j|k|l|m|n|o|p|q|r|s|t|u|v|w|x|y|z|0|1|2|3|4|5|6|7|8|9|_)+)*",
+    };
+
+    size_t len = 4 << 20;
+    char *str = (char*) malloc(len);
+    srand(1);
+    for (size_t i = 0; i < len; i++)
+        str[i] = i % 16 == 15 ? ' ' : "abcdefghijklmnopqrstuvwxyz0123456789_"[rand() % 37];
+    str[len - 1] = 'x';
+
+    for (int k = 0; k < 2; k++) {
+        vm_program_t *prog = regex_compile_bytecode(patterns[k]);
+        match_len_fn_t jit = regex_compile_len_jit(prog);
+
+        double start = wall_time();
+        bool vm = vm_run_len(prog, str, len);
+        double vm_time = wall_time() - start;
+
+        start = wall_time();
+        bool res = jit != NULL && jit(str, len);
+        double jit_time = wall_time() - start;
+
+        printf("class (%s): %d insts, vm %d %f, jit %d %f\n", k == 0 ? "class" : "alternation",
+               prog->insts_length, vm, vm_time, res, jit_time);
+
+        if (jit != NULL) code_heap_free((void*) jit);
+        vm_program_free(prog);
+    }
+    free(str);
+}
+
+// counted repetition is unrolled: compiling grows with the count, matching
+// shouldn't
+void benchmark_repeat() {
+    size_t len = 4 << 20;
+    char *str = (char*) malloc(len);
+    for (size_t i = 0; i < len; i++)
+        str[i] = i % 8 == 7 ? ' ' : 'a' + i % 8;
+
+    for (int n = 10; n <= 1000; n *= 10) {
+        char pattern[64];
+        snprintf(pattern, sizeof(pattern), "(\\w{1,%d} )+", n);
+
+        int ncompiles = 100;
+        double start = wall_time();
+        for (int i = 0; i < ncompiles; i++)
+            vm_program_free(regex_compile_bytecode(pattern));
+        double compile = (wall_time() - start) / ncompiles;
+
+        vm_program_t *prog = regex_compile_bytecode(pattern);
+        match_len_fn_t jit = regex_compile_len_jit(prog);
+
+        start = wall_time();
+        bool vm = vm_run_len(prog, str, len);
+        double vm_time = wall_time() - start;
+
+        start = wall_time();
+        bool res = jit != NULL && jit(str, len);
+        double jit_time = wall_time() - start;
+
+        printf("repeat %s: %d insts, compile %.1fus, vm %d %f, jit %d %f\n", pattern,
+               prog->insts_length, compile * 1e6, vm, vm_time, res, jit_time);
+
+        if (jit != NULL) code_heap_free((void*) jit);
+        vm_program_free(prog);
+    }
+    free(str);
+}
+
+// the bit-parallel automaton against the vm and the JIT, on text each
+// pattern matches so nobody gets to stop early
+void benchmark_bitnfa() {
+    const char *patterns[] = {
+        "(hello|world(0|1|2|3)?)+",
+        "[a-z0-9_]+( [a-z0-9_]+)*",
+        "(a|b)*abb(a|b)(a|b)(a|b)(a|b)(a|b)",
+        "(\\w{1,30} )+",
+        "(\\w{1,100} )+",
+        "(\\w{1,200} )+",
+        "((GET|POST|PUT|DELETE) /api/v[0-9]+/(users|orders|items|carts)/[0-9]+/(details|history) HTTP/1.[01];)+",
+        // 4 words with dozens of live threads, where the dfa gives up
+        "(a|b)*a(a|b){40}",
+    };
+    int npatterns = sizeof(patterns) / sizeof(patterns[0]);
+    const char *request = "PUT /api/v2/orders/1234/history HTTP/1.1;";
+    size_t request_len = strlen(request);
+
+    size_t size = 4 << 20;
+    char *str = (char*) malloc(size);
+    srand(1);
+    for (int p = 0; p < npatterns; p++) {
+        size_t len = size;
+        for (size_t i = 0; i < len; i++) {
+            if (p == 0) str[i] = "hello"[i % 5];
+            else if (p == 2 || p == 7) str[i] = "ab"[rand() % 2];
+            else if (p == 6) str[i] = request[i % request_len];
+            else str[i] = i % 16 == 15 ? ' ' : "abcdefghijklmnopqrstuvwxyz0123456789_"[rand() % 37];
+        }
+        if (p == 2) memcpy(str + len - 8, "abbaaaaa", 8);
+        if (p == 7) str[len - 41] = 'a';
+        if (p >= 3 && p <= 5) str[len - 1] = ' ';
+        if (p == 6) len -= len % request_len;
+
+        vm_program_t *prog = regex_compile_bytecode(patterns[p]);
+        match_len_fn_t jit = regex_compile_len_jit(prog);
+
+        double start = wall_time();
+        bool vm = vm_run_len(prog, str, len);
+        double vm_time = wall_time() - start;
+
+        start = wall_time();
+        bool res = jit != NULL && jit(str, len);
+        double jit_time = wall_time() - start;
+
+        start = wall_time();
+        bool bit = prog->bitnfa != NULL && bitnfa_run_len(prog->bitnfa, str, len);
+        double bit_time = wall_time() - start;
+
+        // what rjit_match picks once the dfa has had a go at it
+        rjit_regex_t *re = rjit_regex_compile(patterns[p], 0);
+        rjit_scratch_t *scratch = rjit_scratch_new(re);
+        rjit_match(re, scratch, str, len);
+        rjit_engine_t engine = rjit_plan(re, scratch, len, NULL);
+        rjit_scratch_free(scratch);
+        rjit_regex_free(re);
+
+        printf("bitnfa %s: %d insts, %d positions in %d words, vm %d %f, jit %d %f, bitnfa %d %f, planned %s\n",
+               patterns[p], prog->insts_length, prog->bitnfa->npositions, prog->bitnfa->nwords,
+               vm, vm_time, res, jit_time, bit, bit_time, rjit_engine_name(engine));
+
+        if (jit != NULL) code_heap_free((void*) jit);
+        vm_program_free(prog);
+    }
+    free(str);
+}
+
+// the vm with a switch over prog->insts against the direct threaded one
+// over prog->code, same scratch
+void benchmark_threaded() {
+    const char *patterns[] = {
+        "(hello|world(0|1|2|3)?)+",
+        "[a-z0-9_]+( [a-z0-9_]+)*",
+        "(a|b)*abb(a|b)(a|b)(a|b)(a|b)(a|b)",
+        ".*(error|warn|fatal).*timeout.*",
+    };
+    int npatterns = sizeof(patterns) / sizeof(patterns[0]);
+
+    size_t len = 4 << 20;
+    char *str = (char*) malloc(len);
+    srand(1);
+    for (int p = 0; p < npatterns; p++) {
+        for (size_t i = 0; i < len; i++) {
+            if (p == 0) str[i] = "hello"[i % 5];
+            else if (p == 2) str[i] = "ab"[rand() % 2];
+            else str[i] = i % 16 == 15 ? ' ' : "abcdefghijklmnopqrstuvwxyz0123456789_"[rand() % 37];
+        }
+        if (p == 2) memcpy(str + len - 8, "abbaaaaa", 8);
+        if (p == 3) memcpy(str + len / 2, "error timeout", 13);
+
+        vm_program_t *prog = regex_compile_bytecode(patterns[p]);
+        vm_scratch_t *s = vm_scratch_new(prog);
+
+        double start = wall_time();
+        bool sw = vm_run_scratch(s, str, len);
+        double switch_time = wall_time() - start;
+
+        start = wall_time();
+        bool threaded = vm_run_code(s, str, len);
+        double threaded_time = wall_time() - start;
+
+        printf("threaded %s: %d insts, switch %d %f, threaded %d %f\n",
+               patterns[p], prog->insts_length, sw, switch_time, threaded, threaded_time);
+
+        vm_scratch_free(s);
+        vm_program_free(prog);
+    }
+    free(str);
+}
+
+// a lone thread in the JIT taking literal runs in one step, against the same
+// program with every run cut to one byte
+void benchmark_literal_runs() {
+    const char *patterns[] = {
+        "(GET /static/img/logo.png HTTP/1.1 200 1532\n)+",
+        "(GET /(static|api)/img/logo.png HTTP/1.1 (200|404) [0-9]+\n)+",
+        "(hello|world(0|1|2|3)?)+",
+    };
+    const char *lines[] = {
+        "GET /static/img/logo.png HTTP/1.1 200 1532\n",
+        "GET /static/img/logo.png HTTP/1.1 200 1532\n",
+        "helloworld1",
+    };
+
+    size_t len = 50 << 20;
+    char *str = (char*) malloc(len);
+    for (int p = 0; p < 3; p++) {
+        size_t line_len = strlen(lines[p]);
+        size_t n = len - len % line_len;
+        for (size_t i = 0; i < n; i++)
+            str[i] = lines[p][i % line_len];
+
+        vm_program_t *prog = regex_compile_bytecode(patterns[p]);
+        match_len_fn_t runs = regex_compile_len_jit(prog);
+        for (int i = 0; i < prog->insts_length; i++)
+            if (prog->insts[i].op == OP_LITERAL) prog->insts[i].literal.length = 1;
+        match_len_fn_t bytes = regex_compile_len_jit(prog);
+        if (runs == NULL || bytes == NULL) break;
+
+        double start = wall_time();
+        bool res_bytes = bytes(str, n);
+        double bytes_time = wall_time() - start;
+
+        start = wall_time();
+        bool res_runs = runs(str, n);
+        double runs_time = wall_time() - start;
+
+        printf("literal runs %d: jit a byte a step %d %f, runs %d %f\n", p, res_bytes, bytes_time,
+               res_runs, runs_time);
+
+        code_heap_free((void*) runs);
+        code_heap_free((void*) bytes);
+        vm_program_free(prog);
+    }
+    free(str);
+}
+
+// vm_run_code stepping between consuming instructions with the epsilon
+// closures, against the same program with them taken away so jmps and splits
+// go on the lists. Threads is what went on (and came off) the lists, per byte
+void benchmark_closures() {
+    const char *patterns[] = {
+        "(hello|world(0|1|2|3)?)+",
+        "[a-z0-9_]+( [a-z0-9_]+)*",
+        "(a|b)*abb(a|b)(a|b)(a|b)(a|b)(a|b)",
+        ".*(error|warn|fatal).*timeout.*",
+    };
+    int npatterns = sizeof(patterns) / sizeof(patterns[0]);
+
+    size_t len = 4 << 20;
+    char *str = (char*) malloc(len);
+    srand(1);
+    for (int p = 0; p < npatterns; p++) {
+        for (size_t i = 0; i < len; i++) {
+            if (p == 0) str[i] = "hello"[i % 5];
+            else if (p == 2) str[i] = "ab"[rand() % 2];
+            else str[i] = i % 16 == 15 ? ' ' : "abcdefghijklmnopqrstuvwxyz0123456789_"[rand() % 37];
+        }
+        if (p == 2) memcpy(str + len - 8, "abbaaaaa", 8);
+        if (p == 3) memcpy(str + len / 2, "error timeout", 13);
+
+        vm_program_t *prog = regex_compile_bytecode(patterns[p]);
+        vm_scratch_t *s = vm_scratch_new(prog);
+
+        double start = wall_time();
+        bool closed = vm_run_code(s, str, len);
+        double closed_time = wall_time() - start;
+        double closed_threads = (double) s->threads / len;
+
+        int *eps = prog->eps;
+        prog->eps = NULL;
+        s->threads = 0;
+        start = wall_time();
+        bool open = vm_run_code(s, str, len);
+        double open_time = wall_time() - start;
+        double open_threads = (double) s->threads / len;
+        prog->eps = eps;
+
+        printf("closures %s: without %d %.2f threads/byte %f, with %d %.2f threads/byte %f\n",
+               patterns[p], open, open_threads, open_time, closed, closed_threads, closed_time);
+
+        vm_scratch_free(s);
+        vm_program_free(prog);
+    }
+    free(str);
+}
+
+// short strings, like header lines and tokens, where the backtracker fits:
+// vm_run_code against backtrack_run against the JIT, same strings
+void benchmark_backtrack() {
+    const char *patterns[] = {
+        "[A-Za-z-]+: .*(gzip|br).*",
+        "(GET|POST|PUT|DELETE) /[a-z0-9/]*(\\?[a-z=&]*)? HTTP/1\\.[01]",
+        "[a-z0-9_]+( [a-z0-9_]+)*",
+        "(a|b)*abb(a|b)(a|b)(a|b)(a|b)(a|b)",
+    };
+    const char *samples[] = {
+        "Accept-Encoding: deflate, gzip;q=1.0",
+        "GET /index/page2?lang=en HTTP/1.1",
+        "the quick brown fox jumps",
+        "abababbbaabbabbbab",
+    };
+    int npatterns = sizeof(patterns) / sizeof(patterns[0]);
+
+    int nstrs = 1 << 18;
+    for (int p = 0; p < npatterns; p++) {
+        vm_program_t *prog = regex_compile_bytecode(patterns[p]);
+        vm_scratch_t *vm = vm_scratch_new(prog);
+        backtrack_scratch_t *bt = backtrack_scratch_new(prog);
+        match_scratch_fn_t jit = (match_scratch_fn_t) jit_compile(prog, JIT_MATCH_SCRATCH);
+        void *jit_scratch = malloc(MATCH_JIT_SCRATCH_SIZE(prog->insts_length));
+
+        // the sample with one byte changed here and there
+        size_t len = strlen(samples[p]);
+        char str[64];
+        memcpy(str, samples[p], len);
+
+        int counts[3] = {0, 0, 0};
+        double times[3];
+        for (int e = 0; e < 3; e++) {
+            srand(1);
+            double start = wall_time();
+            for (int i = 0; i < nstrs; i++) {
+                int k = rand() % len;
+                char was = str[k];
+                if (i % 2) str[k] = 'x';
+                bool m = e == 0 ? vm_run_code(vm, str, len)
+                       : e == 1 ? backtrack_run(bt, str, len)
+                       : jit(str, len, jit_scratch);
+                counts[e] += m;
+                str[k] = was;
+            }
+            times[e] = wall_time() - start;
+        }
+
+        printf("backtrack %s: %d insts, %zu bytes, vm %d %f, backtrack %d %f, jit %d %f\n",
+               patterns[p], prog->insts_length, len, counts[0], times[0], counts[1], times[1],
+               counts[2], times[2]);
+
+        code_heap_free((void*) jit);
+        free(jit_scratch);
+        backtrack_scratch_free(bt);
+        vm_scratch_free(vm);
+        vm_program_free(prog);
+    }
+}
+
+// rjit_match with rjit_plan picking the engine, against each engine forced,
+// for a few short strings on a new scratch, many short strings and long
+// strings. Prints what the plan picked and why
+void benchmark_plan() {
+    const char *patterns[] = {
+        "[a-z0-9_]+( [a-z0-9_]+)*",
+        ".*(error|warn|fatal).*timeout.*",
+        "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)",
+        "\\w{1,200}",
+    };
+    int npatterns = sizeof(patterns) / sizeof(patterns[0]);
+    size_t lens[] = {32, 32, 1 << 20};
+    int counts[] = {64, (16 << 20) / 32, 16};
+
+    for (int p = 0; p < npatterns; p++) {
+        for (int l = 0; l < 3; l++) {
+            size_t len = lens[l];
+            int reps = counts[l];
+            // the few strings on a new scratch are all different
+            size_t stride = l == 0 ? len : 0;
+            size_t size = len + (reps - 1) * stride;
+            char *str = (char*) malloc(size);
+            srand(1);
+            for (size_t i = 0; i < size; i++) {
+                if (p == 2) str[i] = "ab"[rand() % 2];
+                else str[i] = i % 16 == 15 ? ' ' : "abcdefghijklmnopqrstuvwxyz0123456789_"[rand() % 37];
+            }
+
+            printf("plan %s, %d x %zu bytes:", patterns[p], reps, len);
+            for (int e = RJIT_ENGINE_AUTO; e <= RJIT_ENGINE_VM; e++) {
+                rjit_regex_t *re = rjit_regex_compile(patterns[p], RJIT_FORCE(e));
+                rjit_scratch_t *s = rjit_scratch_new(re);
+                const char *why;
+                rjit_engine_t engine = rjit_plan(re, s, len, &why);
+                if (e != RJIT_ENGINE_AUTO && engine != e) {
+                    printf(" %s -", rjit_engine_name((rjit_engine_t) e));
+                } else {
+                    int count = 0;
+                    double start = wall_time();
+                    for (int r = 0; r < reps; r++)
+                        count += rjit_match(re, s, str + r * stride, len);
+                    double t = wall_time() - start;
+                    printf(" %s %d %f", rjit_engine_name((rjit_engine_t) e), count, t);
+                }
+                if (e == RJIT_ENGINE_AUTO) {
+                    // after a run, the dfa may have given up by now
+                    engine = rjit_plan(re, s, len, &why);
+                    printf(" (%s: %s)", rjit_engine_name(engine), why);
+                }
+                rjit_scratch_free(s);
+                rjit_regex_free(re);
+            }
+            printf("\n");
+            free(str);
+        }
+    }
+}
+
+// compiling patterns the way a service taking them from users would
+void benchmark_compile() {
+    const char *patterns[] = {
+        "abc",
+        "(hello|world(0|1|2|3)?)+",
+        "https?...(www.)?(example|test)(0|1|2|3).com.*(login|logout)",
+        ".*(error|warn|fatal).*timeout.*",
+        "(a|b)*abb(a|b)(a|b)(a|b)(a|b)(a|b)",
+    };
+    int npatterns = sizeof(patterns) / sizeof(patterns[0]);
+
+    for (int p = 0; p < npatterns; p++) {
+        int iters = 20000;
+        double start = wall_time();
+        for (int i = 0; i < iters; i++)
+            vm_program_free(regex_compile_bytecode(patterns[p]));
+        double t = wall_time() - start;
+
+        vm_program_t *prog = regex_compile_bytecode(patterns[p]);
+        size_t bytes = sizeof(vm_program_t) + prog->arena.bytes;
+        printf("compile: %-60s %8.0f patterns/s, %d insts, %zu bytes%s\n",
+               patterns[p], iters / t, prog->insts_length, bytes,
+               prog->onepass != NULL ? " + one-pass tables" : "");
+        vm_program_free(prog);
+    }
+}
+
+// lots of small JIT'd patterns, as at the start of a service
+void benchmark_code_heap() {
+    int count = 10000;
+    vm_program_t **progs = (vm_program_t**) malloc(count * sizeof(vm_program_t*));
+    void **code = (void**) malloc(count * sizeof(void*));
+    char pattern[64];
+
+    double start = wall_time();
+    for (int i = 0; i < count; i++) {
+        snprintf(pattern, sizeof(pattern), "w%dx.*(a|b%d)+", i, i % 7);
+        progs[i] = regex_compile_bytecode(pattern);
+        code[i] = jit_compile(progs[i], JIT_MATCH_LEN);
+    }
+    double t = wall_time() - start;
+
+    size_t mapped, used;
+    code_heap_stats(&mapped, &used);
+    long page = sysconf(_SC_PAGESIZE);
+    printf("code heap: %d patterns in %f, %zu KB mapped for %zu KB of code (a page each: %ld KB)\n",
+           count, t, mapped / 1024, used / 1024, count * page / 1024);
+
+    match_len_fn_t fn = (match_len_fn_t) code[count - 1];
+    printf("code heap: last one still runs: %d\n", fn("w9999xab3", 9));
+
+    for (int i = 0; i < count; i++) {
+        code_heap_free(code[i]);
+        vm_program_free(progs[i]);
+    }
+    code_heap_stats(&mapped, &used);
+    printf("code heap: after freeing, %zu KB mapped\n", mapped / 1024);
+
+    free(progs);
+    free(code);
+}
+
+// the same few patterns compiled over and over, with and without the cache
+void benchmark_cache() {
+    int npatterns = 200, iters = 20000;
+    char patterns[200][48];
+    for (int i = 0; i < npatterns; i++)
+        snprintf(patterns[i], sizeof(patterns[i]), "(GET|POST)%d.*(login|logout)(0|1)?", i);
+
+    double start = wall_time();
+    for (int i = 0; i < iters; i++)
+        rjit_regex_free(rjit_regex_compile(patterns[i % npatterns], 0));
+    double t = wall_time() - start;
+    printf("cache: compiling every time %f us per pattern\n", t / iters * 1e6);
+
+    // room for about 32 of them, so the LRU has work to do
+    rjit_regex_t *probe = rjit_regex_compile(patterns[0], 0);
+    size_t budget = rjit_regex_bytes(probe) * 32;
+    rjit_regex_free(probe);
+
+    for (int k = 0; k < 2; k++) {
+        rjit_cache_t *cache = rjit_cache_create(k == 0 ? 100 * budget : budget);
+        start = wall_time();
+        for (int i = 0; i < iters; i++) {
+            // mostly the first few, now and then the rest
+            int p = i % 8 != 0 ? i % 16 : (i / 8) % npatterns;
+            rjit_cache_entry_t *e = rjit_cache_get(cache, patterns[p], 0);
+            rjit_cache_release(e);
+        }
+        t = wall_time() - start;
+        printf("cache: %s budget %f us per pattern, %llu hits, %llu misses, %llu evictions, %zu KB\n",
+               k == 0 ? "big  " : "small", t / iters * 1e6,
+               (unsigned long long) cache->hits, (unsigned long long) cache->misses,
+               (unsigned long long) cache->evictions, cache->bytes / 1024);
+        rjit_cache_free(cache);
+    }
+}
+
+void benchmark() {
+    const char *pattern = "(hello|world(0|1|2|3)?)+";
+
+    int len = 50 * 1000 * 1024;
+    char *str = (char*) malloc(len);
+    memset(str, '\0', len);
+
+    int ctr = 0;
+    for (int i = 0; i < len-100; ) {
+        ctr++;
+        if ((ctr & 1) == 1) {
+            memcpy(str + i, "hello", 5);
+            i += 5;
+        } else {
+            memcpy(str + i, "world", 5);
+            str[i+5] = '0' + (ctr/2 % 4);
+            i += 6;
+        }
+    }
+
+    printf("the string: %.*s\n", 100, str);
+
+    vm_program_t *prog = regex_compile_bytecode(pattern);
+
+    double total = 0;
+    int niters = 20;
+    for (int iter = 0; iter < niters; iter++) {
+        double start = (double) clock() / CLOCKS_PER_SEC;
+        vm_run(prog, str);
+        double end = (double) clock() / CLOCKS_PER_SEC;
+
+        total += (end - start);
+    }
+
+    printf("Total %f, avg %f\n", total, total / niters);
+
+    printf("result ::: %d\n", vm_run(prog, str));
+
+    dfa_cache_t *dfa = dfa_cache_create(prog, DFA_DEFAULT_BUDGET);
+
+    total = 0;
+    for (int iter = 0; iter < niters; iter++) {
+        double start = (double) clock() / CLOCKS_PER_SEC;
+        dfa_run(dfa, str);
+        double end = (double) clock() / CLOCKS_PER_SEC;
+
+        total += (end - start);
+    }
+
+    printf("Total %f, avg %f\n", total, total / niters);
+
+    printf("result ::: %d (lazy dfa, %d states, %d flushes)\n",
+        dfa_run(dfa, str), dfa->states_length, dfa->flushes);
+    printf("memory: program %zu bytes, lazy dfa %zu bytes\n",
+        prog->insts_length * sizeof(vm_inst_t), dfa->used);
+    dfa_cache_free(dfa);
+
+    const char *error = NULL;
+    dfa_table_t *table = dfa_compile(prog, DFA_DEFAULT_MAX_STATES, &error);
+    if (table == NULL) {
+        printf("dfa compile failed: %s\n", error);
+    } else {
+        total = 0;
+        for (int iter = 0; iter < niters; iter++) {
+            double start = (double) clock() / CLOCKS_PER_SEC;
+            dfa_table_run(table, str);
+            double end = (double) clock() / CLOCKS_PER_SEC;
+
+            total += (end - start);
+        }
+
+        printf("Total %f, avg %f\n", total, total / niters);
+
+        printf("result ::: %d (min dfa, %d states, %d classes, %zu bytes)\n",
+            dfa_table_run(table, str), table->nstates, table->nclasses, dfa_table_size(table));
+        dfa_table_free(table);
+    }
+
+    match_fn_t fn = regex_compile(pattern);
+    printf("result ::: %d\n", fn(str));
+
+    total = 0;
+    for (int iter = 0; iter < niters; iter++) {
+        double start = (double) clock() / CLOCKS_PER_SEC;
+        fn(str);
+        double end = (double) clock() / CLOCKS_PER_SEC;
+
+        total += (end - start);
+    }
+
+    printf("Total %f, avg %f\n", total, total / niters);
+
+    // the same with an explicit length, like over an mmapped file
+    match_len_fn_t fn_len = regex_compile_len_jit(prog);
+    size_t str_len = strlen(str);
+    printf("result ::: %d (explicit length)\n", fn_len(str, str_len));
+
+    total = 0;
+    for (int iter = 0; iter < niters; iter++) {
+        double start = (double) clock() / CLOCKS_PER_SEC;
+        fn_len(str, str_len);
+        double end = (double) clock() / CLOCKS_PER_SEC;
+
+        total += (end - start);
+    }
+
+    printf("Total %f, avg %f\n", total, total / niters);
+
+    re2::RE2 re(pattern);
+
+    total = 0;
+    for (int iter = 0; iter < niters; iter++) {
+        double start = (double) clock() / CLOCKS_PER_SEC;
+        re2::RE2::FullMatch(str, re);
+        double end = (double) clock() / CLOCKS_PER_SEC;
+
+        total += (end - start);
+    }
+
+    printf("Total %f, avg %f\n", total, total / niters);
+
+    benchmark_stream(pattern, str);
+
+    // submatches: pike vm vs re2
+    size_t slots[6];
+    int cap_iters = 3;
+    total = 0;
+    for (int iter = 0; iter < cap_iters; iter++) {
+        double start = (double) clock() / CLOCKS_PER_SEC;
+        vm_run_captures(prog, str, slots, 6);
+        double end = (double) clock() / CLOCKS_PER_SEC;
+
+        total += (end - start);
+    }
+
+    printf("captures: Total %f, avg %f, group 2 at [%zd, %zd)\n", total, total / cap_iters,
+        (ssize_t) slots[4], (ssize_t) slots[5]);
+
+    re2::StringPiece groups[3];
+    total = 0;
+    for (int iter = 0; iter < cap_iters; iter++) {
+        double start = (double) clock() / CLOCKS_PER_SEC;
+        re.Match(str, 0, strlen(str), re2::RE2::ANCHOR_BOTH, groups, 3);
+        double end = (double) clock() / CLOCKS_PER_SEC;
+
+        total += (end - start);
+    }
+
+    printf("captures (re2): Total %f, avg %f\n", total, total / cap_iters);
+
+    benchmark_search(pattern);
+    benchmark_set();
+    benchmark_batch();
+    benchmark_class();
+    benchmark_repeat();
+    benchmark_bitnfa();
+    benchmark_threaded();
+    benchmark_literal_runs();
+    benchmark_closures();
+    benchmark_backtrack();
+    benchmark_plan();
+    benchmark_compile();
+    benchmark_code_heap();
+    benchmark_cache();
+}
+
+int main(int argc, char **argv) {
+    test("");
+    test("123");
+    test("1(2)3");
+    test("a|b");
+    test("a.c");
+    test("1(2|3)4");
+    test("1(2|)4");
+    test("1|2|3|4");
+    test("1+");
+    test("1?");
+    test("1*(124)+");
+    test("123(abcd+)");
+    test("(hello(xyz)world)");
+
+    const char *pattern = "(hello|world(0|1|2|3)?)+";
+    match_fn_t fn = regex_compile(pattern);
+
+    const char *pp = "hellohellohelloworld3";
+    bool answer = fn(pp);
+    printf("drumroll... %d\n", answer);
+
+    vm_program_t *prog = regex_compile_bytecode(pattern);
+    //print_program(prog);
+
+    bool vm_ans = vm_run(prog, pp);
+    printf("vm ans: %d\n", vm_ans);
+
+    const char *text = "xx hellohelloworld3 yy";
+    size_t start = 0, end = 0;
+    bool found = regex_search(prog, text, strlen(text), &start, &end);
+    printf("vm search: %d [%zu, %zu)\n", found, start, end);
+
+    search_fn_t search = regex_compile_search_jit(prog);
+    if (search != NULL) {
+        found = search(text, strlen(text), &start, &end);
+        printf("jit search: %d [%zu, %zu)\n", found, start, end);
+    }
+
+    size_t slots[6];
+    found = vm_run_captures(prog, pp, slots, 6);
+    printf("captures: %d", found);
+    for (int i = 0; found && i < 6; i += 2)
+        printf(" [%zd, %zd)", (ssize_t) slots[i], (ssize_t) slots[i+1]);
+    printf(" (%s)\n", prog->onepass != NULL ? "one-pass" : "pike");
+
+    test_onepass();
+    test_len();
+    test_errors();
+
+    benchmark();
+
+    return 0;
+}
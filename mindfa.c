@@ -0,0 +1,276 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Ahead of time DFA: full subset construction (reusing the lazy DFA's state
+// cache with an unlimited budget), Hopcroft minimization, and byte
+// equivalence classes so that each row only has one entry per class.
+//
+// The table stores row offsets instead of state numbers, so the interpreter
+// is just `s = trans[s + classmap[c]]` per byte.
+
+// bytes are in the same class if no instruction can tell them apart
+int dfa_byte_classes(vm_program_t *prog, uint8_t *classmap) {
+    int nclasses = 1;
+    memset(classmap, 0, 256);
+
+    for (int pc = 0; pc < prog->insts_length; pc++) {
+        vm_inst_t inst = prog->insts[pc];
+        if (inst.op != OP_LITERAL && inst.op != OP_CLASS) continue;
+
+        char_class_t single;
+        const char_class_t *cls = &single;
+        if (inst.op == OP_LITERAL) {
+            uint8_t c = inst.literal.str[0];
+            memset(&single, 0, sizeof(single));
+            single.bits[c >> 5] = (uint32_t) 1 << (c & 31);
+        } else {
+            cls = &prog->classes[inst.class_index];
+        }
+
+        // split every class the set cuts through in two: the bytes in
+        // the set, and everything else
+        bool outside[256] = {false};
+        for (int b = 0; b < 256; b++)
+            if (!CHAR_CLASS_HAS(cls, b)) outside[classmap[b]] = true;
+
+        int split[256];
+        for (int k = 0; k < nclasses; k++) split[k] = -1;
+        for (int b = 0; b < 256; b++) {
+            int old = classmap[b];
+            if (!CHAR_CLASS_HAS(cls, b) || !outside[old]) continue;
+            if (split[old] < 0) split[old] = nclasses++;
+            classmap[b] = split[old];
+        }
+    }
+
+    return nclasses;
+}
+
+// Hopcroft's algorithm over the states in `trans` (nstates x nclasses).
+// Writes the block of each state to `block`, returns the number of blocks.
+int dfa_minimize(int *trans, bool *match, int nstates, int nclasses, int *block) {
+    // predecessors of each (class, state), CSR style
+    int *inv_start = (int*) calloc(nclasses * nstates + 1, sizeof(int));
+    int *inv = (int*) malloc(nclasses * nstates * sizeof(int));
+    for (int s = 0; s < nstates; s++)
+        for (int c = 0; c < nclasses; c++)
+            inv_start[c * nstates + trans[s * nclasses + c] + 1]++;
+    for (int i = 0; i < nclasses * nstates; i++)
+        inv_start[i + 1] += inv_start[i];
+    int *fill = (int*) malloc(nclasses * nstates * sizeof(int));
+    memcpy(fill, inv_start, nclasses * nstates * sizeof(int));
+    for (int s = 0; s < nstates; s++)
+        for (int c = 0; c < nclasses; c++)
+            inv[fill[c * nstates + trans[s * nclasses + c]]++] = s;
+    free(fill);
+
+    // the partition: states grouped by block in `elems`
+    int *elems = (int*) malloc(nstates * sizeof(int));
+    int *pos = (int*) malloc(nstates * sizeof(int));
+    int *first = (int*) malloc(nstates * sizeof(int));
+    int *end = (int*) malloc(nstates * sizeof(int));
+    int *marked = (int*) calloc(nstates, sizeof(int));
+    bool *in_worklist = (bool*) calloc(nstates, sizeof(bool));
+    int *worklist = (int*) malloc(nstates * sizeof(int));
+    int *touched = (int*) malloc(nstates * sizeof(int));
+    int *splitter = (int*) malloc(nstates * sizeof(int));
+    int nblocks = 0, wl_length = 0;
+
+    // start with {match, non-match}
+    int n = 0;
+    for (int m = 0; m < 2; m++) {
+        int start = n;
+        for (int s = 0; s < nstates; s++) {
+            if (match[s] != (m == 1)) continue;
+            elems[n] = s;
+            pos[s] = n++;
+            block[s] = nblocks;
+        }
+        if (n > start) {
+            first[nblocks] = start;
+            end[nblocks] = n;
+            nblocks++;
+        }
+    }
+    // either block works as the first splitter
+    worklist[wl_length++] = 0;
+    in_worklist[0] = true;
+
+    while (wl_length > 0) {
+        int a = worklist[--wl_length];
+        in_worklist[a] = false;
+
+        // a might be split while we use it, keep a copy
+        int a_length = end[a] - first[a];
+        memcpy(splitter, elems + first[a], a_length * sizeof(int));
+
+        for (int c = 0; c < nclasses; c++) {
+            int ntouched = 0;
+
+            // move every predecessor to the front of its block
+            for (int i = 0; i < a_length; i++) {
+                int t = splitter[i];
+                for (int j = inv_start[c * nstates + t]; j < inv_start[c * nstates + t + 1]; j++) {
+                    int s = inv[j];
+                    int b = block[s];
+                    if (pos[s] < first[b] + marked[b]) continue; // already marked
+
+                    int p = first[b] + marked[b];
+                    int other = elems[p];
+                    elems[p] = s;
+                    elems[pos[s]] = other;
+                    pos[other] = pos[s];
+                    pos[s] = p;
+
+                    if (marked[b]++ == 0) touched[ntouched++] = b;
+                }
+            }
+
+            for (int i = 0; i < ntouched; i++) {
+                int b = touched[i];
+                if (marked[b] == end[b] - first[b]) {
+                    marked[b] = 0;
+                    continue;
+                }
+
+                // the marked part becomes a new block
+                int nb = nblocks++;
+                first[nb] = first[b];
+                end[nb] = first[b] + marked[b];
+                first[b] = end[nb];
+                marked[b] = 0;
+                for (int p = first[nb]; p < end[nb]; p++)
+                    block[elems[p]] = nb;
+
+                if (in_worklist[b] || end[nb] - first[nb] <= end[b] - first[b]) {
+                    worklist[wl_length++] = nb;
+                    in_worklist[nb] = true;
+                } else {
+                    worklist[wl_length++] = b;
+                    in_worklist[b] = true;
+                }
+            }
+        }
+    }
+
+    free(inv_start);
+    free(inv);
+    free(elems);
+    free(pos);
+    free(first);
+    free(end);
+    free(marked);
+    free(in_worklist);
+    free(worklist);
+    free(touched);
+    free(splitter);
+
+    return nblocks;
+}
+
+dfa_table_t *dfa_compile(vm_program_t *prog, int max_states, const char **error) {
+    uint8_t classmap[256];
+    int nclasses = dfa_byte_classes(prog, classmap);
+
+    // one representative byte per class
+    int rep[256];
+    for (int b = 255; b >= 0; b--)
+        rep[classmap[b]] = b;
+
+    // subset construction, breadth first. State ids are handed out in order,
+    // so everything below states_length has been seen and `s` is the queue.
+    dfa_cache_t *dfa = dfa_cache_create(prog, (size_t) -1);
+    dfa_start_state(dfa);
+
+    int capacity = 64;
+    int *trans = (int*) malloc(capacity * nclasses * sizeof(int));
+    for (int s = 0; s < dfa->states_length; s++) {
+        if (dfa->states_length > max_states) {
+            free(trans);
+            dfa_cache_free(dfa);
+            if (error) *error = "DFA state limit exceeded";
+            return NULL;
+        }
+
+        if (s == capacity) {
+            capacity *= 2;
+            trans = (int*) realloc(trans, capacity * nclasses * sizeof(int));
+        }
+        for (int c = 0; c < nclasses; c++)
+            trans[s * nclasses + c] = dfa_transition(dfa, s, rep[c]);
+    }
+    if (dfa->states_length > max_states) {
+        free(trans);
+        dfa_cache_free(dfa);
+        if (error) *error = "DFA state limit exceeded";
+        return NULL;
+    }
+
+    // sizes as size_t, so they can't be negative in the mallocs
+    size_t nstates = dfa->states_length;
+    bool *match = (bool*) malloc(nstates * sizeof(bool));
+    for (size_t s = 0; s < nstates; s++)
+        match[s] = dfa->states[s].match;
+
+    int *block = (int*) malloc(nstates * sizeof(int));
+    size_t nblocks = dfa_minimize(trans, match, nstates, nclasses, block);
+
+    dfa_table_t *table = (dfa_table_t*) malloc(sizeof(dfa_table_t));
+    table->nstates = nblocks;
+    table->nclasses = nclasses;
+    memcpy(table->classmap, classmap, 256);
+    table->trans = (uint32_t*) malloc(nblocks * nclasses * sizeof(uint32_t));
+    table->match = (bool*) malloc(nblocks * sizeof(bool));
+    for (size_t s = 0; s < nstates; s++) {
+        int b = block[s];
+        table->match[b] = match[s];
+        for (int c = 0; c < nclasses; c++)
+            table->trans[b * nclasses + c] = block[trans[s * nclasses + c]] * nclasses;
+    }
+    table->start = block[dfa->start] * nclasses;
+    table->dead = block[0] * nclasses; // state 0 of the cache is the empty set
+
+    free(trans);
+    free(match);
+    free(block);
+    dfa_cache_free(dfa);
+
+    return table;
+}
+
+void dfa_table_free(dfa_table_t *table) {
+    free(table->trans);
+    free(table->match);
+    free(table);
+}
+
+size_t dfa_table_size(dfa_table_t *table) {
+    return sizeof(dfa_table_t) + table->nstates * table->nclasses * sizeof(uint32_t)
+        + table->nstates * sizeof(bool);
+}
+
+#define DFA_TABLE_CHUNK 4096
+
+bool dfa_table_run_len(dfa_table_t *table, const char *data, size_t len) {
+    const uint8_t *sp = (const uint8_t*) data;
+    const uint8_t *end = sp + len;
+    const uint32_t *trans = table->trans;
+    const uint8_t *classmap = table->classmap;
+
+    uint32_t s = table->start;
+    while (sp < end) {
+        // no branches in here, only check for the dead state between chunks
+        const uint8_t *chunk_end = end - sp > DFA_TABLE_CHUNK ? sp + DFA_TABLE_CHUNK : end;
+        for (; sp < chunk_end; sp++)
+            s = trans[s + classmap[*sp]];
+        if (s == table->dead) return false;
+    }
+
+    return table->match[s / table->nclasses];
+}
+
+bool dfa_table_run(dfa_table_t *table, const char *str) {
+    return dfa_table_run_len(table, str, strlen(str));
+}
@@ -0,0 +1,216 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Cleanup between emit_node() and the engines, in pcs rather than labels:
+//
+//   - jumps and splits go straight to the end of a chain of jmps, and a jmp
+//     to a match becomes the match
+//   - a split with both ways the same is a jmp
+//   - unreachable instructions go, and so do jmps to where we'd fall through
+//     to anyway
+//   - each literal gets the length of the run of literals it starts (the
+//     next bytes of the pattern, one instruction each). Engines that compare
+//     one byte a step still work, ones that can take the whole run at once
+//     do that instead when a single thread is left: the thompson vm and the
+//     x86 JIT's match modes, see benchmark_literal_runs.
+//
+// The label table is rebuilt with one label per target, in pc order.
+
+int vm_opt_target(vm_program_t *prog, int label) {
+    return prog->label_table[label];
+}
+
+// follow jmps, stopping on a loop of them
+int vm_opt_thread(vm_inst_t *insts, int *targets, int N, int pc) {
+    for (int hops = 0; insts[pc].op == OP_JMP && hops < N; hops++)
+        pc = targets[2 * pc];
+    return pc;
+}
+
+void vm_program_optimize(vm_program_t *prog) {
+    int N = prog->insts_length;
+    vm_inst_t *insts = prog->insts;
+
+    // branch targets as pcs, two per instruction
+    int *targets = (int*) malloc(2 * N * sizeof(int));
+    for (int i = 0; i < N; i++) {
+        targets[2 * i] = targets[2 * i + 1] = -1;
+        if (insts[i].op == OP_JMP) {
+            targets[2 * i] = vm_opt_target(prog, insts[i].jmp_label);
+        } else if (insts[i].op == OP_SPLIT) {
+            targets[2 * i] = vm_opt_target(prog, insts[i].split.label_1);
+            targets[2 * i + 1] = vm_opt_target(prog, insts[i].split.label_2);
+        }
+    }
+
+    // thread jumps, collapse splits
+    for (int i = 0; i < N; i++) {
+        if (insts[i].op == OP_JMP) {
+            targets[2 * i] = vm_opt_thread(insts, targets, N, targets[2 * i]);
+        } else if (insts[i].op == OP_SPLIT) {
+            targets[2 * i] = vm_opt_thread(insts, targets, N, targets[2 * i]);
+            targets[2 * i + 1] = vm_opt_thread(insts, targets, N, targets[2 * i + 1]);
+            if (targets[2 * i] == targets[2 * i + 1]) {
+                insts[i].op = OP_JMP;
+                targets[2 * i + 1] = -1;
+            }
+        }
+    }
+    for (int i = 0; i < N; i++) {
+        if (insts[i].op == OP_JMP && insts[targets[2 * i]].op == OP_MATCH) {
+            insts[i] = insts[targets[2 * i]];
+            targets[2 * i] = -1;
+        }
+    }
+
+    // what's reachable from pc 0
+    bool *keep = (bool*) calloc(N, sizeof(bool));
+    int *stack = (int*) malloc((2 * N + 1) * sizeof(int));
+    int sp = 0;
+    stack[sp++] = 0;
+    keep[0] = true;
+    while (sp > 0) {
+        int pc = stack[--sp];
+        int succ[2] = {-1, -1};
+        vm_opcode_t op = insts[pc].op;
+        if (op == OP_LITERAL || op == OP_ANY || op == OP_CLASS || op == OP_SAVE) succ[0] = pc + 1;
+        else if (op == OP_JMP) succ[0] = targets[2 * pc];
+        else if (op == OP_SPLIT) { succ[0] = targets[2 * pc]; succ[1] = targets[2 * pc + 1]; }
+
+        for (int k = 0; k < 2; k++) {
+            if (succ[k] >= 0 && succ[k] < N && !keep[succ[k]]) {
+                keep[succ[k]] = true;
+                stack[sp++] = succ[k];
+            }
+        }
+    }
+
+    // jmps to the next instruction we keep. From the back, so a jmp over
+    // another one that goes sees it gone
+    for (int i = N - 1; i >= 0; i--) {
+        if (!keep[i] || insts[i].op != OP_JMP || targets[2 * i] <= i) continue;
+        bool over = false;
+        for (int j = i + 1; j < targets[2 * i]; j++) over = over || keep[j];
+        if (!over) keep[i] = false;
+    }
+    // pc 0 is where everything starts, it can't go
+    keep[0] = true;
+
+    // renumber: a dropped pc maps to the next one kept
+    int *newpc = (int*) malloc((N + 1) * sizeof(int));
+    int M = 0;
+    for (int i = 0; i < N; i++) {
+        newpc[i] = M;
+        if (keep[i]) M++;
+    }
+    newpc[N] = M;
+
+    int *label_of = (int*) malloc(M * sizeof(int));
+    for (int i = 0; i < M; i++) label_of[i] = -1;
+    for (int i = 0; i < N; i++) {
+        if (!keep[i]) continue;
+        for (int k = 0; k < 2; k++)
+            if (targets[2 * i + k] >= 0) label_of[newpc[targets[2 * i + k]]] = 0;
+    }
+    prog->current_label = 0;
+    for (int pc = 0; pc < M; pc++) {
+        if (label_of[pc] < 0) continue;
+        label_of[pc] = prog->current_label;
+        prog->label_table[prog->current_label++] = pc;
+    }
+
+    for (int i = 0, j = 0; i < N; i++) {
+        if (!keep[i]) continue;
+        vm_inst_t inst = insts[i];
+        if (inst.op == OP_JMP) {
+            inst.jmp_label = label_of[newpc[targets[2 * i]]];
+        } else if (inst.op == OP_SPLIT) {
+            inst.split.label_1 = label_of[newpc[targets[2 * i]]];
+            inst.split.label_2 = label_of[newpc[targets[2 * i + 1]]];
+        }
+        insts[j++] = inst;
+    }
+    prog->insts_length = M;
+
+    // literal runs, from the back
+    for (int i = M - 1; i >= 0; i--) {
+        if (insts[i].op != OP_LITERAL) continue;
+        insts[i].literal.length = 1;
+        if (i + 1 < M && insts[i + 1].op == OP_LITERAL &&
+            insts[i + 1].literal.str == insts[i].literal.str + 1)
+            insts[i].literal.length = insts[i + 1].literal.length + 1;
+    }
+
+    free(targets);
+    free(keep);
+    free(stack);
+    free(newpc);
+    free(label_of);
+}
+
+// Epsilon closures: for pc 0 and each pc a consuming instruction goes on to,
+// the consuming instructions and matches reachable from it through jmps,
+// splits and saves, in priority order (a split's first way first). With
+// these an engine steps straight from consuming instruction to consuming
+// instruction and never puts an epsilon on a thread list.
+//
+// A closure can be most of the program, so there's a cap on the total, and
+// past it prog->eps stays NULL and the engines expand epsilons as they go.
+void vm_program_closures(vm_program_t *prog) {
+    int N = prog->insts_length;
+    vm_inst_t *insts = prog->insts;
+    long max = VM_CLOSURE_MAX(N);
+
+    prog->eps_offsets = (int*) malloc((N + 1) * sizeof(int));
+    int capacity = 2 * N, length = 0;
+    prog->eps = (int*) malloc(capacity * sizeof(int));
+
+    int *seen = (int*) malloc(N * sizeof(int));
+    int *stack = (int*) malloc((2 * N + 1) * sizeof(int));
+    for (int i = 0; i < N; i++) seen[i] = -1;
+
+    for (int pc = 0; pc < N; pc++) {
+        prog->eps_offsets[pc] = length;
+        bool wanted = pc == 0 || (insts[pc - 1].op == OP_LITERAL || insts[pc - 1].op == OP_ANY ||
+                                  insts[pc - 1].op == OP_CLASS);
+        if (!wanted) continue;
+
+        int sp = 0;
+        stack[sp++] = pc;
+        while (sp > 0) {
+            int p = stack[--sp];
+            if (seen[p] == pc) continue;
+            seen[p] = pc;
+
+            vm_inst_t inst = insts[p];
+            if (inst.op == OP_JMP) {
+                stack[sp++] = prog->label_table[inst.jmp_label];
+            } else if (inst.op == OP_SPLIT) {
+                stack[sp++] = prog->label_table[inst.split.label_2];
+                stack[sp++] = prog->label_table[inst.split.label_1];
+            } else if (inst.op == OP_SAVE) {
+                stack[sp++] = p + 1;
+            } else {
+                if (length == max) {
+                    free(prog->eps_offsets);
+                    free(prog->eps);
+                    prog->eps_offsets = prog->eps = NULL;
+                    free(seen);
+                    free(stack);
+                    return;
+                }
+                if (length == capacity) {
+                    capacity *= 2;
+                    prog->eps = (int*) realloc(prog->eps, capacity * sizeof(int));
+                }
+                prog->eps[length++] = p;
+            }
+        }
+    }
+    prog->eps_offsets[N] = length;
+
+    free(seen);
+    free(stack);
+}
@@ -0,0 +1,364 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Submatches in a single pass over the input, no backtracking.
+//
+// pike_run() is vm_run3 with a capture slot array per thread. Threads are kept
+// in priority order (epsilons are followed depth first, like regex_search), so
+// the first thread that matches at the end of the string has the submatches
+// Perl would report. Slot arrays are shared copy-on-write: a split only bumps
+// a reference count and an array is copied when OP_SAVE writes to a shared
+// one, so patterns without groups never copy anything.
+//
+// onepass_run() handles programs where one thread is enough, see onepass_build().
+//
+// In both, group k ends up in slots[2k] and slots[2k+1], CAPTURE_UNSET if it
+// didn't take part in the match. The slots are only written on a match.
+
+typedef struct {
+    int pc;
+    int caps; // slot array in the pool
+} pike_thread_t;
+
+typedef struct {
+    int nslots;
+    size_t *slots; // capacity x nslots
+    int *refs;
+    int *free_list;
+    int free_length;
+} pike_pool_t;
+
+int pike_alloc(pike_pool_t *pool) {
+    int caps = pool->free_list[--pool->free_length];
+    pool->refs[caps] = 1;
+    return caps;
+}
+
+void pike_release(pike_pool_t *pool, int caps) {
+    if (--pool->refs[caps] == 0)
+        pool->free_list[pool->free_length++] = caps;
+}
+
+// set a slot, copying the array first if another thread uses it too
+int pike_save(pike_pool_t *pool, int caps, int slot, size_t pos) {
+    if (pool->refs[caps] > 1) {
+        int copy = pike_alloc(pool);
+        memcpy(pool->slots + copy * pool->nslots, pool->slots + caps * pool->nslots,
+               pool->nslots * sizeof(size_t));
+        pool->refs[caps]--;
+        caps = copy;
+    }
+    pool->slots[caps * pool->nslots + slot] = pos;
+    return caps;
+}
+
+// like vm_search_add, the thread's reference to its slots moves to the list
+void pike_add(vm_program_t *prog, pike_pool_t *pool, pike_thread_t *list, int *len,
+              size_t *hist, size_t mark, pike_thread_t *stack, int pc, int caps) {
+    int sp = 0;
+    stack[sp++] = (pike_thread_t){.pc = pc, .caps = caps};
+
+    while (sp > 0) {
+        pike_thread_t thr = stack[--sp];
+        if (hist[thr.pc] == mark) {
+            pike_release(pool, thr.caps);
+            continue;
+        }
+        hist[thr.pc] = mark;
+
+        vm_inst_t inst = prog->insts[thr.pc];
+        switch (inst.op) {
+        case OP_JMP:
+            stack[sp++] = (pike_thread_t){.pc = prog->label_table[inst.jmp_label], .caps = thr.caps};
+            break;
+
+        case OP_SPLIT:
+            // label_1 has priority, so it goes on top
+            pool->refs[thr.caps]++;
+            stack[sp++] = (pike_thread_t){.pc = prog->label_table[inst.split.label_2], .caps = thr.caps};
+            stack[sp++] = (pike_thread_t){.pc = prog->label_table[inst.split.label_1], .caps = thr.caps};
+            break;
+
+        case OP_SAVE:
+            if (inst.save_slot < pool->nslots)
+                thr.caps = pike_save(pool, thr.caps, inst.save_slot, mark);
+            stack[sp++] = (pike_thread_t){.pc = thr.pc + 1, .caps = thr.caps};
+            break;
+
+        default:
+            list[(*len)++] = thr;
+            break;
+        }
+    }
+}
+
+// data[0, len), '\0' is just another byte
+bool pike_run_len(vm_program_t *prog, const char *data, size_t len, size_t *slots, int nslots) {
+    int N = prog->insts_length;
+
+    // every thread on the lists and the stack holds at most one reference
+    int capacity = 4 * N + 2;
+    pike_pool_t pool;
+    pool.nslots = nslots;
+    pool.slots = (size_t*) malloc(capacity * nslots * sizeof(size_t));
+    pool.refs = (int*) malloc(capacity * sizeof(int));
+    pool.free_list = (int*) malloc(capacity * sizeof(int));
+    for (int i = 0; i < capacity; i++)
+        pool.free_list[i] = capacity - 1 - i;
+    pool.free_length = capacity;
+
+    // the pool is malloced anyway, so are these: programs can be up to
+    // REGEX_MAX_INSTS, too big for the stack
+    size_t *hist = (size_t*) malloc(N * sizeof(size_t));
+    for (int i = 0; i < N; i++)
+        hist[i] = (size_t) -1;
+
+    pike_thread_t *threads = (pike_thread_t*) malloc((4 * N + 1) * sizeof(pike_thread_t));
+    pike_thread_t *stack = threads + 2 * N;
+
+    pike_thread_t *curr = threads, *next = threads + N;
+    int currlen = 0, nextlen = 0;
+
+    int caps = pike_alloc(&pool);
+    for (int i = 0; i < nslots; i++)
+        pool.slots[caps * nslots + i] = CAPTURE_UNSET;
+    pike_add(prog, &pool, curr, &currlen, hist, 0, stack, 0, caps);
+
+    bool matched = false;
+    for (size_t pos = 0; currlen > 0; pos++) {
+        int c = pos < len ? (uint8_t) data[pos] : -1; // -1 at the end
+        for (int i = 0; i < currlen; i++) {
+            pike_thread_t thr = curr[i];
+            vm_inst_t inst = prog->insts[thr.pc];
+
+            if (c >= 0 && ((inst.op == OP_LITERAL && (uint8_t) *inst.literal.str == c) || inst.op == OP_ANY ||
+                           (inst.op == OP_CLASS && CHAR_CLASS_HAS(&prog->classes[inst.class_index], c)))) {
+                pike_add(prog, &pool, next, &nextlen, hist, pos + 1, stack, thr.pc + 1, thr.caps);
+
+            } else if (inst.op == OP_MATCH && c < 0) {
+                // the rest of the list has lower priority
+                matched = true;
+                memcpy(slots, pool.slots + thr.caps * nslots, nslots * sizeof(size_t));
+                if (nslots >= 2) {
+                    slots[0] = 0;
+                    slots[1] = pos;
+                }
+                break;
+
+            } else {
+                pike_release(&pool, thr.caps);
+            }
+        }
+
+        pike_thread_t *tmp = next;
+        next = curr;
+        curr = tmp;
+
+        currlen = nextlen;
+        nextlen = 0;
+
+        if (c < 0) break;
+    }
+
+    free(pool.slots);
+    free(pool.refs);
+    free(pool.free_list);
+    free(hist);
+    free(threads);
+
+    return matched;
+}
+
+bool pike_run(vm_program_t *prog, const char *str, size_t *slots, int nslots) {
+    return pike_run_len(prog, str, strlen(str), slots, nslots);
+}
+
+// One-pass programs. The states are the pcs we can be at between two bytes:
+// pc 0 and the pc after each consuming instruction. From a state we follow
+// the epsilons, and if no pc is reached twice and no byte is accepted by two
+// of the consuming instructions we find, then each (state, byte) has exactly
+// one path. The saves along it are stored with the transition.
+
+int onepass_add_action(onepass_t *op, int next, const int *saves, int saves_length) {
+    if (op->actions_length == op->actions_capacity) {
+        op->actions_capacity *= 2;
+        op->actions = (onepass_action_t*) realloc(op->actions, op->actions_capacity * sizeof(onepass_action_t));
+    }
+    while (op->saves_length + saves_length > op->saves_capacity) {
+        op->saves_capacity *= 2;
+        op->saves = (int*) realloc(op->saves, op->saves_capacity * sizeof(int));
+    }
+
+    onepass_action_t *action = &op->actions[op->actions_length];
+    action->next = next;
+    action->saves_offset = op->saves_length;
+    action->saves_length = saves_length;
+    memcpy(op->saves + op->saves_length, saves, saves_length * sizeof(int));
+    op->saves_length += saves_length;
+
+    return op->actions_length++;
+}
+
+// follow epsilons from pc, `path` holds the saves on the way here
+bool onepass_visit(vm_program_t *prog, onepass_t *op, int state, int *seen,
+                   int *path, int depth, int pc) {
+    if (seen[pc] == state) return false; // two ways to get here
+    seen[pc] = state;
+
+    vm_inst_t inst = prog->insts[pc];
+    int *row = op->trans + state * 256;
+
+    switch (inst.op) {
+    case OP_JMP:
+        return onepass_visit(prog, op, state, seen, path, depth, prog->label_table[inst.jmp_label]);
+
+    case OP_SPLIT:
+        return onepass_visit(prog, op, state, seen, path, depth, prog->label_table[inst.split.label_1]) &&
+               onepass_visit(prog, op, state, seen, path, depth, prog->label_table[inst.split.label_2]);
+
+    case OP_SAVE:
+        path[depth] = inst.save_slot;
+        return onepass_visit(prog, op, state, seen, path, depth + 1, pc + 1);
+
+    case OP_MATCH:
+        // the optimizer can leave several OP_MATCHes, the first one reached wins
+        if (op->match[state] >= 0) return false;
+        op->match[state] = onepass_add_action(op, -1, path, depth);
+        return true;
+
+    case OP_LITERAL:
+    case OP_ANY:
+    case OP_CLASS: {
+        int action = onepass_add_action(op, op->state_of_pc[pc + 1], path, depth);
+        for (int c = 0; c < 256; c++) {
+            if (inst.op == OP_LITERAL && c != (uint8_t) inst.literal.str[0]) continue;
+            if (inst.op == OP_CLASS && !CHAR_CLASS_HAS(&prog->classes[inst.class_index], c)) continue;
+            if (row[c] >= 0) return false; // two instructions want this byte
+            row[c] = action;
+        }
+        return true;
+    }
+    }
+
+    return false;
+}
+
+onepass_t *onepass_build(vm_program_t *prog) {
+    int N = prog->insts_length;
+
+    onepass_t *op = (onepass_t*) malloc(sizeof(onepass_t));
+    op->state_of_pc = (int*) malloc(N * sizeof(int));
+    for (int pc = 0; pc < N; pc++)
+        op->state_of_pc[pc] = -1;
+
+    op->nstates = 0;
+    op->state_of_pc[0] = op->nstates++;
+    for (int pc = 0; pc < N; pc++) {
+        vm_opcode_t code = prog->insts[pc].op;
+        if ((code == OP_LITERAL || code == OP_ANY || code == OP_CLASS) && op->state_of_pc[pc + 1] < 0)
+            op->state_of_pc[pc + 1] = op->nstates++;
+    }
+
+    op->trans = NULL;
+    op->match = NULL;
+    op->actions_capacity = 16;
+    op->actions_length = 0;
+    op->actions = (onepass_action_t*) malloc(op->actions_capacity * sizeof(onepass_action_t));
+    op->saves_capacity = 16;
+    op->saves_length = 0;
+    op->saves = (int*) malloc(op->saves_capacity * sizeof(int));
+
+    if (op->nstates > ONEPASS_MAX_STATES) {
+        onepass_free(op);
+        return NULL;
+    }
+
+    op->trans = (int*) malloc(op->nstates * 256 * sizeof(int));
+    op->match = (int*) malloc(op->nstates * sizeof(int));
+    for (int i = 0; i < op->nstates * 256; i++)
+        op->trans[i] = -1;
+
+    int *seen = (int*) malloc(N * sizeof(int));
+    int *path = (int*) malloc(N * sizeof(int));
+    for (int pc = 0; pc < N; pc++)
+        seen[pc] = -1;
+
+    bool ok = true;
+    for (int pc = 0; pc < N && ok; pc++) {
+        int state = op->state_of_pc[pc];
+        if (state < 0) continue;
+        op->match[state] = -1;
+        ok = onepass_visit(prog, op, state, seen, path, 0, pc);
+    }
+
+    free(seen);
+    free(path);
+
+    if (!ok) {
+        onepass_free(op);
+        return NULL;
+    }
+    return op;
+}
+
+void onepass_free(onepass_t *op) {
+    free(op->state_of_pc);
+    free(op->trans);
+    free(op->match);
+    free(op->actions);
+    free(op->saves);
+    free(op);
+}
+
+void onepass_apply(onepass_t *op, int action, size_t *slots, int nslots, size_t pos) {
+    onepass_action_t a = op->actions[action];
+    for (int i = 0; i < a.saves_length; i++) {
+        int slot = op->saves[a.saves_offset + i];
+        if (slot < nslots) slots[slot] = pos;
+    }
+}
+
+bool onepass_run_len(onepass_t *op, const char *data, size_t len, size_t *slots, int nslots) {
+    size_t caps[nslots];
+    for (int i = 0; i < nslots; i++)
+        caps[i] = CAPTURE_UNSET;
+
+    const uint8_t *sp = (const uint8_t*) data;
+    int state = 0;
+    for (size_t pos = 0; pos < len; pos++) {
+        int action = op->trans[state * 256 + sp[pos]];
+        if (action < 0) return false;
+        onepass_apply(op, action, caps, nslots, pos);
+        state = op->actions[action].next;
+    }
+
+    int action = op->match[state];
+    if (action < 0) return false;
+    onepass_apply(op, action, caps, nslots, len);
+
+    memcpy(slots, caps, nslots * sizeof(size_t));
+    if (nslots >= 2) {
+        slots[0] = 0;
+        slots[1] = len;
+    }
+    return true;
+}
+
+bool onepass_run(onepass_t *op, const char *str, size_t *slots, int nslots) {
+    return onepass_run_len(op, str, strlen(str), slots, nslots);
+}
+
+// full match of data[0, len), filling in up to nslots capture slots
+bool vm_run_captures_len(vm_program_t *prog, const char *data, size_t len, size_t *slots, int nslots) {
+    // nothing asked for, no need to track anything
+    if (nslots == 0) return vm_run_len(prog, data, len);
+
+    if (prog->onepass != NULL) return onepass_run_len(prog->onepass, data, len, slots, nslots);
+    return pike_run_len(prog, data, len, slots, nslots);
+}
+
+bool vm_run_captures(vm_program_t *prog, const char *str, size_t *slots, int nslots) {
+    return vm_run_captures_len(prog, str, strlen(str), slots, nslots);
+}
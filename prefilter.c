@@ -0,0 +1,368 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Required literals. For every node we work out sets of strings such that
+// every match of the node
+//
+//   exact:  is one of them
+//   prefix: starts with one of them
+//   suffix: ends with one of them
+//   inner:  contains one of them
+//
+// A set with length 0 means we don't know anything. Sets that contain the
+// empty string are fine while combining (think `a?`), but useless as a filter.
+
+typedef struct {
+    literal_set_t exact;
+    literal_set_t prefix;
+    literal_set_t suffix;
+    literal_set_t inner;
+} literal_info_t;
+
+// how to handle strings that get too long
+#define LIT_EXACT 0  // give up
+#define LIT_HEAD 1   // keep the start (prefixes, inner)
+#define LIT_TAIL 2   // keep the end (suffixes)
+
+bool literal_set_add(literal_set_t *set, const char *str, int length, int mode) {
+    if (length > LITERAL_MAX_LENGTH) {
+        if (mode == LIT_EXACT) return false;
+        if (mode == LIT_TAIL) str += length - LITERAL_MAX_LENGTH;
+        length = LITERAL_MAX_LENGTH;
+    }
+
+    for (int i = 0; i < set->length; i++)
+        if (set->lengths[i] == length && memcmp(set->strs[i], str, length) == 0)
+            return true;
+
+    if (set->length == LITERAL_SET_MAX) return false;
+    memcpy(set->strs[set->length], str, length);
+    set->lengths[set->length++] = length;
+    return true;
+}
+
+// out = a | b, fails (length 0) if it gets too big
+void literal_set_union(const literal_set_t *a, const literal_set_t *b, literal_set_t *out) {
+    out->length = 0;
+    if (a->length == 0 || b->length == 0) return;
+
+    for (int i = 0; i < a->length; i++)
+        literal_set_add(out, a->strs[i], a->lengths[i], LIT_HEAD);
+    for (int i = 0; i < b->length; i++) {
+        if (!literal_set_add(out, b->strs[i], b->lengths[i], LIT_HEAD)) {
+            out->length = 0;
+            return;
+        }
+    }
+}
+
+// out = every string of a followed by every string of b
+void literal_set_cross(const literal_set_t *a, const literal_set_t *b, literal_set_t *out, int mode) {
+    out->length = 0;
+    if (a->length == 0 || b->length == 0 || a->length * b->length > LITERAL_SET_MAX) return;
+
+    char buf[2 * LITERAL_MAX_LENGTH];
+    for (int i = 0; i < a->length; i++) {
+        for (int j = 0; j < b->length; j++) {
+            memcpy(buf, a->strs[i], a->lengths[i]);
+            memcpy(buf + a->lengths[i], b->strs[j], b->lengths[j]);
+            if (!literal_set_add(out, buf, a->lengths[i] + b->lengths[j], mode)) {
+                out->length = 0;
+                return;
+            }
+        }
+    }
+}
+
+int literal_set_min_length(const literal_set_t *set) {
+    int min = LITERAL_MAX_LENGTH;
+    for (int i = 0; i < set->length; i++)
+        if (set->lengths[i] < min) min = set->lengths[i];
+    return min;
+}
+
+// is `a` a better filter than `b`? longer shortest strings, then fewer strings
+bool literal_set_better(const literal_set_t *a, const literal_set_t *b) {
+    if (a->length == 0) return false;
+    if (b->length == 0) return true;
+    int la = literal_set_min_length(a), lb = literal_set_min_length(b);
+    if (la != lb) return la > lb;
+    return a->length < b->length;
+}
+
+// drop strings that are implied by another one, e.g. "world0" when "world" is
+// a prefix too. With `anywhere` the other string can be inside, for inner sets.
+void literal_set_reduce(literal_set_t *set, int mode, bool anywhere) {
+    literal_set_t out;
+    out.length = 0;
+    for (int i = 0; i < set->length; i++) {
+        bool implied = false;
+        for (int j = 0; j < set->length && !implied; j++) {
+            if (i == j) continue;
+            int li = set->lengths[i], lj = set->lengths[j];
+            if (lj > li || (lj == li && j > i)) continue;
+
+            if (anywhere) {
+                for (int k = 0; k + lj <= li && !implied; k++)
+                    implied = memcmp(set->strs[i] + k, set->strs[j], lj) == 0;
+            } else {
+                int k = mode == LIT_TAIL ? li - lj : 0;
+                implied = memcmp(set->strs[i] + k, set->strs[j], lj) == 0;
+            }
+        }
+        if (!implied) literal_set_add(&out, set->strs[i], set->lengths[i], LIT_HEAD);
+    }
+    *set = out;
+}
+
+const literal_set_t *exact_or(const literal_set_t *exact, const literal_set_t *other) {
+    return exact->length > 0 ? exact : other;
+}
+
+// the best inner set out of everything we know about a node
+void literal_info_best_inner(literal_info_t *info) {
+    if (literal_set_better(&info->exact, &info->inner)) info->inner = info->exact;
+    if (literal_set_better(&info->prefix, &info->inner)) info->inner = info->prefix;
+    if (literal_set_better(&info->suffix, &info->inner)) info->inner = info->suffix;
+}
+
+// info for `a` followed by `b`
+void literal_info_concat(const literal_info_t *a, const literal_info_t *b, literal_info_t *out) {
+    literal_set_cross(&a->exact, &b->exact, &out->exact, LIT_EXACT);
+
+    if (a->exact.length > 0) {
+        literal_set_cross(&a->exact, exact_or(&b->exact, &b->prefix), &out->prefix, LIT_HEAD);
+        if (out->prefix.length == 0) out->prefix = a->exact;
+    } else {
+        out->prefix = a->prefix;
+    }
+
+    if (b->exact.length > 0) {
+        literal_set_cross(exact_or(&a->exact, &a->suffix), &b->exact, &out->suffix, LIT_TAIL);
+        if (out->suffix.length == 0) out->suffix = b->exact;
+    } else {
+        out->suffix = b->suffix;
+    }
+
+    out->inner = a->inner;
+    if (literal_set_better(&b->inner, &out->inner)) out->inner = b->inner;
+    literal_set_t across;
+    literal_set_cross(exact_or(&a->exact, &a->suffix), exact_or(&b->exact, &b->prefix), &across, LIT_HEAD);
+    if (literal_set_better(&across, &out->inner)) out->inner = across;
+    literal_info_best_inner(out);
+}
+
+void literal_info_node(regex_node_t *node, literal_info_t *info) {
+    info->exact.length = 0;
+    info->prefix.length = 0;
+    info->suffix.length = 0;
+    info->inner.length = 0;
+
+    if (node->tag == NODE_LITERAL) {
+        if (!literal_set_add(&info->exact, node->literal.str, node->literal.length, LIT_EXACT)) {
+            literal_set_add(&info->prefix, node->literal.str, node->literal.length, LIT_HEAD);
+            literal_set_add(&info->suffix, node->literal.str, node->literal.length, LIT_TAIL);
+        }
+
+    } else if (node->tag == NODE_NULL) {
+        literal_set_add(&info->exact, "", 0, LIT_EXACT);
+
+    } else if (node->tag == NODE_SEQUENCE) {
+        literal_set_add(&info->exact, "", 0, LIT_EXACT);
+        for (int i = 0; i < node->sequence.length; i++) {
+            literal_info_t el, acc = *info;
+            literal_info_node(node->sequence.list[i], &el);
+            literal_info_concat(&acc, &el, info);
+        }
+
+    } else if (node->tag == NODE_ALTERNATE) {
+        for (int i = 0; i < node->sequence.length; i++) {
+            literal_info_t el, acc = *info;
+            literal_info_node(node->sequence.list[i], &el);
+            if (i == 0) {
+                *info = el;
+                continue;
+            }
+            literal_set_union(&acc.exact, &el.exact, &info->exact);
+            literal_set_union(exact_or(&acc.exact, &acc.prefix), exact_or(&el.exact, &el.prefix), &info->prefix);
+            literal_set_union(exact_or(&acc.exact, &acc.suffix), exact_or(&el.exact, &el.suffix), &info->suffix);
+            literal_set_union(&acc.inner, &el.inner, &info->inner);
+        }
+
+    } else if (node->tag == NODE_REPEAT) {
+        literal_info_t el;
+        literal_info_node(node->repeat.el, &el);
+
+        if (node->repeat.min == 0 && node->repeat.max == 1) {
+            literal_set_t empty;
+            empty.length = 0;
+            literal_set_add(&empty, "", 0, LIT_EXACT);
+            literal_set_union(&el.exact, &empty, &info->exact);
+        } else if (node->repeat.min >= 1) {
+            // every match has at least one copy of el
+            info->prefix = *exact_or(&el.exact, &el.prefix);
+            info->suffix = *exact_or(&el.exact, &el.suffix);
+            info->inner = el.inner;
+            if (node->repeat.max == 1) info->exact = el.exact;
+        }
+        // with min == 0 (and no upper bound) nothing is required
+
+    } else if (node->tag == NODE_GROUP) {
+        literal_info_node(node->group.el, info);
+    }
+
+    literal_info_best_inner(info);
+}
+
+// sets with the empty string in them don't filter anything
+bool literal_set_usable(const literal_set_t *set) {
+    return set->length > 0 && literal_set_min_length(set) > 0;
+}
+
+prefilter_t *prefilter_build(regex_node_t *node) {
+    literal_info_t info;
+    literal_info_node(node, &info);
+
+    prefilter_t *pf = (prefilter_t*) malloc(sizeof(prefilter_t));
+    pf->prefix = *exact_or(&info.exact, &info.prefix);
+    pf->suffix = *exact_or(&info.exact, &info.suffix);
+    pf->inner = info.inner;
+
+    literal_set_reduce(&pf->prefix, LIT_HEAD, false);
+    literal_set_reduce(&pf->suffix, LIT_TAIL, false);
+    literal_set_reduce(&pf->inner, LIT_HEAD, true);
+
+    if (!literal_set_usable(&pf->prefix)) pf->prefix.length = 0;
+    if (!literal_set_usable(&pf->suffix)) pf->suffix.length = 0;
+    if (!literal_set_usable(&pf->inner)) pf->inner.length = 0;
+
+    if (pf->prefix.length == 0 && pf->inner.length == 0) {
+        free(pf);
+        return NULL;
+    }
+    return pf;
+}
+
+// Scanning. Candidates are found 16 (SSE2) or 32 (AVX2) bytes at a time by
+// comparing against the first byte of every literal, and for a single literal
+// also its last byte, then verified with memcmp.
+
+bool literal_set_match_at(const literal_set_t *set, const char *p, const char *end) {
+    for (int i = 0; i < set->length; i++) {
+        int n = set->lengths[i];
+        if (end - p >= n && p[0] == set->strs[i][0] && memcmp(p, set->strs[i], n) == 0)
+            return true;
+    }
+    return false;
+}
+
+const char *literal_set_find_scalar(const literal_set_t *set, const char *p, const char *end) {
+    bool first[256] = {false};
+    for (int i = 0; i < set->length; i++)
+        first[(uint8_t) set->strs[i][0]] = true;
+
+    for (; p < end; p++)
+        if (first[(uint8_t) *p] && literal_set_match_at(set, p, end)) return p;
+    return NULL;
+}
+
+#if defined(__x86_64__)
+
+#define FIND_MAX_FIRST 8 // different first bytes we'll compare against
+
+int literal_set_first_bytes(const literal_set_t *set, uint8_t *firsts) {
+    int n = 0;
+    for (int i = 0; i < set->length; i++) {
+        uint8_t c = set->strs[i][0];
+        bool seen = false;
+        for (int j = 0; j < n; j++) seen |= firsts[j] == c;
+        if (seen) continue;
+        if (n == FIND_MAX_FIRST) return -1;
+        firsts[n++] = c;
+    }
+    return n;
+}
+
+const char *literal_set_find_sse2(const literal_set_t *set, const char *p, const char *end) {
+    uint8_t firsts[FIND_MAX_FIRST];
+    int nfirst = literal_set_first_bytes(set, firsts);
+    if (nfirst < 0) return literal_set_find_scalar(set, p, end);
+
+    // for a single literal the last byte has to match too
+    int last_off = set->length == 1 ? set->lengths[0] - 1 : 0;
+    __m128i last = _mm_set1_epi8(set->strs[0][last_off]);
+    __m128i first[FIND_MAX_FIRST];
+    for (int i = 0; i < nfirst; i++)
+        first[i] = _mm_set1_epi8(firsts[i]);
+
+    for (; end - p >= 16 + last_off; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        __m128i eq = _mm_cmpeq_epi8(block, first[0]);
+        for (int i = 1; i < nfirst; i++)
+            eq = _mm_or_si128(eq, _mm_cmpeq_epi8(block, first[i]));
+        if (set->length == 1) {
+            __m128i tail = _mm_loadu_si128((const __m128i*) (p + last_off));
+            eq = _mm_and_si128(eq, _mm_cmpeq_epi8(tail, last));
+        }
+
+        unsigned mask = _mm_movemask_epi8(eq);
+        while (mask != 0) {
+            const char *cand = p + __builtin_ctz(mask);
+            if (literal_set_match_at(set, cand, end)) return cand;
+            mask &= mask - 1;
+        }
+    }
+    return literal_set_find_scalar(set, p, end);
+}
+
+__attribute__((target("avx2")))
+const char *literal_set_find_avx2(const literal_set_t *set, const char *p, const char *end) {
+    uint8_t firsts[FIND_MAX_FIRST];
+    int nfirst = literal_set_first_bytes(set, firsts);
+    if (nfirst < 0) return literal_set_find_scalar(set, p, end);
+
+    int last_off = set->length == 1 ? set->lengths[0] - 1 : 0;
+    __m256i last = _mm256_set1_epi8(set->strs[0][last_off]);
+    __m256i first[FIND_MAX_FIRST];
+    for (int i = 0; i < nfirst; i++)
+        first[i] = _mm256_set1_epi8(firsts[i]);
+
+    for (; end - p >= 32 + last_off; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) p);
+        __m256i eq = _mm256_cmpeq_epi8(block, first[0]);
+        for (int i = 1; i < nfirst; i++)
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(block, first[i]));
+        if (set->length == 1) {
+            __m256i tail = _mm256_loadu_si256((const __m256i*) (p + last_off));
+            eq = _mm256_and_si256(eq, _mm256_cmpeq_epi8(tail, last));
+        }
+
+        unsigned mask = _mm256_movemask_epi8(eq);
+        while (mask != 0) {
+            const char *cand = p + __builtin_ctz(mask);
+            if (literal_set_match_at(set, cand, end)) return cand;
+            mask &= mask - 1;
+        }
+    }
+    return literal_set_find_sse2(set, p, end);
+}
+
+#endif
+
+// first position in [p, end) where one of the literals starts, or NULL
+const char *literal_set_find(const literal_set_t *set, const char *p, const char *end) {
+#if defined(__x86_64__)
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) return literal_set_find_avx2(set, p, end);
+    return literal_set_find_sse2(set, p, end);
+#else
+    return literal_set_find_scalar(set, p, end);
+#endif
+}
@@ -0,0 +1,219 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// rjit_regex_t and its scratch: everything a match needs is allocated up
+// front, so the match path is just one of the engines over memory the caller
+// already has.
+//
+// Which engine is rjit_plan's call, from what rjit_plan_build found out about
+// the program and the length of the string. The order comes from the
+// engines' benchmarks in main.c:
+//
+//   - the lazy DFA is a table lookup per byte once its states are built,
+//     ahead of everything else there. Its cache is per scratch, and once it
+//     has given up on a pattern (too many states) it's not tried again.
+//     Until the scratch has run RJIT_PLAN_DFA_WARMUP bytes, a string shorter
+//     than that goes to the engines below, so a few short strings don't pay
+//     for building states
+//   - a one word bitnfa, which needs no warming up
+//   - a 4 word bitnfa once the dfa has had too many states: that many
+//     states means lots of live threads, which the JIT and the vm step one
+//     at a time
+//   - JIT code (patterns that fit a one word bitnfa don't get any)
+//   - the backtracker, for strings short enough for its bitmap, unless the
+//     pattern starts with something like .* that it would have to back out of
+//   - the vm
+//
+// A string without the literals every match needs is turned down before any
+// of them run.
+
+// the pattern can start by skipping any bytes: an OP_ANY at the start that
+// loops back to itself
+bool rjit_plan_floating(const vm_program_t *prog) {
+    for (int k = prog->eps_offsets[0]; k < prog->eps_offsets[1]; k++) {
+        int pc = prog->eps[k];
+        if (prog->insts[pc].op != OP_ANY) continue;
+        for (int j = prog->eps_offsets[pc + 1]; j < prog->eps_offsets[pc + 2]; j++)
+            if (prog->eps[j] == pc) return true;
+    }
+    return false;
+}
+
+void rjit_plan_build(rjit_regex_t *re) {
+    vm_program_t *prog = re->prog;
+    rjit_plan_t *plan = &re->plan;
+    plan->insts = prog->insts_length;
+    plan->literals = prog->prefilter != NULL;
+    plan->closures = prog->eps != NULL;
+    plan->anchored = plan->closures && !rjit_plan_floating(prog);
+    plan->onepass = prog->onepass != NULL;
+    plan->bitnfa_words = prog->bitnfa != NULL ? prog->bitnfa->nwords : 0;
+    plan->jit = re->jit != NULL;
+}
+
+rjit_regex_t *rjit_regex_compile(const char *pattern, int flags) {
+    rjit_regex_t *re = (rjit_regex_t*) malloc(sizeof(rjit_regex_t));
+    re->pattern = strdup(pattern);
+    re->flags = flags;
+    re->prog = regex_compile_bytecode(re->pattern);
+    if (re->prog == NULL) {
+        free(re->pattern);
+        free(re);
+        return NULL;
+    }
+    re->jit = NULL;
+    bool jit = !BITNFA_PREFERRED(re->prog) || RJIT_FORCED(flags) == RJIT_ENGINE_JIT;
+    if (!(flags & RJIT_NO_JIT) && jit)
+        re->jit = (match_scratch_fn_t) jit_compile(re->prog, JIT_MATCH_SCRATCH);
+    rjit_plan_build(re);
+    return re;
+}
+
+// roughly what the regex keeps alive, not counting the one-pass tables
+size_t rjit_regex_bytes(const rjit_regex_t *re) {
+    size_t bytes = sizeof(rjit_regex_t) + strlen(re->pattern) + 1;
+    bytes += sizeof(vm_program_t) + re->prog->arena.bytes;
+    if (re->prog->bitnfa != NULL) bytes += bitnfa_size(re->prog->bitnfa);
+    if (re->jit != NULL) bytes += code_heap_size((void*) re->jit);
+    return bytes;
+}
+
+void rjit_regex_free(rjit_regex_t *re) {
+    if (re->jit != NULL) code_heap_free((void*) re->jit);
+    vm_program_free(re->prog);
+    free(re->pattern);
+    free(re);
+}
+
+rjit_scratch_t *rjit_scratch_new(const rjit_regex_t *re) {
+    rjit_engine_t forced = RJIT_FORCED(re->flags);
+    rjit_scratch_t *s = (rjit_scratch_t*) malloc(sizeof(rjit_scratch_t));
+    s->dfa = NULL;
+    s->vm = NULL;
+    s->bt = NULL;
+    s->jit = NULL;
+    s->bytes = 0;
+    if (forced == RJIT_ENGINE_AUTO || forced == RJIT_ENGINE_DFA)
+        s->dfa = dfa_cache_create(re->prog, DFA_DEFAULT_BUDGET);
+    if (re->jit != NULL)
+        s->jit = malloc(MATCH_JIT_SCRATCH_SIZE(re->prog->insts_length));
+    // the last resort if there's no JIT code or one word bitnfa
+    bool nfa = re->jit == NULL && !BITNFA_PREFERRED(re->prog);
+    if (nfa || forced == RJIT_ENGINE_VM || forced == RJIT_ENGINE_BACKTRACK) {
+        s->vm = vm_scratch_new(re->prog);
+        if (re->prog->eps != NULL) s->bt = backtrack_scratch_new(re->prog);
+    }
+    return s;
+}
+
+void rjit_scratch_free(rjit_scratch_t *s) {
+    if (s->dfa != NULL) dfa_cache_free(s->dfa);
+    if (s->vm != NULL) vm_scratch_free(s->vm);
+    if (s->bt != NULL) backtrack_scratch_free(s->bt);
+    free(s->jit);
+    free(s);
+}
+
+const char *rjit_engine_name(rjit_engine_t engine) {
+    switch (engine) {
+    case RJIT_ENGINE_AUTO: return "auto";
+    case RJIT_ENGINE_DFA: return "dfa";
+    case RJIT_ENGINE_BITNFA: return "bitnfa";
+    case RJIT_ENGINE_JIT: return "jit";
+    case RJIT_ENGINE_BACKTRACK: return "backtrack";
+    case RJIT_ENGINE_VM: return "vm";
+    }
+    return "?";
+}
+
+// whether rjit_match could run data[0, len) with `engine`
+bool rjit_plan_can(const rjit_regex_t *re, const rjit_scratch_t *s, rjit_engine_t engine, size_t len) {
+    switch (engine) {
+    case RJIT_ENGINE_DFA: return s->dfa != NULL;
+    case RJIT_ENGINE_BITNFA: return re->prog->bitnfa != NULL;
+    case RJIT_ENGINE_JIT: return re->jit != NULL;
+    case RJIT_ENGINE_BACKTRACK: return s->bt != NULL && BACKTRACK_FITS(re->prog, len);
+    case RJIT_ENGINE_VM: return s->vm != NULL;
+    default: return false;
+    }
+}
+
+// The engine rjit_match would use for a string of `len` bytes with this
+// scratch, and in `why` (if not NULL) the reason, for tuning.
+rjit_engine_t rjit_plan(const rjit_regex_t *re, const rjit_scratch_t *s, size_t len, const char **why) {
+    const rjit_plan_t *plan = &re->plan;
+    const char *reason;
+    rjit_engine_t engine;
+
+    rjit_engine_t forced = RJIT_FORCED(re->flags);
+    bool dfa_gave_up = s->dfa != NULL && s->dfa->nfa_fallbacks > 0;
+    bool dfa_warm = len >= RJIT_PLAN_DFA_WARMUP || s->bytes >= RJIT_PLAN_DFA_WARMUP;
+    if (forced != RJIT_ENGINE_AUTO && rjit_plan_can(re, s, forced, len)) {
+        engine = forced;
+        reason = "forced with RJIT_FORCE";
+    } else if (s->dfa != NULL && !dfa_gave_up && dfa_warm) {
+        engine = RJIT_ENGINE_DFA;
+        reason = "a table lookup per byte once its states are cached";
+    } else if (plan->bitnfa_words == 1) {
+        engine = RJIT_ENGINE_BITNFA;
+        reason = dfa_gave_up ? "fits a one word bitnfa, and the dfa had too many states"
+               : s->dfa != NULL ? "fits a one word bitnfa, and a short string isn't worth building dfa states for yet"
+               : "fits a one word bitnfa";
+    } else if (plan->bitnfa_words == 4 && dfa_gave_up) {
+        engine = RJIT_ENGINE_BITNFA;
+        reason = "the dfa had too many states, and the bitnfa steps all the live threads at once";
+    } else if (plan->jit) {
+        engine = RJIT_ENGINE_JIT;
+        reason = dfa_gave_up ? "jit code, and the dfa had too many states"
+               : s->dfa != NULL ? "jit code, and a short string isn't worth building dfa states for yet"
+               : "jit code";
+    } else if (plan->anchored && rjit_plan_can(re, s, RJIT_ENGINE_BACKTRACK, len)) {
+        engine = RJIT_ENGINE_BACKTRACK;
+        reason = "no jit code, and the string is short enough for the backtracker's bitmap";
+    } else {
+        engine = RJIT_ENGINE_VM;
+        reason = !plan->closures ? "no jit code, and too big for the backtracker"
+               : !plan->anchored ? "no jit code, and the pattern starts like .* so the backtracker would back out of it"
+               : "no jit code, and the string is too long for the backtracker";
+    }
+    if (forced != RJIT_ENGINE_AUTO && engine != forced)
+        reason = "the forced engine isn't there for this pattern or string, picked as if not forced";
+
+    if (why != NULL) *why = reason;
+    return engine;
+}
+
+// false if data[0, len) can't have the literals every match of the pattern needs
+bool rjit_plan_literals(const prefilter_t *pf, const char *data, size_t len) {
+    if (pf->prefix.length > 0) return literal_set_match_at(&pf->prefix, data, data + len);
+    if (len < RJIT_PLAN_SCAN_MIN_LEN) return true;
+    return literal_set_find(&pf->inner, data, data + len) != NULL;
+}
+
+// full match of data[0, len)
+bool rjit_match(const rjit_regex_t *re, rjit_scratch_t *s, const char *data, size_t len) {
+    if (re->plan.literals && !rjit_plan_literals(re->prog->prefilter, data, len)) return false;
+
+    rjit_engine_t engine = rjit_plan(re, s, len, NULL);
+    s->bytes += len;
+    switch (engine) {
+    case RJIT_ENGINE_DFA: {
+        int st = dfa_final_state(s->dfa, data, len);
+        if (st >= 0) return s->dfa->states[st].match;
+        s->dfa->nfa_fallbacks++; // so rjit_plan won't pick it again
+        if (RJIT_FORCED(re->flags) == RJIT_ENGINE_DFA) return vm_run_len(re->prog, data, len);
+        s->bytes -= len; // the next try counts them again
+        return rjit_match(re, s, data, len);
+    }
+    case RJIT_ENGINE_BITNFA:
+        return bitnfa_run_len(re->prog->bitnfa, data, len);
+    case RJIT_ENGINE_JIT:
+        return re->jit(data, len, s->jit);
+    case RJIT_ENGINE_BACKTRACK:
+        return backtrack_run(s->bt, data, len);
+    default:
+        return vm_run_code(s->vm, data, len);
+    }
+}
@@ -6,55 +6,229 @@
 #include <errno.h>
 #include <ctype.h>
 
-#include <sys/mman.h>
-#include <pthread.h>
-#include <libkern/OSCacheControl.h>
 
-#include <re2/re2.h>
-
-regex_node_t *regex_node_allocate(regex_node_tag_t tag) {
-    regex_node_t *node = (regex_node_t *) malloc(sizeof(regex_node_t));
+regex_node_t *regex_node_allocate(arena_t *arena, regex_node_tag_t tag) {
+    regex_node_t *node = (regex_node_t *) arena_alloc(arena, sizeof(regex_node_t));
     node->tag = tag;
+    node->next = NULL;
     return node;
 }
 
-void regex_node_free(regex_node_t *node) { free(node); }
+// keeps the first error, the parse then unwinds with NULL
+void *parse_error(const char **error, const char *msg) {
+    if (*error == NULL) *error = msg;
+    return NULL;
+}
+
+// the ranges of \w and friends, at most 5 of them
+int special_ranges(regex_special_literal_t special, char *starts, char *ends) {
+    const char *pos; // start and end of each range
+    bool invert = special == META_NON_WORD_CHAR || special == META_NON_DIGIT_CHAR ||
+                  special == META_NON_WHITESPACE_CHAR;
+    if (special == META_WORD_CHAR || special == META_NON_WORD_CHAR) pos = "09AZ__az";
+    else if (special == META_DIGIT_CHAR || special == META_NON_DIGIT_CHAR) pos = "09";
+    else pos = "\t\r  ";
+
+    int n = strlen(pos) / 2;
+    int length = 0;
+    if (!invert) {
+        for (int i = 0; i < n; i++, length++) {
+            starts[length] = pos[2*i];
+            ends[length] = pos[2*i + 1];
+        }
+        return length;
+    }
+
+    // the gaps between them
+    int lo = 0;
+    for (int i = 0; i < n; i++) {
+        if ((uint8_t) pos[2*i] > lo) {
+            starts[length] = lo;
+            ends[length++] = pos[2*i] - 1;
+        }
+        lo = (uint8_t) pos[2*i + 1] + 1;
+    }
+    if (lo <= 255) {
+        starts[length] = lo;
+        ends[length++] = (char) 255;
+    }
+    return length;
+}
+
+// after a '\': NULL for a class like \w (in `special`) or an error,
+// otherwise where the byte it stands for is
+const char *regex_parse_escape(const char **pattern, regex_special_literal_t *special, const char **error) {
+    char c = **pattern;
+    if (c == '\0') return (const char*) parse_error(error, "Expected something after '\\'");
+    *pattern = *pattern + 1;
+
+    switch (c) {
+    case 'w': *special = META_WORD_CHAR; return NULL;
+    case 'W': *special = META_NON_WORD_CHAR; return NULL;
+    case 'd': *special = META_DIGIT_CHAR; return NULL;
+    case 'D': *special = META_NON_DIGIT_CHAR; return NULL;
+    case 's': *special = META_WHITESPACE_CHAR; return NULL;
+    case 'S': *special = META_NON_WHITESPACE_CHAR; return NULL;
+    case 'n': return "\n";
+    case 't': return "\t";
+    case 'r': return "\r";
+    }
+    if (isalnum(c)) return (const char*) parse_error(error, "Unknown escape");
+    return *pattern - 1; // \. \\ \[ and so on
+}
+
+// [...], after the '['. A ']' right at the start and a '-' at either end
+// stand for themselves
+regex_node_t *regex_parse_class(arena_t *arena, const char **pattern, const char **error) {
+    regex_node_t *node = regex_node_allocate(arena, NODE_CHAR_CLASS);
+    node->char_class.invert = false;
+    if (**pattern == '^') {
+        node->char_class.invert = true;
+        *pattern = *pattern + 1;
+    }
+
+    int capacity = 16, length = 0;
+    char *starts = (char*) malloc(capacity);
+    char *ends = (char*) malloc(capacity);
+
+    for (bool first = true; first || **pattern != ']'; first = false) {
+        if (length + 5 > capacity) {
+            capacity *= 2;
+            starts = (char*) realloc(starts, capacity);
+            ends = (char*) realloc(ends, capacity);
+        }
+
+        char c = **pattern;
+        if (c == '\0') {
+            parse_error(error, "Expected ']'");
+            break;
+        }
+        *pattern = *pattern + 1;
+
+        char lo = c;
+        if (c == '\\') {
+            regex_special_literal_t special;
+            const char *esc = regex_parse_escape(pattern, &special, error);
+            if (*error != NULL) break;
+            if (esc == NULL) {
+                length += special_ranges(special, starts + length, ends + length);
+                continue;
+            }
+            lo = *esc;
+        }
+
+        char hi = lo;
+        if ((*pattern)[0] == '-' && (*pattern)[1] != ']' && (*pattern)[1] != '\0') {
+            *pattern = *pattern + 2;
+            hi = (*pattern)[-1];
+            if (hi == '\\') {
+                regex_special_literal_t special;
+                const char *esc = regex_parse_escape(pattern, &special, error);
+                if (*error != NULL) break;
+                if (esc == NULL) {
+                    parse_error(error, "Range can't end in a class");
+                    break;
+                }
+                hi = *esc;
+            }
+            if ((uint8_t) hi < (uint8_t) lo) {
+                parse_error(error, "Range out of order");
+                break;
+            }
+        }
+        starts[length] = lo;
+        ends[length++] = hi;
+    }
+    if (*error != NULL) {
+        free(starts);
+        free(ends);
+        return NULL;
+    }
+    *pattern = *pattern + 1; // the ']'
+
+    char *s = (char*) arena_alloc(arena, 2 * length);
+    memcpy(s, starts, length);
+    memcpy(s + length, ends, length);
+    node->char_class.char_starts = s;
+    node->char_class.char_ends = s + length;
+    node->char_class.length = length;
+
+    free(starts);
+    free(ends);
+    return node;
+}
 
-void parse_error(const char *msg) {
-    printf("Oops: %s\n", msg);
-    exit(-1);
+// {m}, {m,} or {m,n}, after the '{'. Only moves past it if it is one,
+// otherwise the '{' is a literal. Bad counts are an error, and not a count
+bool regex_parse_count(const char **pattern, int *min, int *max, const char **error) {
+    const char *p = *pattern;
+    if (!isdigit(*p)) return false;
+    long lo = 0, hi;
+    for (; isdigit(*p); p++) lo = lo < 100000 ? 10 * lo + (*p - '0') : lo;
+    hi = lo;
+    if (*p == ',') {
+        p++;
+        hi = -1;
+        if (isdigit(*p))
+            for (hi = 0; isdigit(*p); p++) hi = hi < 100000 ? 10 * hi + (*p - '0') : hi;
+    }
+    if (*p != '}') return false;
+
+    if (lo > REGEX_MAX_REPEAT || hi > REGEX_MAX_REPEAT) parse_error(error, "Repetition count too big");
+    else if (hi >= 0 && hi < lo) parse_error(error, "Repetition counts out of order");
+    if (*error != NULL) return false;
+    *min = lo;
+    *max = hi;
+    *pattern = p + 1;
+    return true;
 }
 
-regex_node_t *regex_parse(const char **pattern) {
+regex_node_t *regex_parse(arena_t *arena, const char **pattern, const char **error) {
     // linked list of nodes in this sequence
-    regex_node_t *head = regex_node_allocate(NODE_NULL);
+    regex_node_t *head = regex_node_allocate(arena, NODE_NULL);
     regex_node_t *current = head;
     int seqlength = 0;
 
     char c = **pattern;
     while (c != '\0' && c != '|' && c != ')') {
         *pattern = *pattern + 1; // consume it
+        int min, max;
 
         regex_node_t *next = NULL;
         if (c == '(') {
-            next = regex_parse(pattern);
+            next = regex_node_allocate(arena, NODE_GROUP);
+            next->group.el = regex_parse(arena, pattern, error);
+            next->group.index = 0; // see regex_number_groups
 
-            if (**pattern != ')') parse_error("Expected ')'");
+            if (next->group.el == NULL) return NULL;
+            if (**pattern != ')') return (regex_node_t*) parse_error(error, "Expected ')'");
             *pattern = *pattern + 1;
 
-        } else if (isalpha(c) || isdigit(c)) {
-            next = regex_node_allocate(NODE_LITERAL);
-            next->literal.str = *pattern - 1;
-            next->literal.length = 1;
-
         } else if (c == '.') {
-            next = regex_node_allocate(NODE_ANY);
+            next = regex_node_allocate(arena, NODE_ANY);
+
+        } else if (c == '[') {
+            next = regex_parse_class(arena, pattern, error);
+            if (next == NULL) return NULL;
+
+        } else if (c == '\\') {
+            regex_special_literal_t special;
+            const char *esc = regex_parse_escape(pattern, &special, error);
+            if (*error != NULL) return NULL;
+            if (esc == NULL) {
+                next = regex_node_allocate(arena, NODE_SPECIAL_LITERAL);
+                next->special = special;
+            } else {
+                next = regex_node_allocate(arena, NODE_LITERAL);
+                next->literal.str = esc;
+                next->literal.length = 1;
+            }
 
-        } else if (c == '?' || c == '*' || c == '+') {
+        } else if (c == '?' || c == '*' || c == '+' || (c == '{' && regex_parse_count(pattern, &min, &max, error))) {
             if (current->tag == NODE_NULL || current->tag == NODE_REPEAT)
-                parse_error("Cannot use repetition here");
+                return (regex_node_t*) parse_error(error, "Cannot use repetition here");
 
-            regex_node_t *el = regex_node_allocate(NODE_NULL);
+            regex_node_t *el = regex_node_allocate(arena, NODE_NULL);
             *el = *current; // copy current node
 
             current->tag = NODE_REPEAT; // change current into a repeat node
@@ -63,6 +237,12 @@ regex_node_t *regex_parse(const char **pattern) {
             if (c == '?') { current->repeat.min = 0; current->repeat.max = 1; }
             if (c == '*') { current->repeat.min = 0; current->repeat.max = -1; }
             if (c == '+') { current->repeat.min = 1; current->repeat.max = -1; }
+            if (c == '{') { current->repeat.min = min; current->repeat.max = max; }
+
+        } else { // anything else stands for itself
+            next = regex_node_allocate(arena, NODE_LITERAL);
+            next->literal.str = *pattern - 1;
+            next->literal.length = 1;
         }
 
         if (next != NULL) { // did we add to the sequence?
@@ -71,12 +251,13 @@ regex_node_t *regex_parse(const char **pattern) {
             current = next;
         }
 
+        if (*error != NULL) return NULL; // a bad count
         c = **pattern; // peek
     }
     
-    regex_node_t *seq = regex_node_allocate(NODE_SEQUENCE);
+    regex_node_t *seq = regex_node_allocate(arena, NODE_SEQUENCE);
     seq->sequence.length = seqlength;
-    seq->sequence.list = (regex_node_t **) malloc(seqlength * sizeof(regex_node_t *));
+    seq->sequence.list = (regex_node_t **) arena_alloc(arena, seqlength * sizeof(regex_node_t *));
 
     head = head->next; // get rid of the null node
     for (int i = 0; head != NULL; i++, head = head->next) {
@@ -86,12 +267,13 @@ regex_node_t *regex_parse(const char **pattern) {
     if (c == '|') { // make things simple: only two alternatives per node
         *pattern = *pattern + 1; // consume it
 
-        regex_node_t *alt = regex_node_allocate(NODE_ALTERNATE);
+        regex_node_t *alt = regex_node_allocate(arena, NODE_ALTERNATE);
         alt->sequence.length = 2;
-        alt->sequence.list = (regex_node_t **) malloc(2 * sizeof(regex_node_t *));
+        alt->sequence.list = (regex_node_t **) arena_alloc(arena, 2 * sizeof(regex_node_t *));
 
         alt->sequence.list[0] = seq;
-        alt->sequence.list[1] = regex_parse(pattern);
+        alt->sequence.list[1] = regex_parse(arena, pattern, error);
+        if (alt->sequence.list[1] == NULL) return NULL;
 
         return alt;
     }
@@ -102,9 +284,7 @@ regex_node_t *regex_parse(const char **pattern) {
 // remove sequence nodes with a single child
 regex_node_t *eliminate_single_seqs(regex_node_t *node) {
     if (node->tag == NODE_SEQUENCE && node->sequence.length == 1) {
-        regex_node_t *ret = eliminate_single_seqs(node->sequence.list[0]);
-        free(node);
-        return ret;
+        return eliminate_single_seqs(node->sequence.list[0]);
     }
 
     if (node->tag == NODE_SEQUENCE || node->tag == NODE_ALTERNATE) {
@@ -113,6 +293,8 @@ regex_node_t *eliminate_single_seqs(regex_node_t *node) {
         }
     } else if (node->tag == NODE_REPEAT) {
         node->repeat.el = eliminate_single_seqs(node->repeat.el);
+    } else if (node->tag == NODE_GROUP) {
+        node->group.el = eliminate_single_seqs(node->group.el);
     }
     return node;
 }
@@ -140,14 +322,11 @@ void compress_literals(regex_node_t *node) {
             }
         }
 
-        // delete the null nodes
+        // drop the null nodes, they go with the arena
         int idx = 0;
         for (int i = 0; i < node->sequence.length; i++) {
-            if (node->sequence.list[i]->tag == NODE_NULL) {
-                regex_node_free(node->sequence.list[i]);
-            } else {
+            if (node->sequence.list[i]->tag != NODE_NULL)
                 node->sequence.list[idx++] = node->sequence.list[i];
-            }
         }
         node->sequence.length = idx;
     } else if (node->tag == NODE_ALTERNATE) {
@@ -155,16 +334,53 @@ void compress_literals(regex_node_t *node) {
             compress_literals(node->sequence.list[i]);
     } else if (node->tag == NODE_REPEAT) {
         compress_literals(node->repeat.el);
+    } else if (node->tag == NODE_GROUP) {
+        compress_literals(node->group.el);
     }
 
 }
 
-regex_node_t *collapse_alts(regex_node_t *node) {
-    // blah
-    return NULL;
+// can the node match the empty string?
+bool regex_node_nullable(regex_node_t *node) {
+    if (node->tag == NODE_SEQUENCE) {
+        for (int i = 0; i < node->sequence.length; i++)
+            if (!regex_node_nullable(node->sequence.list[i])) return false;
+        return true;
+    } else if (node->tag == NODE_ALTERNATE) {
+        for (int i = 0; i < node->sequence.length; i++)
+            if (regex_node_nullable(node->sequence.list[i])) return true;
+        return false;
+    } else if (node->tag == NODE_REPEAT) {
+        return node->repeat.min == 0 || regex_node_nullable(node->repeat.el);
+    } else if (node->tag == NODE_GROUP) {
+        return regex_node_nullable(node->group.el);
+    }
+    return node->tag == NODE_NULL;
+}
+
+// number the groups in the order of their '(', returns the number of groups
+int regex_number_groups(regex_node_t *node, int count) {
+    if (node->tag == NODE_GROUP) {
+        node->group.index = ++count;
+        return regex_number_groups(node->group.el, count);
+    } else if (node->tag == NODE_SEQUENCE || node->tag == NODE_ALTERNATE) {
+        for (int i = 0; i < node->sequence.length; i++)
+            count = regex_number_groups(node->sequence.list[i], count);
+    } else if (node->tag == NODE_REPEAT) {
+        return regex_number_groups(node->repeat.el, count);
+    }
+    return count;
+}
+
+// the label table is sized like the instructions, so they grow together
+void vm_program_grow(vm_program_t *prog) {
+    prog->insts_capacity *= 2;
+    prog->insts = (vm_inst_t*) realloc(prog->insts, prog->insts_capacity * sizeof(vm_inst_t));
+    prog->label_table = (int*) realloc(prog->label_table, prog->insts_capacity * sizeof(int));
 }
 
 int create_label(vm_program_t *prog, int offset) {
+    if (prog->current_label == prog->insts_capacity) vm_program_grow(prog);
     int label = prog->current_label;
     prog->current_label++;
 
@@ -174,7 +390,7 @@ int create_label(vm_program_t *prog, int offset) {
 }
 
 int add_inst(vm_program_t *prog, vm_inst_t inst) {
-    if (prog->insts_length == prog->insts_capacity) exit(-1);
+    if (prog->insts_length == prog->insts_capacity) vm_program_grow(prog);
 
     int index = prog->insts_length;
     prog->insts[index] = inst;
@@ -183,23 +399,80 @@ int add_inst(vm_program_t *prog, vm_inst_t inst) {
     return index;
 }
 
+// the index of the class in prog->classes, adding it if it's new
+int add_class(vm_program_t *prog, const char_class_t *cls) {
+    for (int i = 0; i < prog->classes_length; i++)
+        if (memcmp(&prog->classes[i], cls, sizeof(char_class_t)) == 0) return i;
+
+    if (prog->classes_length == prog->classes_capacity) {
+        prog->classes_capacity = prog->classes_capacity == 0 ? 4 : 2 * prog->classes_capacity;
+        prog->classes = (char_class_t*) realloc(prog->classes, prog->classes_capacity * sizeof(char_class_t));
+    }
+    prog->classes[prog->classes_length] = *cls;
+    return prog->classes_length++;
+}
+
+// the bytes a NODE_CHAR_CLASS or NODE_SPECIAL_LITERAL matches
+void regex_node_class(regex_node_t *node, char_class_t *cls) {
+    char buf_starts[5], buf_ends[5];
+    const char *starts = buf_starts, *ends = buf_ends;
+    int length;
+    bool invert = false;
+    if (node->tag == NODE_SPECIAL_LITERAL) {
+        length = special_ranges(node->special, buf_starts, buf_ends);
+    } else {
+        starts = node->char_class.char_starts;
+        ends = node->char_class.char_ends;
+        length = node->char_class.length;
+        invert = node->char_class.invert;
+    }
+
+    memset(cls, 0, sizeof(char_class_t));
+    for (int i = 0; i < length; i++)
+        for (int c = (uint8_t) starts[i]; c <= (uint8_t) ends[i]; c++)
+            cls->bits[c >> 5] |= (uint32_t) 1 << (c & 31);
+    if (invert)
+        for (int i = 0; i < 8; i++) cls->bits[i] = ~cls->bits[i];
+}
+
 void emit_node(vm_program_t *prog, regex_node_t *node) {
     vm_inst_t inst;
 
     if (node->tag == NODE_LITERAL) {
-        inst.op = OP_LITERAL;
-        inst.literal.str    = node->literal.str;
-        inst.literal.length = node->literal.length;
-        add_inst(prog, inst);
+        // one byte per instruction, the rest of the string is the run
+        for (int i = 0; i < node->literal.length; i++) {
+            inst.op = OP_LITERAL;
+            inst.literal.str    = node->literal.str + i;
+            inst.literal.length = node->literal.length - i;
+            add_inst(prog, inst);
+        }
 
     } else if (node->tag == NODE_ANY) {
         inst.op = OP_ANY;
         add_inst(prog, inst);
 
+    } else if (node->tag == NODE_CHAR_CLASS || node->tag == NODE_SPECIAL_LITERAL) {
+        char_class_t cls;
+        regex_node_class(node, &cls);
+        inst.op = OP_CLASS;
+        inst.class_index = add_class(prog, &cls);
+        add_inst(prog, inst);
+
     } else if (node->tag == NODE_SEQUENCE) {
         for (int i = 0; i < node->sequence.length; i++)
             emit_node(prog, node->sequence.list[i]);
 
+    } else if (node->tag == NODE_GROUP) {
+        inst.op = OP_SAVE;
+        inst.save_slot = 2 * node->group.index;
+        add_inst(prog, inst);
+
+        emit_node(prog, node->group.el);
+
+        inst.op = OP_SAVE;
+        inst.save_slot = 2 * node->group.index + 1;
+        add_inst(prog, inst);
+
     } else if (node->tag == NODE_ALTERNATE) {
         inst.op = OP_SPLIT;
         int split_idx = add_inst(prog, inst);
@@ -234,6 +507,26 @@ void emit_node(vm_program_t *prog, regex_node_t *node) {
             prog->insts[split_idx].split.label_1 = lab1;
             prog->insts[split_idx].split.label_2 = lab2;
 
+        } else if (node->repeat.min == 0 && node->repeat.max == -1 && regex_node_nullable(node->repeat.el)) {
+            // '*' of something that can be empty: emit (el+)? so that an empty
+            // iteration leaves the loop instead of losing to a longer one (Perl/RE2 priorities)
+            inst.op = OP_SPLIT;
+            int split_idx = add_inst(prog, inst);
+
+            int L1 = create_label(prog, 0);
+            emit_node(prog, node->repeat.el);
+
+            inst.op = OP_SPLIT;
+            int loop_idx = add_inst(prog, inst);
+
+            int L3 = create_label(prog, 0);
+
+            // fix up labels
+            prog->insts[split_idx].split.label_1 = L1;
+            prog->insts[split_idx].split.label_2 = L3;
+            prog->insts[loop_idx].split.label_1 = L1;
+            prog->insts[loop_idx].split.label_2 = L3;
+
         } else if (node->repeat.min == 0 && node->repeat.max == -1) { // '*'
             int L1 = create_label(prog, 0);
             inst.op = OP_SPLIT;
@@ -264,190 +557,405 @@ void emit_node(vm_program_t *prog, regex_node_t *node) {
             // fix up labels
             prog->insts[split_idx].split.label_1 = L1;
             prog->insts[split_idx].split.label_2 = L3;
+        } else if (node->repeat.max == -1) {
+            // el{m,}: m-1 copies, then el+
+            for (int i = 0; i < node->repeat.min - 1; i++)
+                emit_node(prog, node->repeat.el);
+            regex_node_t plus = *node;
+            plus.repeat.min = 1;
+            emit_node(prog, &plus);
+
         } else {
-            printf("unsupported repetition\n");
-            exit(-1);
+            // el{m,n}: m copies, then (el(el(...)?)?)? for the other n-m,
+            // so each optional copy is one split and they all skip to the end
+            for (int i = 0; i < node->repeat.min; i++)
+                emit_node(prog, node->repeat.el);
+
+            int optional = node->repeat.max - node->repeat.min;
+            int *splits = (int*) malloc(2 * optional * sizeof(int));
+            for (int i = 0; i < optional; i++) {
+                inst.op = OP_SPLIT;
+                splits[2*i] = add_inst(prog, inst);
+                splits[2*i + 1] = create_label(prog, 0);
+                emit_node(prog, node->repeat.el);
+            }
+            int end = create_label(prog, 0);
+
+            // fix up labels
+            for (int i = 0; i < optional; i++) {
+                prog->insts[splits[2*i]].split.label_1 = splits[2*i + 1];
+                prog->insts[splits[2*i]].split.label_2 = end;
+            }
+            free(splits);
         }
     }
 }
 
-vm_program_t *regex_compile_bytecode(const char *pattern) {
-    const char *input = pattern;
-    regex_node_t *node = regex_parse(&input);
+// how many instructions emit_node() makes for the node, or more than
+// REGEX_MAX_INSTS once it's that big
+long regex_node_insts(regex_node_t *node) {
+    long n = 0;
+    if (node->tag == NODE_LITERAL) {
+        n = node->literal.length;
+    } else if (node->tag == NODE_ANY || node->tag == NODE_CHAR_CLASS || node->tag == NODE_SPECIAL_LITERAL) {
+        n = 1;
+    } else if (node->tag == NODE_SEQUENCE) {
+        for (int i = 0; i < node->sequence.length && n <= REGEX_MAX_INSTS; i++)
+            n += regex_node_insts(node->sequence.list[i]);
+    } else if (node->tag == NODE_ALTERNATE) {
+        n = 2 + regex_node_insts(node->sequence.list[0]) + regex_node_insts(node->sequence.list[1]);
+    } else if (node->tag == NODE_GROUP) {
+        n = 2 + regex_node_insts(node->group.el);
+    } else if (node->tag == NODE_REPEAT) {
+        long el = regex_node_insts(node->repeat.el);
+        int min = node->repeat.min, max = node->repeat.max;
+        if (max == -1) n = (min > 1 ? (min - 1) * el : 0) + el + 2;
+        else n = min * el + (max - min) * (el + 1);
+    }
+    return n > REGEX_MAX_INSTS ? REGEX_MAX_INSTS + 1 : n;
+}
 
+// While compiling, insts, label_table and classes grow with realloc. Once the
+// program is done vm_program_finish() moves them, and the prefilter, into
+// one arena block of exactly the right size, so nothing can be added after.
+// It also copies the literals' bytes in, so the program doesn't need the
+// pattern string anymore, links the program for vm_run_code() and works out
+// the epsilon closures.
+vm_program_t *vm_program_new(int capacity) {
     vm_program_t *prog = (vm_program_t*) malloc(sizeof(vm_program_t));
-    prog->insts_capacity = 1000;
+    prog->insts_capacity = capacity;
     prog->insts_length = 0;
     prog->insts = (vm_inst_t*) malloc(prog->insts_capacity * sizeof(vm_inst_t));
 
     prog->label_table = (int*) malloc(prog->insts_capacity * sizeof(int));
     prog->current_label = 0;
 
-    emit_node(prog, node);
-    // terminate with a match inst
-    add_inst(prog, (vm_inst_t){.op = OP_MATCH});
-    
+    prog->classes = NULL;
+    prog->classes_length = 0;
+    prog->classes_capacity = 0;
+
+    prog->prefilter = NULL;
+    prog->ncaptures = 0;
+    prog->onepass = NULL;
+    prog->bitnfa = NULL;
+    prog->npatterns = 1;
+    prog->bytes = NULL;
+    prog->code = NULL;
+    prog->eps_offsets = NULL;
+    prog->eps = NULL;
+    arena_init(&prog->arena, 0);
+
     return prog;
 }
 
-match_fn_t regex_compile_jit(vm_program_t *prog) {
-    arm_program_t arm;
-    arm.index = 0;
-
-    arm.f = fopen("asm/foo.s", "w");
-    vm2arm(prog, &arm);
-    fclose(arm.f);
-
-    // assemble the code
-    system("clang asm/foo.s -c -o asm/foo.o");
-    // dump the code
-    system("otool -tX asm/foo.o > asm/foo.txt");
-
-    FILE *text = fopen("asm/foo.txt", "r");
-
-    uint32_t *data = (uint32_t*) executable_mem(4096);
-    pthread_jit_write_protect_np(false);
-    sys_icache_invalidate(data, 4096);
-
-    int addr = 0;
-    uint64_t _unused;
-    uint32_t b1, b2, b3, b4;
-    int nret;
-    while ((nret = fscanf(text, "%llx %x %x %x %x\n", &_unused, &b1, &b2, &b3, &b4)) > 1) {
-        if (nret >= 2) data[addr++] = b1;
-        if (nret >= 3) data[addr++] = b2;
-        if (nret >= 4) data[addr++] = b3;
-        if (nret >= 5) data[addr++] = b4;
+void vm_program_finish(vm_program_t *prog) {
+    vm_program_closures(prog);
+    size_t offsets_size = prog->eps != NULL ? (prog->insts_length + 1) * sizeof(int) : 0;
+    size_t eps_size = prog->eps != NULL ? prog->eps_offsets[prog->insts_length] * sizeof(int) : 0;
+    size_t insts_size = prog->insts_length * sizeof(vm_inst_t);
+    size_t labels_size = prog->current_label * sizeof(int);
+    size_t classes_size = prog->classes_length * sizeof(char_class_t);
+    size_t pf_size = prog->prefilter != NULL ? sizeof(prefilter_t) : 0;
+    size_t bytes_size = prog->insts_length;
+    size_t code_size = prog->insts_length * sizeof(vm_code_t);
+    // a 16 byte boundary after each, see arena_alloc
+    arena_init(&prog->arena, insts_size + labels_size + classes_size + pf_size + bytes_size + code_size +
+               offsets_size + eps_size + 128);
+
+    vm_inst_t *insts = (vm_inst_t*) arena_alloc(&prog->arena, insts_size);
+    memcpy(insts, prog->insts, insts_size);
+    free(prog->insts);
+    prog->insts = insts;
+    prog->insts_capacity = prog->insts_length;
+
+    int *labels = (int*) arena_alloc(&prog->arena, labels_size);
+    memcpy(labels, prog->label_table, labels_size);
+    free(prog->label_table);
+    prog->label_table = labels;
+
+    if (prog->classes != NULL) {
+        char_class_t *classes = (char_class_t*) arena_alloc(&prog->arena, classes_size);
+        memcpy(classes, prog->classes, classes_size);
+        free(prog->classes);
+        prog->classes = classes;
+        prog->classes_capacity = prog->classes_length;
     }
-    fclose(text);
 
-    pthread_jit_write_protect_np(true);
-    sys_icache_invalidate(data, 4096);
+    if (prog->prefilter != NULL) {
+        prefilter_t *pf = (prefilter_t*) arena_alloc(&prog->arena, pf_size);
+        memcpy(pf, prog->prefilter, pf_size);
+        free(prog->prefilter);
+        prog->prefilter = pf;
+    }
 
-    match_fn_t fn = (match_fn_t) data;
-    return fn;
-}
+    // a run of literals is a run of pcs, so it stays one string here
+    prog->bytes = (uint8_t*) arena_alloc(&prog->arena, bytes_size);
+    for (int i = 0; i < prog->insts_length; i++) {
+        if (prog->insts[i].op != OP_LITERAL) continue;
+        prog->bytes[i] = (uint8_t) prog->insts[i].literal.str[0];
+        prog->insts[i].literal.str = (const char*) &prog->bytes[i];
+    }
 
-match_fn_t regex_compile(const char *pattern) {
-    vm_program_t *prog = regex_compile_bytecode(pattern);
-    match_fn_t fn = regex_compile_jit(prog);
-    return fn;
+    prog->code = (vm_code_t*) arena_alloc(&prog->arena, code_size);
+    vm_program_link(prog, prog->code);
+
+    if (prog->eps != NULL) {
+        int *offsets = (int*) arena_alloc(&prog->arena, offsets_size);
+        memcpy(offsets, prog->eps_offsets, offsets_size);
+        free(prog->eps_offsets);
+        prog->eps_offsets = offsets;
+
+        int *eps = (int*) arena_alloc(&prog->arena, eps_size);
+        memcpy(eps, prog->eps, eps_size);
+        free(prog->eps);
+        prog->eps = eps;
+    }
 }
 
-void test(const char *pattern) {
-    printf("Test pattern: %s\n", pattern);
-    
-    const char *pat = pattern;
+void vm_program_link(vm_program_t *prog, vm_code_t *code) {
+    for (int i = 0; i < prog->insts_length; i++) {
+        vm_inst_t inst = prog->insts[i];
+        vm_code_t c = {.op = (uint8_t) inst.op, .c = 0, .length = 0, .x = 0, .y = 0};
+        switch (inst.op) {
+        case OP_LITERAL:
+            c.c = (uint8_t) inst.literal.str[0];
+            c.length = inst.literal.length < 65535 ? inst.literal.length : 65535;
+            break;
+        case OP_JMP:
+            c.x = prog->label_table[inst.jmp_label];
+            break;
+        case OP_SPLIT:
+            c.x = prog->label_table[inst.split.label_1];
+            c.y = prog->label_table[inst.split.label_2];
+            break;
+        case OP_SAVE:
+            c.x = inst.save_slot;
+            break;
+        case OP_MATCH:
+            c.x = inst.match_id;
+            break;
+        case OP_CLASS:
+            c.x = inst.class_index;
+            break;
+        case OP_ANY:
+            break;
+        }
+        code[i] = c;
+    }
+}
 
-    regex_node_t *node = regex_parse(&pat);
+vm_program_t *regex_compile_bytecode(const char *pattern) {
+    // the tree only lives while compiling
+    arena_t tree;
+    arena_init(&tree, 4096);
+
+    const char *input = pattern, *error = NULL;
+    regex_node_t *node = regex_parse(&tree, &input, &error);
+    // the parse stops at a ')' it has no group for
+    if (node != NULL && *input != '\0') node = (regex_node_t*) parse_error(&error, "Unmatched ')'");
+    if (node == NULL) {
+        arena_release(&tree);
+        return NULL;
+    }
     node = eliminate_single_seqs(node);
     compress_literals(node);
 
-    printf(" > Reconstructed: ");
-    print_node(node);
-    printf("\n");
-    print_node_tree(node, 0);
-}
+    // and the match at the end
+    if (regex_node_insts(node) + 1 > REGEX_MAX_INSTS) {
+        arena_release(&tree);
+        return NULL;
+    }
 
-#include <time.h>
+    vm_program_t *prog = vm_program_new(64);
 
-void benchmark() {
-    const char *pattern = "(hello|world(0|1|2|3)?)+";
+    prog->ncaptures = regex_number_groups(node, 0);
+    emit_node(prog, node);
+    // terminate with a match inst
+    add_inst(prog, (vm_inst_t){.op = OP_MATCH});
 
-    int len = 50 * 1000 * 1024;
-    char *str = (char*) malloc(len);
-    memset(str, '\0', len);
+    prog->prefilter = prefilter_build(node);
+    vm_program_optimize(prog);
+    // only worth it if there's something to capture
+    prog->onepass = prog->ncaptures > 0 ? onepass_build(prog) : NULL;
+    prog->bitnfa = bitnfa_build(node);
+    prog->npatterns = 1;
 
-    int ctr = 0;
-    for (int i = 0; i < len-100; ) {
-        ctr++;
-        if ((ctr & 1) == 1) {
-            memcpy(str + i, "hello", 5);
-            i += 5;
-        } else {
-            memcpy(str + i, "world", 5);
-            str[i+5] = '0' + (ctr/2 % 4);
-            i += 6;
+    vm_program_finish(prog);
+    arena_release(&tree);
+
+    return prog;
+}
+
+// All the patterns in one program, behind a chain of splits:
+//
+//     split L0, S1
+// L0: <pattern 0>
+//     match 0
+// S1: split L1, S2
+// L1: <pattern 1>
+//     match 1
+//     ...
+//
+// A single pass then finds every pattern that matches. Only the lazy DFA
+// makes that pass cheaper than running each pattern, see dfa_run_set().
+vm_program_t *regex_compile_set(const char **patterns, int count) {
+    // a program needs at least one match
+    if (count <= 0) return NULL;
+
+    arena_t tree;
+    arena_init(&tree, 4096);
+
+    regex_node_t **nodes = (regex_node_t**) malloc(count * sizeof(regex_node_t*));
+    long size = 0;
+    for (int i = 0; i < count; i++) {
+        const char *input = patterns[i], *error = NULL;
+        nodes[i] = regex_parse(&tree, &input, &error);
+        if (nodes[i] != NULL && *input != '\0') nodes[i] = (regex_node_t*) parse_error(&error, "Unmatched ')'");
+        if (nodes[i] == NULL) {
+            size = REGEX_MAX_INSTS + 1;
+            break;
         }
+        nodes[i] = eliminate_single_seqs(nodes[i]);
+        compress_literals(nodes[i]);
+        regex_number_groups(nodes[i], 0);
+        // the split, the pattern and its match
+        if (size <= REGEX_MAX_INSTS) size += 2 + regex_node_insts(nodes[i]);
+    }
+    if (size > REGEX_MAX_INSTS) {
+        free(nodes);
+        arena_release(&tree);
+        return NULL;
     }
 
-    printf("the string: %.*s\n", 100, str);
+    vm_program_t *prog = vm_program_new(64 * count);
 
-    vm_program_t *prog = regex_compile_bytecode(pattern);
+    for (int i = 0; i < count; i++) {
+        int split_idx = -1;
+        if (i < count - 1) split_idx = add_inst(prog, (vm_inst_t){.op = OP_SPLIT});
 
-    double total = 0;
-    int niters = 20;
-    for (int iter = 0; iter < niters; iter++) {
-        double start = (double) clock() / CLOCKS_PER_SEC;
-        vm_run(prog, str);
-        double end = (double) clock() / CLOCKS_PER_SEC;
+        int lab1 = create_label(prog, 0);
+        emit_node(prog, nodes[i]);
+        add_inst(prog, (vm_inst_t){.op = OP_MATCH, .match_id = i});
 
-        total += (end - start);
+        if (split_idx >= 0) {
+            prog->insts[split_idx].split.label_1 = lab1;
+            prog->insts[split_idx].split.label_2 = create_label(prog, 0);
+        }
     }
+    free(nodes);
 
-    printf("Total %f, avg %f\n", total, total / niters);
+    // no submatches or literal filters across patterns
+    prog->prefilter = NULL;
+    prog->ncaptures = 0;
+    prog->onepass = NULL;
+    prog->npatterns = count;
 
-    printf("result ::: %d\n", vm_run(prog, str));
+    vm_program_optimize(prog);
+    vm_program_finish(prog);
+    arena_release(&tree);
 
-    match_fn_t fn = regex_compile(pattern);
-    printf("result ::: %d\n", fn(str));
+    return prog;
+}
 
-    total = 0;
-    for (int iter = 0; iter < niters; iter++) {
-        double start = (double) clock() / CLOCKS_PER_SEC;
-        fn(str);
-        double end = (double) clock() / CLOCKS_PER_SEC;
+void vm_program_free(vm_program_t *prog) {
+    if (prog->onepass != NULL) onepass_free(prog->onepass);
+    if (prog->bitnfa != NULL) bitnfa_free(prog->bitnfa);
+    arena_release(&prog->arena);
+    free(prog);
+}
 
-        total += (end - start);
-    }
+#if defined(__x86_64__)
 
-    printf("Total %f, avg %f\n", total, total / niters);
+void *jit_compile(vm_program_t *prog, jit_mode_t mode) {
+    bool on_stack = mode != JIT_STREAM && mode != JIT_MATCH_SCRATCH;
+    if (on_stack && prog->insts_length > JIT_STACK_MAX_INSTS) return NULL;
 
-    re2::RE2 re(pattern);
+    x86_program_t x86;
+    vm2x86(prog, &x86, mode);
 
-    total = 0;
-    for (int iter = 0; iter < niters; iter++) {
-        double start = (double) clock() / CLOCKS_PER_SEC;
-        re2::RE2::FullMatch(str, re);
-        double end = (double) clock() / CLOCKS_PER_SEC;
+    void *data = code_heap_install(x86.code, x86.index);
+    x86_program_free(&x86);
 
-        total += (end - start);
-    }
+    return data;
+}
+
+match_fn_t regex_compile_jit(vm_program_t *prog) {
+    match_fn_t fn = (match_fn_t) jit_compile(prog, JIT_MATCH);
+    return fn;
+}
+
+match_len_fn_t regex_compile_len_jit(vm_program_t *prog) {
+    match_len_fn_t fn = (match_len_fn_t) jit_compile(prog, JIT_MATCH_LEN);
+    return fn;
+}
 
-    printf("Total %f, avg %f\n", total, total / niters);
+search_fn_t regex_compile_search_jit(vm_program_t *prog) {
+    search_fn_t fn = (search_fn_t) jit_compile(prog, JIT_SEARCH);
+    return fn;
+}
 
+set_fn_t regex_compile_set_jit(vm_program_t *prog) {
+    set_fn_t fn = (set_fn_t) jit_compile(prog, JIT_SET);
+    return fn;
+}
 
+set_len_fn_t regex_compile_set_len_jit(vm_program_t *prog) {
+    set_len_fn_t fn = (set_len_fn_t) jit_compile(prog, JIT_SET_LEN);
+    return fn;
 }
 
-int main(int argc, char **argv) {
-    test("");
-    test("123");
-    test("1(2)3");
-    test("a|b");
-    test("a.c");
-    test("1(2|3)4");
-    test("1(2|)4");
-    test("1|2|3|4");
-    test("1+");
-    test("1?");
-    test("1*(124)+");
-    test("123(abcd+)");
-    test("(hello(xyz)world)");
+stream_fn_t regex_compile_stream_jit(vm_program_t *prog) {
+    stream_fn_t fn = (stream_fn_t) jit_compile(prog, JIT_STREAM);
+    return fn;
+}
 
-    const char *pattern = "(hello|world(0|1|2|3)?)+";
-    match_fn_t fn = regex_compile(pattern);
+#else
 
-    const char *pp = "hellohellohelloworld3";
-    bool answer = fn(pp);
-    printf("drumroll... %d\n", answer);
+void *jit_compile(vm_program_t *prog, jit_mode_t mode) {
+    // no scratch mode on ARM yet, the other modes keep the lists on the stack
+    if (mode == JIT_MATCH_SCRATCH || prog->insts_length > JIT_STACK_MAX_INSTS) return NULL;
 
-    vm_program_t *prog = regex_compile_bytecode(pattern);
-    //print_program(prog);
+    arm_program_t arm;
+    vm2arm(prog, &arm, mode);
 
-    bool vm_ans = vm_run(prog, pp);
-    printf("vm ans: %d\n", vm_ans);
+    void *data = code_heap_install(arm.insts, arm.index * sizeof(arm_inst_t));
+    arm_program_free(&arm);
 
-    benchmark();
+    return data;
+}
 
-    return 0;
+match_fn_t regex_compile_jit(vm_program_t *prog) {
+    match_fn_t fn = (match_fn_t) jit_compile(prog, JIT_MATCH);
+    return fn;
+}
+
+match_len_fn_t regex_compile_len_jit(vm_program_t *prog) {
+    match_len_fn_t fn = (match_len_fn_t) jit_compile(prog, JIT_MATCH_LEN);
+    return fn;
+}
+
+search_fn_t regex_compile_search_jit(vm_program_t *prog) {
+    // the ARM backend only does full matches so far
+    return NULL;
+}
+
+set_fn_t regex_compile_set_jit(vm_program_t *prog) {
+    return NULL;
+}
+
+set_len_fn_t regex_compile_set_len_jit(vm_program_t *prog) {
+    return NULL;
+}
+
+stream_fn_t regex_compile_stream_jit(vm_program_t *prog) {
+    return NULL;
+}
+
+#endif
+
+match_fn_t regex_compile(const char *pattern) {
+    vm_program_t *prog = regex_compile_bytecode(pattern);
+    if (prog == NULL) return NULL;
+    match_fn_t fn = regex_compile_jit(prog);
+    return fn;
 }
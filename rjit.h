@@ -1,8 +1,36 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
 
 typedef bool (*match_fn_t)(const char *str);
+typedef bool (*match_len_fn_t)(const char *data, size_t len);
+typedef bool (*search_fn_t)(const char *text, size_t len, size_t *start, size_t *end);
+typedef bool (*set_fn_t)(const char *str, uint64_t *matched);
+typedef bool (*set_len_fn_t)(const char *data, size_t len, uint64_t *matched);
+// state, see regex_compile_stream_jit. buf == NULL ends the stream
+typedef bool (*stream_fn_t)(void *state, const char *buf, size_t len);
+// match_len_fn_t with the lists in caller memory, see MATCH_JIT_SCRATCH_SIZE
+typedef bool (*match_scratch_fn_t)(const char *data, size_t len, void *scratch);
+
+// see arena.c
+typedef struct arena_block_t {
+    struct arena_block_t *prev;
+    char *data;
+    size_t size;
+    size_t used;
+} arena_block_t;
+
+typedef struct {
+    arena_block_t *head;
+    size_t block_size; // smallest block to malloc
+    size_t bytes; // malloc'd so far
+} arena_t;
+
+void arena_init(arena_t *a, size_t block_size);
+void *arena_alloc(arena_t *a, size_t size);
+void arena_release(arena_t *a);
 
 typedef enum {
     NODE_NULL, // i.e. a dummy node
@@ -12,7 +40,8 @@ typedef enum {
     NODE_SEQUENCE,
     NODE_ALTERNATE,
     NODE_REPEAT, // i.e. ?, +, *, {...}
-    NODE_ANY
+    NODE_ANY,
+    NODE_GROUP // i.e. (...), a capture group
 } regex_node_tag_t;
 
 typedef enum {
@@ -32,16 +61,18 @@ typedef struct regex_node_t {
     union {
         struct {
             const char *str;
-            int length;
+            int length; // of the run of literals this one starts, see optimize.c
         } literal;
 
         struct {
             bool invert;
-            const char *char_starts;
+            const char *char_starts; // inclusive ranges, in the arena
             const char *char_ends;
             int length;
         } char_class;
 
+        regex_special_literal_t special; // \w, \d and so on
+
         // for both NODE_SEQUENCE and NODE_ALTERNATE
         struct {
             struct regex_node_t **list;
@@ -53,6 +84,11 @@ typedef struct regex_node_t {
             int min;
             int max;
         } repeat;
+
+        struct {
+            struct regex_node_t *el;
+            int index; // 1 for the first '(' and so on
+        } group;
     };
 } regex_node_t;
 
@@ -61,16 +97,26 @@ typedef enum {
     OP_ANY,
     OP_JMP,
     OP_SPLIT,
-    OP_MATCH
+    OP_MATCH,
+    OP_SAVE, // record the position in a capture slot, then go on to pc+1
+    OP_CLASS // any byte in prog->classes[class_index]
 } vm_opcode_t;
 
+// a set of bytes, byte c is bit c % 32 of bits[c / 32]
+typedef struct {
+    uint32_t bits[8];
+} char_class_t;
+
+// c has to be 0..255
+#define CHAR_CLASS_HAS(cls, c) (((cls)->bits[(c) >> 5] >> ((c) & 31)) & 1)
+
 typedef struct {
     vm_opcode_t op;
 
     union {
         struct {
             const char *str;
-            int length;
+            int length; // of the run of literals this one starts, see optimize.c
         } literal;
 
         int jmp_label;
@@ -79,9 +125,90 @@ typedef struct {
             int label_1;
             int label_2;
         } split;
+
+        int save_slot; // group k starts in slot 2k and ends in 2k+1
+
+        int match_id; // which pattern of a set matched, 0 otherwise
+
+        int class_index;
     };
 } vm_inst_t;
 
+// An instruction linked for vm_run_code(), see vm_program_link(): targets
+// are pcs and a literal's byte is inline, so it's 12 bytes and doesn't
+// point anywhere.
+typedef struct {
+    uint8_t op; // vm_opcode_t
+    uint8_t c; // OP_LITERAL
+    uint16_t length; // of the literal run, at most 65535
+    int32_t x; // OP_JMP and the first way of OP_SPLIT, the class, slot or match id
+    int32_t y; // the second way of OP_SPLIT
+} vm_code_t;
+
+#define LITERAL_SET_MAX 16
+#define LITERAL_MAX_LENGTH 32
+
+typedef struct {
+    int length; // 0 if nothing is known
+    int lengths[LITERAL_SET_MAX];
+    char strs[LITERAL_SET_MAX][LITERAL_MAX_LENGTH];
+} literal_set_t;
+
+// literals every match has to have, used to skip ahead when searching
+typedef struct {
+    literal_set_t prefix; // every match starts with one of these
+    literal_set_t suffix; // ... ends with one of these
+    literal_set_t inner;  // ... contains one of these
+} prefilter_t;
+
+// what a one-pass program does on a byte: apply some saves, then go to a state
+typedef struct {
+    int next; // state
+    int saves_offset; // into onepass_t.saves
+    int saves_length;
+} onepass_action_t;
+
+// For programs where each byte decides which way every split goes, so a
+// single thread is enough. States are pc 0 and the pcs after each consuming
+// instruction.
+typedef struct {
+    int nstates;
+    int *state_of_pc; // -1 if the pc doesn't start a state
+    int *trans; // nstates x 256, action or -1
+    int *match; // by state, action to take at the end or -1
+
+    onepass_action_t *actions;
+    int actions_length;
+    int actions_capacity;
+
+    int *saves; // slots
+    int saves_length;
+    int saves_capacity;
+} onepass_t;
+
+#define ONEPASS_MAX_STATES 1000
+
+// The pattern as a bit-parallel Glushkov automaton, see bitnfa.c. Only says
+// whether the whole input matches. Position 0 is the start, the others are
+// the bytes, classes and dots of the pattern with repetition unrolled.
+#define BITNFA_MAX_POSITIONS 256
+
+typedef struct {
+    int npositions; // counting the start
+    int nwords; // 64 bit words in a state: 1, or 4 past 64 positions
+    uint64_t accept[4]; // positions a match can end at
+    uint64_t shift[4]; // positions only ever followed by the next one
+    int nchunks; // bytes of the state with any other positions in them
+    int chunks[BITNFA_MAX_POSITIONS / 8]; // which ones
+    uint64_t *masks; // 256 x nwords, the positions that take each byte
+    uint64_t *follow; // nchunks x 256 x nwords, see bitnfa.c
+} bitnfa_t;
+
+// The one word automaton beats the JIT and the vm on everything in
+// benchmark_bitnfa, so only it is picked on its own. The 4 word one loses
+// to the JIT unless lots of threads are live, see rjit_plan
+#define BITNFA_PREFERRED(prog) ((prog)->bitnfa != NULL && (prog)->bitnfa->nwords == 1)
+
 typedef struct {
     vm_inst_t *insts;
     int insts_length;
@@ -89,31 +216,434 @@ typedef struct {
 
     int *label_table;
     int current_label;
+
+    char_class_t *classes; // for OP_CLASS, no two the same
+    int classes_length;
+    int classes_capacity;
+
+    prefilter_t *prefilter; // NULL if there are no required literals
+
+    int ncaptures; // groups, not counting group 0 (the whole match)
+    onepass_t *onepass; // NULL if not one-pass or there are no groups
+    bitnfa_t *bitnfa; // NULL if the pattern has too many positions, or for sets
+
+    int npatterns; // 1 unless compiled with regex_compile_set
+
+    uint8_t *bytes; // by pc, the byte of each OP_LITERAL; their literal.str point here
+    vm_code_t *code; // insts linked, by pc
+
+    // the consuming instructions and matches reachable from a pc through
+    // epsilons are eps[eps_offsets[pc] .. eps_offsets[pc + 1]), for pc 0 and
+    // the pc after each consuming instruction, see optimize.c. NULL if too big
+    int *eps_offsets;
+    int *eps;
+
+    // insts, label_table, classes, prefilter, bytes, code and the closures,
+    // sized to fit once compiling is done
+    arena_t arena;
 } vm_program_t;
 
+// words in the bitset of matched patterns
+#define SET_WORDS(npatterns) (((npatterns) + 63) / 64)
+
+// the nodes go in `arena`, release it when done with the tree. NULL on a
+// syntax error, with the message in *error (which should start out NULL)
+regex_node_t *regex_parse(arena_t *arena, const char **pattern, const char **error);
+regex_node_t *eliminate_single_seqs(regex_node_t *node);
+void compress_literals(regex_node_t *node);
+int regex_number_groups(regex_node_t *node, int count);
+long regex_node_insts(regex_node_t *node);
+
+// Counted repetition is unrolled, so x{m,n} costs about n copies of x.
+// Counts go up to REGEX_MAX_REPEAT (more is a parse error), and a pattern
+// (or set) that would take more than REGEX_MAX_INSTS instructions doesn't
+// compile. Either way, like any syntax error, regex_compile_bytecode and
+// regex_compile_set return NULL.
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_MAX_INSTS 100000
+
+// entries in all of a program's epsilon closures together
+#define VM_CLOSURE_MAX(N) (16L * (N) + 4096)
+
+vm_program_t *regex_compile_bytecode(const char *pattern);
+// Match a set with dfa_run_set: its states stand for every pattern at once, so
+// N patterns cost well under N runs. vm_run_set and the set JIT still step a
+// thread per live pattern and cost about as much as N separate runs; they're
+// what the DFA falls back on. See benchmark_set. NULL for an empty set, as
+// for a pattern that doesn't compile.
+vm_program_t *regex_compile_set(const char **patterns, int count);
+void vm_program_free(vm_program_t *prog);
+void vm_program_optimize(vm_program_t *prog);
+void vm_program_closures(vm_program_t *prog);
+void vm_program_link(vm_program_t *prog, vm_code_t *code);
+match_fn_t regex_compile_jit(vm_program_t *prog);
+match_len_fn_t regex_compile_len_jit(vm_program_t *prog);
+search_fn_t regex_compile_search_jit(vm_program_t *prog);
+set_fn_t regex_compile_set_jit(vm_program_t *prog);
+set_len_fn_t regex_compile_set_len_jit(vm_program_t *prog);
+stream_fn_t regex_compile_stream_jit(vm_program_t *prog);
+match_fn_t regex_compile(const char *pattern);
+
 int create_label(vm_program_t *prog, int offset);
 
 int add_inst(vm_program_t *prog, vm_inst_t inst);
+int add_class(vm_program_t *prog, const char_class_t *cls);
+void regex_node_class(regex_node_t *node, char_class_t *cls);
 
 void print_node(regex_node_t *node);
 void print_node_tree(regex_node_t *node, int level);
 void print_program(vm_program_t *prog);
+void print_literal_set(literal_set_t *set);
+
+prefilter_t *prefilter_build(regex_node_t *node);
+const char *literal_set_find(const literal_set_t *set, const char *p, const char *end);
+bool literal_set_match_at(const literal_set_t *set, const char *p, const char *end);
 
-void *executable_mem(int size);
+// see codeheap.c. Returns where the copy of `code` can be run from, or NULL
+// if there's no memory for it
+void *code_heap_install(const void *code, size_t size);
+void code_heap_free(void *code);
+size_t code_heap_size(const void *code);
+void code_heap_stats(size_t *mapped, size_t *used);
+
+typedef enum {
+    JIT_MATCH, // match_fn_t
+    JIT_MATCH_LEN, // match_len_fn_t
+    JIT_SEARCH, // search_fn_t
+    JIT_SET, // set_fn_t
+    JIT_SET_LEN, // set_len_fn_t
+    JIT_STREAM, // stream_fn_t
+    JIT_MATCH_SCRATCH // match_scratch_fn_t
+} jit_mode_t;
+
+// Bigger programs don't get a JIT in the modes that put the lists on the
+// machine stack (24-40 bytes per instruction), the VM or the scratch mode
+// has to do instead.
+#define JIT_STACK_MAX_INSTS 8192
+
+// NULL if there's no JIT for the mode, or the code heap is out of memory.
+// The code is in the code heap, code_heap_free() it when done
+void *jit_compile(vm_program_t *prog, jit_mode_t mode);
 
 
 typedef int reg_t;
 typedef uint32_t arm_inst_t;
 
+typedef struct {
+    int index; // the instruction that refers to the label
+    int label;
+    int kind;
+} arm_fixup_t;
+
 typedef struct {
     arm_inst_t *insts;
     int index;
+    int capacity;
 
-    FILE *f;
+    int *label_table; // label -> instruction index
+    int labels_length;
+    int labels_capacity;
 
-    int *label_table;
+    arm_fixup_t *fixups;
+    int fixups_length;
+    int fixups_capacity;
 } arm_program_t;
 
-void vm2arm(vm_program_t *vp, arm_program_t *ap);
+void vm2arm(vm_program_t *vp, arm_program_t *ap, jit_mode_t mode);
+void arm_program_free(arm_program_t *ap);
+
+typedef struct {
+    int offset; // where the rel32 lives
+    int label;
+} x86_fixup_t;
+
+typedef struct {
+    uint8_t *code;
+    int index;
+    int capacity;
+
+    int *label_table; // label -> code offset
+    int labels_length;
+    int labels_capacity;
+
+    x86_fixup_t *fixups;
+    int fixups_length;
+    int fixups_capacity;
+} x86_program_t;
+
+// the stream JIT keeps its lists and history in the caller's memory:
+// hist, curr, next (8 bytes per instruction each), then 5 words of registers
+#define STREAM_JIT_STATE_SIZE(insts_length) (24 * (insts_length) + 40)
+// the scratch JIT has the same frame as JIT_MATCH_LEN, but in caller memory
+#define MATCH_JIT_SCRATCH_SIZE(insts_length) (24 * (insts_length) + 16)
+
+void vm2x86(vm_program_t *vp, x86_program_t *xp, jit_mode_t mode);
+void x86_program_free(x86_program_t *xp);
 
 bool vm_run(vm_program_t *prog, const char *str);
+bool vm_run3(vm_program_t *prog, const char *str);
+bool vm_run_len(vm_program_t *prog, const char *data, size_t len);
+bool regex_search(vm_program_t *prog, const char *text, size_t len, size_t *start, size_t *end);
+bool vm_run_set(vm_program_t *prog, const char *str, uint64_t *matched);
+bool vm_run_set_len(vm_program_t *prog, const char *data, size_t len, uint64_t *matched);
+
+// vm_run_len's lists and history, kept between calls so a string doesn't
+// pay for resetting them. One per thread, for vm_run_code or vm_run_scratch.
+typedef struct {
+    vm_program_t *prog;
+    int *curr;
+    int *next;
+    size_t *histc;
+    size_t *histn;
+    size_t base; // history entries below this are from earlier strings
+    size_t threads; // run off the lists by vm_run_code, over every call
+} vm_scratch_t;
+
+vm_scratch_t *vm_scratch_new(vm_program_t *prog);
+void vm_scratch_free(vm_scratch_t *s);
+bool vm_run_scratch(vm_scratch_t *s, const char *data, size_t len);
+bool vm_run_code(vm_scratch_t *s, const char *data, size_t len);
+
+// Bit-state backtracking, see backtrack.c: a bit per (pc, position) of the
+// string, so only for strings where that fits in BACKTRACK_MAX_BITS (32KB).
+// Scratch is reused like vm_scratch_t, one per thread.
+#define BACKTRACK_MAX_BITS (256 * 1024)
+#define BACKTRACK_FITS(prog, len) ((size_t) (prog)->insts_length * ((size_t) (len) + 1) <= BACKTRACK_MAX_BITS)
+
+typedef struct {
+    vm_program_t *prog;
+    uint64_t *visited; // BACKTRACK_MAX_BITS
+    void *stack; // of jobs, grows as needed
+    int stack_capacity;
+} backtrack_scratch_t;
+
+backtrack_scratch_t *backtrack_scratch_new(vm_program_t *prog);
+void backtrack_scratch_free(backtrack_scratch_t *s);
+bool backtrack_run(backtrack_scratch_t *s, const char *data, size_t len);
+
+// vm_run_len, vm_run_set_len and regex_search keep their lists on the stack up
+// to this many instructions, bigger programs get them from malloc
+#define VM_STACK_MAX_INSTS 4096
+
+typedef struct {
+    int pcs_offset; // into dfa_cache_t.pcs
+    int pcs_length;
+    uint32_t hash;
+    bool match;
+} dfa_state_t;
+
+typedef struct {
+    vm_program_t *prog;
+
+    size_t budget; // bytes
+    size_t used;
+
+    dfa_state_t *states;
+    int *trans; // 256 per state
+    int states_length;
+    int states_capacity;
+
+    int *pcs;
+    int pcs_length;
+    int pcs_capacity;
+
+    int *table; // open addressing, pc set -> state
+    int table_capacity;
+
+    int start;
+
+    // scratch for computing transitions
+    int *mark;
+    int mark_gen;
+    int *stack;
+    int *closure;
+    int *succ;
+
+    int flushes;
+    int flushed_states; // how many states there were at the last flush
+    int nfa_fallbacks;
+} dfa_cache_t;
+
+#define DFA_DEFAULT_BUDGET (2 << 20)
+
+dfa_cache_t *dfa_cache_create(vm_program_t *prog, size_t budget);
+void dfa_cache_free(dfa_cache_t *dfa);
+bool dfa_run(dfa_cache_t *dfa, const char *str);
+bool dfa_run_len(dfa_cache_t *dfa, const char *data, size_t len);
+int dfa_final_state(dfa_cache_t *dfa, const char *data, size_t len);
+bool dfa_run_set(dfa_cache_t *dfa, const char *str, uint64_t *matched);
+bool dfa_run_set_len(dfa_cache_t *dfa, const char *data, size_t len, uint64_t *matched);
+int dfa_start_state(dfa_cache_t *dfa);
+int dfa_transition(dfa_cache_t *dfa, int state, uint8_t c);
+
+// The engines rjit_match can run a pattern with, see rjit_plan()
+typedef enum {
+    RJIT_ENGINE_AUTO, // whatever rjit_plan picks
+    RJIT_ENGINE_DFA, // the lazy DFA, dfa.c
+    RJIT_ENGINE_BITNFA,
+    RJIT_ENGINE_JIT,
+    RJIT_ENGINE_BACKTRACK,
+    RJIT_ENGINE_VM // vm_run_code
+} rjit_engine_t;
+
+// What rjit_plan goes on besides the input, worked out once when compiling
+typedef struct {
+    int insts;
+    bool literals; // there's a literal every match starts with or contains
+    bool anchored; // it doesn't start with something like .*
+    bool onepass; // one-pass tables were built (only for patterns with groups)
+    int bitnfa_words; // 0 if it has too many positions
+    bool jit; // there's JIT code
+    bool closures; // the program has its epsilon closures
+} rjit_plan_t;
+
+// A compiled pattern that owns its program and JIT code. Nothing in it
+// changes after rjit_regex_compile, so one can be shared between threads,
+// each with its own rjit_scratch_t. rjit_match doesn't allocate, apart from
+// the lazy DFA in the scratch growing up to DFA_DEFAULT_BUDGET.
+typedef struct {
+    char *pattern; // what it was compiled from
+    int flags; // RJIT_*
+    vm_program_t *prog;
+    match_scratch_fn_t jit; // NULL to use the bitnfa or the VM
+    rjit_plan_t plan;
+} rjit_regex_t;
+
+typedef struct {
+    dfa_cache_t *dfa; // NULL if another engine is forced
+    vm_scratch_t *vm; // NULL if there's JIT code or a one word bitnfa, unless forced
+    backtrack_scratch_t *bt; // with vm, if the program has closures
+    void *jit; // MATCH_JIT_SCRATCH_SIZE bytes
+    size_t bytes; // run through rjit_match so far, see RJIT_PLAN_DFA_WARMUP
+} rjit_scratch_t;
+
+#define RJIT_NO_JIT 1 // no JIT code, only the VM (or the bitnfa or the backtracker)
+// always use this rjit_engine_t, if the pattern has it (RJIT_NO_JIT wins over
+// forcing the JIT)
+#define RJIT_FORCE(engine) ((int) (engine) << 4)
+#define RJIT_FORCED(flags) ((rjit_engine_t) (((flags) >> 4) & 15))
+
+// strings at least this long are checked for the pattern's literals before
+// an engine runs on them
+#define RJIT_PLAN_SCAN_MIN_LEN 64
+// a shorter string doesn't go to the lazy DFA until the scratch has run this
+// many bytes: till then building states costs more than the lookups save
+#define RJIT_PLAN_DFA_WARMUP 4096
+
+// NULL if the pattern doesn't parse or is too big, see REGEX_MAX_INSTS
+rjit_regex_t *rjit_regex_compile(const char *pattern, int flags);
+void rjit_regex_free(rjit_regex_t *re);
+size_t rjit_regex_bytes(const rjit_regex_t *re);
+rjit_scratch_t *rjit_scratch_new(const rjit_regex_t *re);
+void rjit_scratch_free(rjit_scratch_t *s);
+bool rjit_match(const rjit_regex_t *re, rjit_scratch_t *s, const char *data, size_t len);
+rjit_engine_t rjit_plan(const rjit_regex_t *re, const rjit_scratch_t *s, size_t len, const char **why);
+const char *rjit_engine_name(rjit_engine_t engine);
+
+// Compiled patterns by (pattern, flags), see cache.c. A handle from
+// rjit_cache_get() stays valid until rjit_cache_release(), even if the
+// cache evicts it or is freed in the meantime.
+typedef struct rjit_cache_entry_t {
+    rjit_regex_t *re;
+    uint32_t hash;
+    size_t bytes;
+    int refs; // handles out, plus one while it's in the cache
+
+    struct rjit_cache_entry_t *chain; // same bucket
+    struct rjit_cache_entry_t *newer; // LRU order
+    struct rjit_cache_entry_t *older;
+} rjit_cache_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    rjit_cache_entry_t **buckets;
+    int nbuckets; // a power of two
+    int count;
+
+    rjit_cache_entry_t *newest;
+    rjit_cache_entry_t *oldest;
+
+    size_t budget; // bytes
+    size_t bytes;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} rjit_cache_t;
+
+rjit_cache_t *rjit_cache_create(size_t budget);
+void rjit_cache_free(rjit_cache_t *cache);
+// NULL if the pattern doesn't compile, which isn't cached
+rjit_cache_entry_t *rjit_cache_get(rjit_cache_t *cache, const char *pattern, int flags);
+void rjit_cache_release(rjit_cache_entry_t *entry);
+
+// Full match of count strings, results[i] for strs[i]. Spread over worker
+// threads; rjit_match_batch uses one per core. The workers run jit when it
+// isn't NULL, else a one word bitnfa if the program has one, else the VM.
+void rjit_match_batch(vm_program_t *prog, const char **strs, const size_t *lens,
+                      size_t count, bool *results);
+void rjit_match_batch_threads(vm_program_t *prog, match_len_fn_t jit,
+                              const char **strs, const size_t *lens,
+                              size_t count, bool *results, int nthreads);
+
+// Full match over input that arrives in pieces. Memory is allocated once in
+// rjit_stream_begin, whatever the length of the stream.
+typedef struct {
+    vm_program_t *prog;
+    stream_fn_t jit; // NULL to use the VM
+    void *jit_state;
+
+    // the VM: vm_run3's lists, with the history indexed by stream position
+    int *curr;
+    int *next;
+    int currlen;
+    size_t *histc;
+    size_t *histn;
+    size_t pos; // bytes fed so far
+
+    bool dead; // nothing can match anymore
+} rjit_stream_t;
+
+rjit_stream_t *rjit_stream_begin(vm_program_t *prog, stream_fn_t jit);
+bool rjit_stream_feed(rjit_stream_t *st, const char *buf, size_t len);
+bool rjit_stream_finish(rjit_stream_t *st);
+
+#define CAPTURE_UNSET ((size_t) -1)
+
+// the _len ones take data[0, len), where '\0' is just another byte
+bool vm_run_captures(vm_program_t *prog, const char *str, size_t *slots, int nslots);
+bool vm_run_captures_len(vm_program_t *prog, const char *data, size_t len, size_t *slots, int nslots);
+bool pike_run(vm_program_t *prog, const char *str, size_t *slots, int nslots);
+bool pike_run_len(vm_program_t *prog, const char *data, size_t len, size_t *slots, int nslots);
+onepass_t *onepass_build(vm_program_t *prog);
+void onepass_free(onepass_t *op);
+bool onepass_run(onepass_t *op, const char *str, size_t *slots, int nslots);
+bool onepass_run_len(onepass_t *op, const char *data, size_t len, size_t *slots, int nslots);
+
+bitnfa_t *bitnfa_build(regex_node_t *node);
+void bitnfa_free(bitnfa_t *nfa);
+size_t bitnfa_size(const bitnfa_t *nfa);
+bool bitnfa_run(const bitnfa_t *nfa, const char *str);
+bool bitnfa_run_len(const bitnfa_t *nfa, const char *data, size_t len);
+
+typedef struct {
+    int nstates;
+    int nclasses;
+    uint8_t classmap[256]; // byte -> equivalence class
+
+    // nstates x nclasses, entries are row offsets (state * nclasses)
+    uint32_t *trans;
+    bool *match; // by state
+    uint32_t start;
+    uint32_t dead;
+} dfa_table_t;
+
+#define DFA_DEFAULT_MAX_STATES 10000
+
+int dfa_byte_classes(vm_program_t *prog, uint8_t *classmap);
+dfa_table_t *dfa_compile(vm_program_t *prog, int max_states, const char **error);
+void dfa_table_free(dfa_table_t *table);
+size_t dfa_table_size(dfa_table_t *table);
+bool dfa_table_run(dfa_table_t *table, const char *str);
+bool dfa_table_run_len(dfa_table_t *table, const char *data, size_t len);
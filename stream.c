@@ -0,0 +1,189 @@
+#include "rjit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Streaming full match. The thread lists and the history survive between
+// rjit_stream_feed() calls, so a byte is only ever looked at once and the
+// buffers are read in place. The end of the stream is rjit_stream_finish(),
+// not a '\0', so the stream can contain any byte.
+//
+// With a JIT (regex_compile_stream_jit) the generated code keeps the same
+// state in `jit_state` and picks up where it left off on every call.
+
+rjit_stream_t *rjit_stream_begin(vm_program_t *prog, stream_fn_t jit) {
+    int N = prog->insts_length;
+
+    rjit_stream_t *st = (rjit_stream_t*) malloc(sizeof(rjit_stream_t));
+    st->prog = prog;
+    st->jit = jit;
+    st->jit_state = NULL;
+    st->curr = NULL;
+    st->next = NULL;
+    st->histc = NULL;
+    st->histn = NULL;
+    st->pos = 0;
+    st->dead = false;
+
+    if (jit != NULL) {
+        // the first call sets things up, the state only has to say it's new
+        st->jit_state = calloc(1, STREAM_JIT_STATE_SIZE(N));
+        st->dead = !jit(st->jit_state, "", 0);
+        return st;
+    }
+
+    st->curr = (int*) malloc(N * sizeof(int));
+    st->next = (int*) malloc(N * sizeof(int));
+    st->histc = (size_t*) malloc(N * sizeof(size_t));
+    st->histn = (size_t*) malloc(N * sizeof(size_t));
+    for (int i = 0; i < N; i++)
+        st->histc[i] = st->histn[i] = (size_t) -1;
+
+    st->currlen = 1;
+    st->curr[0] = 0;
+    st->histc[0] = 0;
+
+    return st;
+}
+
+// returns false once nothing can match anymore, the rest can be skipped
+bool rjit_stream_feed(rjit_stream_t *st, const char *buf, size_t len) {
+    if (st->dead) return false;
+
+    if (st->jit != NULL) {
+        st->dead = !st->jit(st->jit_state, buf, len);
+        return !st->dead;
+    }
+
+    vm_program_t *prog = st->prog;
+    int *curr = st->curr, *next = st->next;
+    size_t *histc = st->histc, *histn = st->histn;
+    int currlen = st->currlen;
+    size_t g = st->pos;
+
+    for (size_t k = 0; k < len; k++, g++) {
+        if (currlen == 0) break;
+
+        char c = buf[k];
+        int nextidx = 0;
+        for (int i = 0; i < currlen; i++) {
+            int pc1, pc2;
+            int idx = curr[i];
+            vm_inst_t inst = prog->insts[idx];
+            switch (inst.op) {
+            case OP_LITERAL:
+                if (*inst.literal.str == c) {
+                    if (histn[idx+1] != g) {
+                        next[nextidx++] = idx+1;
+                        histn[idx+1] = g;
+                    }
+                }
+                break;
+
+            case OP_ANY:
+                if (histn[idx+1] != g) {
+                    next[nextidx++] = idx+1;
+                    histn[idx+1] = g;
+                }
+                break;
+
+            case OP_CLASS:
+                if (CHAR_CLASS_HAS(&prog->classes[inst.class_index], (uint8_t) c)) {
+                    if (histn[idx+1] != g) {
+                        next[nextidx++] = idx+1;
+                        histn[idx+1] = g;
+                    }
+                }
+                break;
+
+            case OP_MATCH: // only at the end
+                break;
+
+            case OP_SAVE:
+            case OP_JMP:
+                pc1 = inst.op == OP_SAVE ? idx + 1 : prog->label_table[inst.jmp_label];
+                if (histc[pc1] != g) {
+                    curr[currlen++] = pc1;
+                    histc[pc1] = g;
+                }
+                break;
+
+            case OP_SPLIT:
+                pc1 = prog->label_table[inst.split.label_1];
+                pc2 = prog->label_table[inst.split.label_2];
+                if (histc[pc1] != g) {
+                    curr[currlen++] = pc1;
+                    histc[pc1] = g;
+                }
+                if (histc[pc2] != g) {
+                    curr[currlen++] = pc2;
+                    histc[pc2] = g;
+                }
+                break;
+            }
+        }
+
+        int *tmp = next;
+        next = curr;
+        curr = tmp;
+
+        currlen = nextidx;
+
+        for (int i = 0; i < currlen; i++)
+            histc[curr[i]] = g+1;
+    }
+
+    st->curr = curr;
+    st->next = next;
+    st->currlen = currlen;
+    st->pos = g;
+    st->dead = currlen == 0;
+
+    return !st->dead;
+}
+
+// ends the stream and frees it, returns whether the whole stream matched
+bool rjit_stream_finish(rjit_stream_t *st) {
+    bool matched = false;
+
+    if (st->jit != NULL) {
+        if (!st->dead) matched = st->jit(st->jit_state, NULL, 0);
+
+    } else if (!st->dead) {
+        // follow the epsilons one last time, looking for a match
+        vm_program_t *prog = st->prog;
+        size_t g = st->pos;
+        for (int i = 0; i < st->currlen && !matched; i++) {
+            int pc = st->curr[i];
+            vm_inst_t inst = prog->insts[pc];
+            int targets[2], ntargets = 0;
+
+            if (inst.op == OP_MATCH) {
+                matched = true;
+            } else if (inst.op == OP_SAVE) {
+                targets[ntargets++] = pc + 1;
+            } else if (inst.op == OP_JMP) {
+                targets[ntargets++] = prog->label_table[inst.jmp_label];
+            } else if (inst.op == OP_SPLIT) {
+                targets[ntargets++] = prog->label_table[inst.split.label_1];
+                targets[ntargets++] = prog->label_table[inst.split.label_2];
+            }
+
+            for (int t = 0; t < ntargets; t++) {
+                if (st->histc[targets[t]] != g) {
+                    st->curr[st->currlen++] = targets[t];
+                    st->histc[targets[t]] = g;
+                }
+            }
+        }
+    }
+
+    free(st->jit_state);
+    free(st->curr);
+    free(st->next);
+    free(st->histc);
+    free(st->histn);
+    free(st);
+
+    return matched;
+}
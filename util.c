@@ -1,16 +1,40 @@
 #include "rjit.h"
 
 #include <stdio.h>
-#include <sys/mman.h>
 #include <string.h>
-#include <errno.h>
 #include <stdlib.h>
 
+void print_class_byte(int c) {
+    if (c > ' ' && c < 127 && c != '\\' && c != ']' && c != '-' && c != '^') printf("%c", c);
+    else printf("\\x%02x", c);
+}
+
+// as [...] ranges
+void print_char_class(const char_class_t *cls) {
+    printf("[");
+    for (int c = 0; c < 256; c++) {
+        if (!CHAR_CLASS_HAS(cls, c)) continue;
+        int end = c;
+        while (end < 255 && CHAR_CLASS_HAS(cls, end + 1)) end++;
+        print_class_byte(c);
+        if (end > c) {
+            printf("-");
+            print_class_byte(end);
+        }
+        c = end;
+    }
+    printf("]");
+}
+
 void print_node(regex_node_t *node) {
     if (node->tag == NODE_LITERAL) {
         printf("%.*s", node->literal.length, node->literal.str);
     } else if (node->tag == NODE_ANY) {
         printf(".");
+    } else if (node->tag == NODE_CHAR_CLASS || node->tag == NODE_SPECIAL_LITERAL) {
+        char_class_t cls;
+        regex_node_class(node, &cls);
+        print_char_class(&cls);
     } else if (node->tag == NODE_SEQUENCE || node->tag == NODE_ALTERNATE) {
         printf("(");
 
@@ -29,6 +53,19 @@ void print_node(regex_node_t *node) {
             printf("*");
         else if (node->repeat.min == 1 && node->repeat.max == -1)
             printf("+");
+        else if (node->repeat.max == -1)
+            printf("{%d,}", node->repeat.min);
+        else if (node->repeat.min == node->repeat.max)
+            printf("{%d}", node->repeat.min);
+        else
+            printf("{%d,%d}", node->repeat.min, node->repeat.max);
+    } else if (node->tag == NODE_GROUP) {
+        // sequences and alternations print their own parens
+        regex_node_tag_t tag = node->group.el->tag;
+        bool parens = tag != NODE_SEQUENCE && tag != NODE_ALTERNATE;
+        if (parens) printf("(");
+        print_node(node->group.el);
+        if (parens) printf(")");
     }
 }
 
@@ -38,6 +75,12 @@ void print_node_tree(regex_node_t *node, int level) {
         printf("literal '%.*s'\n", node->literal.length, node->literal.str);
     } else if (node->tag == NODE_ANY) {
         printf("any .\n");
+    } else if (node->tag == NODE_CHAR_CLASS || node->tag == NODE_SPECIAL_LITERAL) {
+        char_class_t cls;
+        regex_node_class(node, &cls);
+        printf("class ");
+        print_char_class(&cls);
+        printf("\n");
     } else if (node->tag == NODE_SEQUENCE || node->tag == NODE_ALTERNATE) {
         printf("%s\n", node->tag == NODE_SEQUENCE ? "sequence" : "alternate");
 
@@ -47,6 +90,9 @@ void print_node_tree(regex_node_t *node, int level) {
     } else if (node->tag == NODE_REPEAT) {
         printf("repeat [%d, %d]\n", node->repeat.min, node->repeat.max);
         print_node_tree(node->repeat.el, level + 1);
+    } else if (node->tag == NODE_GROUP) {
+        printf("group %d\n", node->group.index);
+        print_node_tree(node->group.el, level + 1);
     }
 }
 
@@ -64,27 +110,36 @@ void print_program(vm_program_t *prog) {
 
         vm_inst_t inst = prog->insts[i];
         if (inst.op == OP_LITERAL) {
-            printf("literal '%.*s'", inst.literal.length, inst.literal.str);
+            printf("literal '%c'", inst.literal.str[0]);
+            // the start of a run
+            bool head = i == 0 || prog->insts[i-1].op != OP_LITERAL || prog->insts[i-1].literal.length == 1;
+            if (inst.literal.length > 1 && head)
+                printf(" (run '%.*s')", inst.literal.length, inst.literal.str);
         } else if (inst.op == OP_JMP) {
             printf("jmp %d", inst.jmp_label);
         } else if (inst.op == OP_SPLIT) {
             printf("split %d, %d", inst.split.label_1, inst.split.label_2);
         } else if (inst.op == OP_ANY) {
             printf("any");
+        } else if (inst.op == OP_CLASS) {
+            printf("class %d ", inst.class_index);
+            print_char_class(&prog->classes[inst.class_index]);
         } else if (inst.op == OP_MATCH) {
             printf("match");
+        } else if (inst.op == OP_SAVE) {
+            printf("save %d", inst.save_slot);
         }
         printf("\n");
     }
 }
 
-void *executable_mem(int size) {
-    void *res = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-        MAP_ANON | MAP_PRIVATE | MAP_JIT, -1, 0);
-
-    if (res == MAP_FAILED) {
-        printf("mmap failed!: %s\n", strerror(errno));
-        exit(-1);
+void print_literal_set(literal_set_t *set) {
+    if (set->length == 0) {
+        printf("(none)");
+        return;
+    }
+    for (int i = 0; i < set->length; i++) {
+        if (i > 0) printf(" | ");
+        printf("\"%.*s\"", set->lengths[i], set->strs[i]);
     }
-    return res;
 }
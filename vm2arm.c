@@ -3,24 +3,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#define REG_TMP2 "x3"
-#define REG_TMP "x4"
-#define REGW_TMP "w4"
-#define REG_SPTR "x5"
-#define REG_SIDX "x6"
-#define REGW_SIDX "w6"
-#define REG_CHAR "x7"
-#define REGW_CHAR "w7"
-#define REG_CURR_BASE "x8"
-#define REG_CURR_LEN "x9"
-#define REG_CURR_IDX "x10"
-#define REG_RUN_PC "x11"
-
-#define REG_NEXT_BASE "x12"
-#define REG_NEXT_IDX "x13"
-#define REG_HIST_BASE "x14"
-
+#define REG_LEN 1 // JIT_MATCH_LEN only
+#define REG_SIDX1 2 // REG_SIDX + 1
+#define REG_TMP2 3
+#define REG_TMP 4
+#define REG_SPTR 5
+#define REG_SIDX 6
+#define REG_CHAR 7
+#define REG_CURR_BASE 8
+#define REG_CURR_LEN 9
+#define REG_CURR_IDX 10
+#define REG_RUN_PC 11
+
+#define REG_NEXT_BASE 12
+#define REG_NEXT_IDX 13
+#define REG_HIST_BASE 14
+#define REG_SCRATCH 15 // for immediates that don't fit in an instruction
+
+#define REG_FP 29
+#define REG_LR 30
 #define REG_SP 31
+#define REG_ZR 31
 
 #define COND_EQ 0b0000
 #define COND_NE 0b0001
@@ -29,18 +32,63 @@
 #define COND_GT 0b1100
 #define COND_LE 0b1101
 
-#define LABEL_NOMATCH 1
-#define LABEL_MATCH 2
+// doesn't match any byte, used as the char at the end in JIT_MATCH_LEN
+#define CHAR_END 256
+
+// kinds of label references
+#define FIXUP_B 0     // imm26
+#define FIXUP_IMM19 1 // b.cond, cbz
+#define FIXUP_ADR 2   // immhi:immlo
 
 arm_inst_t arm_ldr_reg(reg_t base, reg_t offset, reg_t dest) {
-    return 0xf8600800 | (base << 5) | (offset << 16) | (dest << 0);
+    // ldr dest, [base, offset, sxtx #3]
+    return 0xf860f800 | (base << 5) | (offset << 16) | (dest << 0);
+}
+
+arm_inst_t arm_str_reg(reg_t base, reg_t offset, reg_t src) {
+    // str src, [base, offset, sxtx #3]
+    return 0xf820f800 | (base << 5) | (offset << 16) | (src << 0);
+}
+
+arm_inst_t arm_str_imm(reg_t base, int imm, reg_t src) {
+    return 0xf9000000 | ((imm / 8) << 10) | (base << 5) | (src << 0);
+}
+
+arm_inst_t arm_ldr_imm(reg_t base, int imm, reg_t dest) {
+    return 0xf9400000 | ((imm / 8) << 10) | (base << 5) | (dest << 0);
+}
+
+arm_inst_t arm_ldrb_reg(reg_t base, reg_t offset, reg_t dest) {
+    return 0x38606800 | (base << 5) | (offset << 16) | (dest << 0);
+}
+
+// ldr wdest, [base, offset, lsl #2]
+arm_inst_t arm_ldr_w_reg(reg_t base, reg_t offset, reg_t dest) {
+    return 0xb8607800 | (base << 5) | (offset << 16) | (dest << 0);
+}
+
+// lsr wdest, wa, #shift
+arm_inst_t arm_lsr_w_imm(reg_t a, int shift, reg_t dest) {
+    return 0x53007c00 | (shift << 16) | (a << 5) | (dest << 0);
+}
+
+// lsr wdest, wa, wb (the shift is wb mod 32)
+arm_inst_t arm_lsrv_w(reg_t a, reg_t b, reg_t dest) {
+    return 0x1ac02400 | (b << 16) | (a << 5) | (dest << 0);
+}
+
+// and wdest, wa, #1
+arm_inst_t arm_and1_w(reg_t a, reg_t dest) {
+    return 0x12000000 | (a << 5) | (dest << 0);
 }
 
 arm_inst_t arm_add_reg(reg_t a, reg_t b, reg_t dest) {
     return 0x8b000000 | (a << 5) | (b << 16) | (dest << 0);
 }
 
+// imm is 12 bits, optionally shifted left by 12
 arm_inst_t arm_add_imm(reg_t a, int imm, reg_t dest) {
+    if (imm > 0xfff) return 0x91400000 | (a << 5) | ((imm >> 12) << 10) | (dest << 0);
     return 0x91000000 | (a << 5) | (imm << 10) | (dest << 0);
 }
 
@@ -49,9 +97,52 @@ arm_inst_t arm_sub_reg(reg_t a, reg_t b, reg_t dest) {
 }
 
 arm_inst_t arm_sub_imm(reg_t a, int imm, reg_t dest) {
+    if (imm > 0xfff) return 0xd1400000 | (a << 5) | ((imm >> 12) << 10) | (dest << 0);
     return 0xd1000000 | (a << 5) | (imm << 10) | (dest << 0);
 }
 
+arm_inst_t arm_cmp_reg(reg_t a, reg_t b) {
+    return 0xeb000000 | (a << 5) | (b << 16) | REG_ZR;
+}
+
+arm_inst_t arm_cmp_imm(reg_t a, int imm) {
+    return 0xf1000000 | (a << 5) | (imm << 10) | REG_ZR;
+}
+
+arm_inst_t arm_mov_reg(reg_t src, reg_t dest) {
+    if (src == REG_SP || dest == REG_SP) return arm_add_imm(src, 0, dest);
+    return 0xaa0003e0 | (src << 16) | (dest << 0);
+}
+
+arm_inst_t arm_movz(int imm16, int shift, reg_t dest) {
+    return 0xd2800000 | ((shift / 16) << 21) | (imm16 << 5) | (dest << 0);
+}
+
+arm_inst_t arm_movk(int imm16, int shift, reg_t dest) {
+    return 0xf2800000 | ((shift / 16) << 21) | (imm16 << 5) | (dest << 0);
+}
+
+arm_inst_t arm_movn(int imm16, reg_t dest) {
+    return 0x92800000 | (imm16 << 5) | (dest << 0);
+}
+
+arm_inst_t arm_br(reg_t target) {
+    return 0xd61f0000 | (target << 5);
+}
+
+arm_inst_t arm_ret() {
+    return 0xd65f03c0;
+}
+
+arm_inst_t arm_stp_pre(reg_t a, reg_t b, reg_t base, int imm) {
+    return 0xa9800000 | (((imm / 8) & 0x7f) << 15) | (b << 10) | (base << 5) | (a << 0);
+}
+
+arm_inst_t arm_ldp_post(reg_t a, reg_t b, reg_t base, int imm) {
+    return 0xa8c00000 | (((imm / 8) & 0x7f) << 15) | (b << 10) | (base << 5) | (a << 0);
+}
+
+// the label is filled in when the program is resolved
 arm_inst_t arm_b_cond(int label, int cond) {
     return 0x54000000 | (label << 5) | cond;
 }
@@ -60,157 +151,334 @@ arm_inst_t arm_b(int label) {
     return 0x14000000 | label;
 }
 
+arm_inst_t arm_cbz_w(reg_t reg) {
+    return 0x34000000 | reg;
+}
+
+arm_inst_t arm_adr(reg_t dest) {
+    return 0x10000000 | dest;
+}
+
 int insert(arm_program_t *prog, arm_inst_t inst) {
+    if (prog->index == prog->capacity) {
+        prog->capacity *= 2;
+        prog->insts = (arm_inst_t*) realloc(prog->insts, prog->capacity * sizeof(arm_inst_t));
+    }
     prog->insts[prog->index] = inst;
     return prog->index++;
 }
 
-void vm2arm(vm_program_t *vp, arm_program_t *ap) {
-    FILE *f = ap->f;
+int arm_new_label(arm_program_t *prog) {
+    if (prog->labels_length == prog->labels_capacity) {
+        prog->labels_capacity *= 2;
+        prog->label_table = (int*) realloc(prog->label_table, prog->labels_capacity * sizeof(int));
+    }
+    prog->label_table[prog->labels_length] = -1;
+    return prog->labels_length++;
+}
+
+void arm_bind(arm_program_t *prog, int label) {
+    prog->label_table[label] = prog->index;
+}
+
+// insert an instruction that refers to a label
+int insert_ref(arm_program_t *prog, arm_inst_t inst, int label, int kind) {
+    if (prog->fixups_length == prog->fixups_capacity) {
+        prog->fixups_capacity *= 2;
+        prog->fixups = (arm_fixup_t*) realloc(prog->fixups, prog->fixups_capacity * sizeof(arm_fixup_t));
+    }
+    prog->fixups[prog->fixups_length++] = (arm_fixup_t){.index = prog->index, .label = label, .kind = kind};
+    return insert(prog, inst);
+}
+
+void arm_resolve(arm_program_t *prog) {
+    for (int i = 0; i < prog->fixups_length; i++) {
+        arm_fixup_t fix = prog->fixups[i];
+        int rel = prog->label_table[fix.label] - fix.index; // in instructions
+
+        if (fix.kind == FIXUP_B) {
+            prog->insts[fix.index] |= rel & 0x3ffffff;
+        } else if (fix.kind == FIXUP_IMM19) {
+            prog->insts[fix.index] |= (rel & 0x7ffff) << 5;
+        } else if (fix.kind == FIXUP_ADR) {
+            // byte offset, the low 2 bits (immlo) are always 0
+            prog->insts[fix.index] |= (rel & 0x7ffff) << 5;
+        }
+    }
+}
+
+// dest = imm, for any 32-bit immediate
+void arm_mov_imm(arm_program_t *prog, reg_t dest, uint32_t imm) {
+    insert(prog, arm_movz(imm & 0xffff, 0, dest));
+    if (imm >> 16) insert(prog, arm_movk(imm >> 16, 16, dest));
+}
+
+// dest = imm, for addresses
+void arm_mov_imm64(arm_program_t *prog, reg_t dest, uint64_t imm) {
+    insert(prog, arm_movz(imm & 0xffff, 0, dest));
+    for (int shift = 16; shift < 64; shift += 16)
+        if ((imm >> shift) & 0xffff) insert(prog, arm_movk((imm >> shift) & 0xffff, shift, dest));
+}
+
+// add/sub immediates up to 24 bits
+void arm_add_big(arm_program_t *prog, reg_t a, int imm, reg_t dest) {
+    if (imm > 0xfff) {
+        insert(prog, arm_add_imm(a, imm & ~0xfff, dest));
+        a = dest;
+    }
+    if ((imm & 0xfff) != 0 || a != dest) insert(prog, arm_add_imm(a, imm & 0xfff, dest));
+}
+
+void arm_sub_big(arm_program_t *prog, reg_t a, int imm, reg_t dest) {
+    if (imm > 0xfff) {
+        insert(prog, arm_sub_imm(a, imm & ~0xfff, dest));
+        a = dest;
+    }
+    if ((imm & 0xfff) != 0 || a != dest) insert(prog, arm_sub_imm(a, imm & 0xfff, dest));
+}
+
+void arm_cmp_big(arm_program_t *prog, reg_t a, int imm) {
+    if (imm > 0xfff) {
+        arm_mov_imm(prog, REG_SCRATCH, imm);
+        insert(prog, arm_cmp_reg(a, REG_SCRATCH));
+    } else {
+        insert(prog, arm_cmp_imm(a, imm));
+    }
+}
+
+// ldr/str on the history, the scaled immediate only reaches 32760.
+// The register forms scale by 8 too
+void arm_hist_ldr(arm_program_t *prog, int offset, reg_t dest) {
+    if (offset / 8 > 0xfff) {
+        arm_mov_imm(prog, REG_SCRATCH, offset / 8);
+        insert(prog, arm_ldr_reg(REG_HIST_BASE, REG_SCRATCH, dest));
+    } else {
+        insert(prog, arm_ldr_imm(REG_HIST_BASE, offset, dest));
+    }
+}
+
+void arm_hist_str(arm_program_t *prog, int offset, reg_t src) {
+    if (offset / 8 > 0xfff) {
+        arm_mov_imm(prog, REG_SCRATCH, offset / 8);
+        insert(prog, arm_str_reg(REG_HIST_BASE, REG_SCRATCH, src));
+    } else {
+        insert(prog, arm_str_imm(REG_HIST_BASE, offset, src));
+    }
+}
+
+// The history has the step each pc was last pushed for: REG_SIDX for the
+// current list, REG_SIDX1 for the next one. So a pc that is already on the
+// next list won't be pushed again by a jmp/split once the lists are swapped.
+// Positions are 64 bits so they never wrap.
+#define HIST(pc) ((pc) * 8)
+
+// push bytecode_inst_<target> onto a stack, unless the history says it's already there
+void arm_push_thread(arm_program_t *prog, int hist_offset, reg_t mark, int target_label,
+                     reg_t base, reg_t len, int skip_label) {
+    arm_hist_ldr(prog, hist_offset, REG_TMP);
+    insert(prog, arm_cmp_reg(REG_TMP, mark));
+    insert_ref(prog, arm_b_cond(0, COND_EQ), skip_label, FIXUP_IMM19); // this was already on the stack
+    // or make these conditional instead of branching?
+    arm_hist_str(prog, hist_offset, mark);
+    insert_ref(prog, arm_adr(REG_TMP), target_label, FIXUP_ADR);
+    insert(prog, arm_str_reg(base, len, REG_TMP));
+    insert(prog, arm_add_imm(len, 1, len));
+}
+
+void vm2arm(vm_program_t *vp, arm_program_t *ap, jit_mode_t mode) {
+    ap->capacity = 1024;
+    ap->index = 0;
+    ap->insts = (arm_inst_t*) malloc(ap->capacity * sizeof(arm_inst_t));
+    ap->labels_capacity = 64;
+    ap->labels_length = 0;
+    ap->label_table = (int*) malloc(ap->labels_capacity * sizeof(int));
+    ap->fixups_capacity = 64;
+    ap->fixups_length = 0;
+    ap->fixups = (arm_fixup_t*) malloc(ap->fixups_capacity * sizeof(arm_fixup_t));
+
+    // JIT_MATCH stops at '\0', JIT_MATCH_LEN at x1 (len)
+    bool bounded = mode == JIT_MATCH_LEN;
+    // consuming instructions push their closures straight onto the next
+    // stack, and jmps, splits and saves never run
+    bool closed = vp->eps != NULL;
 
     int N = vp->insts_length;
-    int sp_sub = 16 + 3 * 8 * N;
-    
+    int sp_sub = 3 * 8 * N;
+
     sp_sub = sp_sub + (16 - (sp_sub % 16)); // 16 byte aligned stack pointer
 
-    fprintf(f, "_matchit:\n");
+    int *inst_labels = (int*) malloc(N * sizeof(int));
+    for (int i = 0; i < N; i++)
+        inst_labels[i] = arm_new_label(ap);
+
+    int zero_hist_loop = arm_new_label(ap);
+    int the_loop = arm_new_label(ap);
+    int loop_inner = arm_new_label(ap);
+    int bytecode_instr_done = arm_new_label(ap);
+    int match = arm_new_label(ap);
+    int fin = arm_new_label(ap);
+    int at_end = arm_new_label(ap);
+    int have_char = arm_new_label(ap);
 
     // set up SP
-    fprintf(f, "sub sp, sp, #%d\n", sp_sub);
-    //fprintf(f, "stp x29, x30, [sp, #%d]\n", sp_sub - 16);
-    fprintf(f, "str x29, [sp, #%d]\n", sp_sub-16); // offset can be too large for stp
-    fprintf(f, "str x30, [sp, #%d]\n", sp_sub-8);
+    insert(ap, arm_stp_pre(REG_FP, REG_LR, REG_SP, -16));
+    arm_sub_big(ap, REG_SP, sp_sub, REG_SP);
 
     // initialize our regs
-    fprintf(f, "mov " REG_SPTR ", x0\n");
-    fprintf(f, "mov x0, #0\n"); // the result (no match by default)
-    fprintf(f, "mov " REG_SIDX ", #0\n");
-    fprintf(f, "mov " REG_CURR_BASE ", sp\n" );
-    fprintf(f, "mov " REG_CURR_IDX ", #0\n");
-    fprintf(f, "mov " REG_CURR_LEN ", #1\n");
-    fprintf(f, "mov " REG_NEXT_BASE ", sp\n");
-    fprintf(f, "add " REG_NEXT_BASE ", " REG_NEXT_BASE ", #%d\n", 8*N);
-    fprintf(f, "mov " REG_NEXT_IDX ", #0\n");
-    fprintf(f, "mov " REG_HIST_BASE ", sp\n");
-    fprintf(f, "add " REG_HIST_BASE ", " REG_HIST_BASE ", #%d\n", 2*8*N);
+    insert(ap, arm_mov_reg(0, REG_SPTR));
+    insert(ap, arm_movz(0, 0, 0)); // the result (no match by default)
+    insert(ap, arm_movz(0, 0, REG_SIDX));
+    insert(ap, arm_mov_reg(REG_SP, REG_CURR_BASE));
+    insert(ap, arm_movz(0, 0, REG_CURR_IDX));
+    insert(ap, arm_movz(closed ? 0 : 1, 0, REG_CURR_LEN));
+    arm_add_big(ap, REG_SP, 8*N, REG_NEXT_BASE);
+    insert(ap, arm_movz(0, 0, REG_NEXT_IDX));
+    arm_add_big(ap, REG_SP, 2*8*N, REG_HIST_BASE);
 
     // zero the history array
-    fprintf(f, "mov " REG_TMP ", #0\n");
-    fprintf(f, "zero_hist_loop:\n");
-    fprintf(f, "mov " REG_TMP2 ", #-1\n");
-    fprintf(f, "str " REG_TMP2 ", [" REG_HIST_BASE ", " REG_TMP ", sxtx #3]\n");
-    fprintf(f, "add " REG_TMP ", " REG_TMP ", #1\n");
-    fprintf(f, "cmp " REG_TMP ", #%d\n", N);
-    fprintf(f, "b.lt zero_hist_loop\n");
-
-    // add the first instruction to the current stack
-    fprintf(f, "adr " REG_TMP ", bytecode_inst_0\n");
-    fprintf(f, "str " REG_TMP ", [" REG_CURR_BASE "]\n");
+    insert(ap, arm_movz(0, 0, REG_TMP));
+    arm_bind(ap, zero_hist_loop);
+    insert(ap, arm_movn(0, REG_TMP2));
+    insert(ap, arm_str_reg(REG_HIST_BASE, REG_TMP, REG_TMP2));
+    insert(ap, arm_add_imm(REG_TMP, 1, REG_TMP));
+    arm_cmp_big(ap, REG_TMP, N);
+    insert_ref(ap, arm_b_cond(0, COND_LT), zero_hist_loop, FIXUP_IMM19);
+
+    // add the first instruction to the current stack, or with the epsilon
+    // closures everything it leads to without consuming
+    if (closed) {
+        for (int k = vp->eps_offsets[0]; k < vp->eps_offsets[1]; k++) {
+            insert_ref(ap, arm_adr(REG_TMP), inst_labels[vp->eps[k]], FIXUP_ADR);
+            insert(ap, arm_str_reg(REG_CURR_BASE, REG_CURR_LEN, REG_TMP));
+            insert(ap, arm_add_imm(REG_CURR_LEN, 1, REG_CURR_LEN));
+        }
+    } else {
+        insert_ref(ap, arm_adr(REG_TMP), inst_labels[0], FIXUP_ADR);
+        insert(ap, arm_str_imm(REG_CURR_BASE, 0, REG_TMP));
+        insert(ap, arm_str_imm(REG_HIST_BASE, HIST(0), REG_ZR));
+    }
 
     // the main loop
-    fprintf(f, "the_loop:\n");
+    arm_bind(ap, the_loop);
+    insert(ap, arm_add_imm(REG_SIDX, 1, REG_SIDX1));
     // char = str[idx]
-    fprintf(f, "ldrb " REGW_CHAR ", [" REG_SPTR ", " REG_SIDX "]\n");
+    if (bounded) {
+        insert(ap, arm_cmp_reg(REG_SIDX, REG_LEN));
+        insert_ref(ap, arm_b_cond(0, COND_GE), at_end, FIXUP_IMM19);
+    }
+    insert(ap, arm_ldrb_reg(REG_SPTR, REG_SIDX, REG_CHAR));
+    arm_bind(ap, have_char);
 
     // stack is empty -> no possible matches, exit
-    fprintf(f, "cmp " REG_CURR_LEN ", #0\n");
-    fprintf(f, "b.eq FIN\n");
+    insert(ap, arm_cmp_imm(REG_CURR_LEN, 0));
+    insert_ref(ap, arm_b_cond(0, COND_EQ), fin, FIXUP_IMM19);
 
     // execute things on the stack
-    fprintf(f, "loop_inner:\n");
-    fprintf(f, "ldr " REG_RUN_PC ", [" REG_CURR_BASE ", " REG_CURR_IDX ", sxtx #3]\n");
-    fprintf(f, "br " REG_RUN_PC "\n"); // do it!
-    fprintf(f, "bytecode_instr_done:\n");
-    fprintf(f, "add " REG_CURR_IDX ", " REG_CURR_IDX ", #1\n");
-    fprintf(f, "cmp " REG_CURR_IDX ", " REG_CURR_LEN "\n");
-    fprintf(f, "b.lt loop_inner\n");
+    arm_bind(ap, loop_inner);
+    insert(ap, arm_ldr_reg(REG_CURR_BASE, REG_CURR_IDX, REG_RUN_PC));
+    insert(ap, arm_br(REG_RUN_PC)); // do it!
+    arm_bind(ap, bytecode_instr_done);
+    insert(ap, arm_add_imm(REG_CURR_IDX, 1, REG_CURR_IDX));
+    insert(ap, arm_cmp_reg(REG_CURR_IDX, REG_CURR_LEN));
+    insert_ref(ap, arm_b_cond(0, COND_LT), loop_inner, FIXUP_IMM19);
 
     // inner loop is over, swap current & next stacks
-    fprintf(f, "mov " REG_TMP ", " REG_CURR_BASE "\n");
-    fprintf(f, "mov " REG_CURR_BASE ", " REG_NEXT_BASE "\n");
-    fprintf(f, "mov " REG_NEXT_BASE ", " REG_TMP "\n");
-    
-    fprintf(f, "mov " REG_CURR_IDX ", #0\n");
-    fprintf(f, "mov " REG_CURR_LEN ", " REG_NEXT_IDX "\n");
-    fprintf(f, "mov " REG_NEXT_IDX ", #0\n");
-
-    // go next to char, or exit without matching if already at '\0'
-    fprintf(f, "add " REG_SIDX ", " REG_SIDX ", #1\n");
-    fprintf(f, "cmp " REG_CHAR ", #0\n");
-    fprintf(f, "b.ne the_loop\n");
-    fprintf(f, "b FIN\n"); // we're done
+    insert(ap, arm_mov_reg(REG_CURR_BASE, REG_TMP));
+    insert(ap, arm_mov_reg(REG_NEXT_BASE, REG_CURR_BASE));
+    insert(ap, arm_mov_reg(REG_TMP, REG_NEXT_BASE));
+
+    insert(ap, arm_movz(0, 0, REG_CURR_IDX));
+    insert(ap, arm_mov_reg(REG_NEXT_IDX, REG_CURR_LEN));
+    insert(ap, arm_movz(0, 0, REG_NEXT_IDX));
+
+    // go next to char, or exit without matching if already at the end
+    insert(ap, arm_add_imm(REG_SIDX, 1, REG_SIDX));
+    insert(ap, arm_cmp_imm(REG_CHAR, bounded ? CHAR_END : 0));
+    insert_ref(ap, arm_b_cond(0, COND_NE), the_loop, FIXUP_IMM19);
+    insert_ref(ap, arm_b(0), fin, FIXUP_B); // we're done
+
+    if (bounded) {
+        arm_bind(ap, at_end);
+        insert(ap, arm_movz(CHAR_END, 0, REG_CHAR));
+        insert_ref(ap, arm_b(0), have_char, FIXUP_B);
+    }
 
     for (int idx = 0; idx < vp->insts_length; idx++) {
         vm_inst_t vi = vp->insts[idx];
 
-        for (int label_idx = 0; label_idx < vp->current_label; label_idx++) {
-            if (vp->label_table[label_idx] == idx) {
-                fprintf(f, "RL_%d:\n", label_idx);
-            }
-        }
-        fprintf(f, "bytecode_inst_%d:\n", idx);
+        arm_bind(ap, inst_labels[idx]);
 
-        if (vi.op == OP_LITERAL || vi.op == OP_ANY) {
+        if (vi.op == OP_LITERAL || vi.op == OP_ANY || vi.op == OP_CLASS) {
             if (vi.op == OP_LITERAL) {
-                char chr = vi.literal.str[0];
+                int chr = (uint8_t) vi.literal.str[0];
                 // assume char is already loaded
-                //fprintf(f, "ldrb " REGW_CHAR ", [" REG_SPTR ", " REG_SIDX "]\n");
-                fprintf(f, "cmp " REG_CHAR ", #%d\n", (int) chr);
-                fprintf(f, "b.ne bytecode_instr_done\n");
+                insert(ap, arm_cmp_imm(REG_CHAR, chr));
+                insert_ref(ap, arm_b_cond(0, COND_NE), bytecode_instr_done, FIXUP_IMM19);
+            } else if (vi.op == OP_CLASS) {
+                if (bounded) { // CHAR_END would be past the end of the bitmap
+                    insert(ap, arm_cmp_imm(REG_CHAR, CHAR_END));
+                    insert_ref(ap, arm_b_cond(0, COND_EQ), bytecode_instr_done, FIXUP_IMM19);
+                }
+                // bit char % 32 of word char / 32
+                arm_mov_imm64(ap, REG_SCRATCH, (uint64_t) &vp->classes[vi.class_index]);
+                insert(ap, arm_lsr_w_imm(REG_CHAR, 5, REG_TMP));
+                insert(ap, arm_ldr_w_reg(REG_SCRATCH, REG_TMP, REG_TMP));
+                insert(ap, arm_lsrv_w(REG_TMP, REG_CHAR, REG_TMP));
+                insert(ap, arm_and1_w(REG_TMP, REG_TMP));
+                insert_ref(ap, arm_cbz_w(REG_TMP), bytecode_instr_done, FIXUP_IMM19);
             }
 
-            fprintf(f, "ldrh " REGW_TMP ", [" REG_HIST_BASE ", #%d]\n", (idx+1)*8 + 4);
-            fprintf(f, "cmp " REG_TMP ", " REG_SIDX "\n");
-            fprintf(f, "b.eq bytecode_instr_done\n"); // this was already on the stack
-            // or make these conditional instead of branching?
-            fprintf(f, "strh " REGW_SIDX ", [" REG_HIST_BASE ", #%d]\n", (idx+1)*8 + 4);
-            fprintf(f, "adr " REG_TMP ", bytecode_inst_%d\n", idx+1);
-            fprintf(f, "str " REG_TMP ", [" REG_NEXT_BASE ", " REG_NEXT_IDX ", sxtx #3]\n");
-            fprintf(f, "add " REG_NEXT_IDX ", " REG_NEXT_IDX ", #1\n");
-            fprintf(f, "b bytecode_instr_done\n");
+            if (closed) {
+                for (int k = vp->eps_offsets[idx+1]; k < vp->eps_offsets[idx+2]; k++) {
+                    int target = vp->eps[k];
+                    int skip = arm_new_label(ap);
+                    arm_push_thread(ap, HIST(target), REG_SIDX1, inst_labels[target],
+                        REG_NEXT_BASE, REG_NEXT_IDX, skip);
+                    arm_bind(ap, skip);
+                }
+            } else {
+                arm_push_thread(ap, HIST(idx+1), REG_SIDX1, inst_labels[idx+1],
+                    REG_NEXT_BASE, REG_NEXT_IDX, bytecode_instr_done);
+            }
+            insert_ref(ap, arm_b(0), bytecode_instr_done, FIXUP_B);
 
         } else if (vi.op == OP_MATCH) {
-            fprintf(f, "cbz " REGW_CHAR ", MATCH\n");
-            fprintf(f, "b bytecode_instr_done\n");
+            if (bounded) {
+                insert(ap, arm_cmp_imm(REG_CHAR, CHAR_END));
+                insert_ref(ap, arm_b_cond(0, COND_EQ), match, FIXUP_IMM19);
+            } else {
+                insert_ref(ap, arm_cbz_w(REG_CHAR), match, FIXUP_IMM19);
+            }
+            insert_ref(ap, arm_b(0), bytecode_instr_done, FIXUP_B);
+
+        } else if (closed) {
+            // an epsilon, never on a stack
 
         } else if (vi.op == OP_JMP) {
             int jmp_pc = vp->label_table[vi.jmp_label];
 
-            fprintf(f, "ldrh " REGW_TMP ", [" REG_HIST_BASE ", #%d]\n", jmp_pc*8);
-            fprintf(f, "cmp " REG_TMP ", " REG_SIDX "\n");
-            fprintf(f, "b.eq bytecode_instr_done\n"); // this was already on the stack
-            // or make these conditional instead of branching?
-            fprintf(f, "strh " REGW_SIDX ", [" REG_HIST_BASE ", #%d]\n", jmp_pc*8);
-            fprintf(f, "adr " REG_TMP ", bytecode_inst_%d\n", jmp_pc);
-            fprintf(f, "str " REG_TMP ", [" REG_CURR_BASE ", " REG_CURR_LEN ", sxtx #3]\n");
-            fprintf(f, "add " REG_CURR_LEN ", " REG_CURR_LEN ", #1\n");
-            fprintf(f, "b bytecode_instr_done\n");
+            arm_push_thread(ap, HIST(jmp_pc), REG_SIDX, inst_labels[jmp_pc],
+                REG_CURR_BASE, REG_CURR_LEN, bytecode_instr_done);
+            insert_ref(ap, arm_b(0), bytecode_instr_done, FIXUP_B);
 
+        } else if (vi.op == OP_SAVE) {
+            // no captures here, just move on
+            arm_push_thread(ap, HIST(idx+1), REG_SIDX, inst_labels[idx+1],
+                REG_CURR_BASE, REG_CURR_LEN, bytecode_instr_done);
+            insert_ref(ap, arm_b(0), bytecode_instr_done, FIXUP_B);
 
         } else if (vi.op == OP_SPLIT) {
             int pc1 = vp->label_table[vi.split.label_1];
             int pc2 = vp->label_table[vi.split.label_2];
+            int split_part2 = arm_new_label(ap);
 
-            fprintf(f, "ldrh " REGW_TMP ", [" REG_HIST_BASE ", #%d]\n", pc1*8);
-            fprintf(f, "cmp " REG_TMP ", " REG_SIDX "\n");
-            fprintf(f, "b.eq split_part2_for_%d\n", idx); // this was already on the stack
-            // or make these conditional instead of branching?
-            fprintf(f, "strh " REGW_SIDX ", [" REG_HIST_BASE ", #%d]\n", pc1*8);
-            fprintf(f, "adr " REG_TMP ", bytecode_inst_%d\n", pc1);
-            fprintf(f, "str " REG_TMP ", [" REG_CURR_BASE ", " REG_CURR_LEN ", sxtx #3]\n");
-            fprintf(f, "add " REG_CURR_LEN ", " REG_CURR_LEN ", #1\n");
-
-            fprintf(f, "split_part2_for_%d:\n", idx);
-
-            fprintf(f, "ldrh " REGW_TMP ", [" REG_HIST_BASE ", #%d]\n", pc2*8);
-            fprintf(f, "cmp " REG_TMP ", " REG_SIDX "\n");
-            fprintf(f, "b.eq bytecode_instr_done\n"); // this was already on the stack
-            // or make these conditional instead of branching?
-            fprintf(f, "strh " REGW_SIDX ", [" REG_HIST_BASE ", #%d]\n", pc2*8);
-            fprintf(f, "adr " REG_TMP ", bytecode_inst_%d\n", pc2);
-            fprintf(f, "str " REG_TMP ", [" REG_CURR_BASE ", " REG_CURR_LEN ", sxtx #3]\n");
-            fprintf(f, "add " REG_CURR_LEN ", " REG_CURR_LEN ", #1\n");
-            fprintf(f, "b bytecode_instr_done\n");
+            arm_push_thread(ap, HIST(pc1), REG_SIDX, inst_labels[pc1],
+                REG_CURR_BASE, REG_CURR_LEN, split_part2);
+
+            arm_bind(ap, split_part2);
+            arm_push_thread(ap, HIST(pc2), REG_SIDX, inst_labels[pc2],
+                REG_CURR_BASE, REG_CURR_LEN, bytecode_instr_done);
+            insert_ref(ap, arm_b(0), bytecode_instr_done, FIXUP_B);
 
         } else {
             printf("Unsupported\n");
@@ -219,14 +487,22 @@ void vm2arm(vm_program_t *vp, arm_program_t *ap) {
     }
 
     // yay!
-    fprintf(f, "MATCH:\n");
-    fprintf(f, "mov x0, #1\n");
+    arm_bind(ap, match);
+    insert(ap, arm_movz(1, 0, 0));
 
-    fprintf(f, "FIN:\n");
+    arm_bind(ap, fin);
     // restore SP
-    // fprintf(f, "ldp x29, x30, [sp, #%d]\n", sp_sub - 16);
-    fprintf(f, "ldr x29, [sp, #%d]\n", sp_sub-16);
-    fprintf(f, "ldr x30, [sp, #%d]\n", sp_sub-8);
-    fprintf(f, "add sp, sp, #%d\n", sp_sub);
-    fprintf(f, "ret\n");
+    arm_add_big(ap, REG_SP, sp_sub, REG_SP);
+    insert(ap, arm_ldp_post(REG_FP, REG_LR, REG_SP, 16));
+    insert(ap, arm_ret());
+
+    arm_resolve(ap);
+
+    free(inst_labels);
+}
+
+void arm_program_free(arm_program_t *ap) {
+    free(ap->insts);
+    free(ap->label_table);
+    free(ap->fixups);
 }
@@ -0,0 +1,731 @@
+#include "rjit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// x86-64 backend. Generates machine code directly (no assembler round trip),
+// System V calling convention: arguments in rdi, rsi, rdx, rcx, result in eax.
+//
+// Unlike the ARM backend, the thread lists only ever hold consuming
+// instructions (literal/any/class/match). JMP and SPLIT are followed when a thread
+// is added, depth first, using the machine stack for pending alternatives.
+// This keeps the lists in priority order, which the search mode relies on.
+// Every bytecode instruction `p` gets two blocks of code:
+//
+//   S_p: "step"  - run the thread for the current char, then dispatch the
+//                  next thread in the current list
+//   A_p: "add"   - add pc p to the next list (following epsilons), then
+//                  `pop rax; jmp rax` to whoever asked for the add
+//
+// In JIT_SEARCH mode a list entry is (code address, start position) and a
+// new thread starting at pc 0 is added after every step until something
+// matches, see regex_search() for the semantics. With a required prefix the
+// generated code calls literal_set_find() to skip ahead when the lists run dry.
+//
+// JIT_MATCH_LEN is JIT_MATCH over (data, len): like the search mode, the end
+// is a position and the char there is CHAR_END, so '\0' is an ordinary byte.
+//
+// JIT_MATCH_SCRATCH is JIT_MATCH_LEN with the frame in caller memory (the
+// third argument, see MATCH_JIT_SCRATCH_SIZE), so big programs don't need a
+// big machine stack.
+//
+// JIT_SET is the match mode for regex_compile_set() programs: a match step at
+// the end of the string sets the pattern's bit and lets the other threads run.
+// JIT_SET_LEN is the same over (data, len), bounded like JIT_MATCH_LEN.
+//
+// In the match modes a literal that starts a run (see optimize.c) takes up to
+// X86_RUN_MAX bytes of it in one step when its thread is the only one on the
+// list: nothing else can be added meanwhile, so the step just compares the
+// bytes and moves the position past them. In JIT_MATCH that needs no length
+// check, the '\0' at the end never equals a pattern byte.
+//
+// JIT_STREAM keeps hist and the lists in caller memory instead of on the
+// stack (see STREAM_JIT_STATE_SIZE) and saves the list registers there when a
+// buffer runs out, so the next call resumes at the same step. Positions are
+// counted over the whole stream; REG_SPTR is pointed at where the stream
+// would start, so `[rdi + rsi - 1]` still addresses the current char.
+
+#define X86_RAX 0
+#define X86_RCX 1
+#define X86_RDX 2
+#define X86_RBX 3
+#define X86_RSP 4
+#define X86_RBP 5
+#define X86_RSI 6
+#define X86_RDI 7
+#define X86_R8  8
+#define X86_R9  9
+#define X86_R10 10
+#define X86_R11 11
+#define X86_R12 12
+#define X86_R13 13
+#define X86_R14 14
+#define X86_NOREG -1
+
+#define REG_TMP       X86_RAX
+#define REG_NEXT_LEN  X86_RCX
+#define REG_CHAR      X86_RDX
+#define REG_HIST_BASE X86_RBX
+#define REG_MARK      X86_RSI // index of the current char + 1
+#define REG_SPTR      X86_RDI
+#define REG_CURR_BASE X86_R8
+#define REG_CURR_LEN  X86_R9
+#define REG_CURR_IDX  X86_R10
+#define REG_NEXT_BASE X86_R11
+#define REG_LEN       X86_R12 // not in JIT_MATCH/JIT_SET
+#define REG_START     X86_R13 // search only: start of the thread being added
+#define REG_MATCHED   X86_R14 // search and set only
+
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_A  0x7
+
+// doesn't match any byte, used as the char at the end of the text
+#define CHAR_END 256
+
+// bytes of a literal run a lone thread takes in one step
+#define X86_RUN_MAX 16
+
+void x86_byte(x86_program_t *prog, uint8_t b) {
+    if (prog->index == prog->capacity) {
+        prog->capacity *= 2;
+        prog->code = (uint8_t*) realloc(prog->code, prog->capacity);
+    }
+    prog->code[prog->index++] = b;
+}
+
+void x86_imm32(x86_program_t *prog, int32_t imm) {
+    for (int i = 0; i < 4; i++)
+        x86_byte(prog, (imm >> (8 * i)) & 0xff);
+}
+
+int x86_new_label(x86_program_t *prog) {
+    if (prog->labels_length == prog->labels_capacity) {
+        prog->labels_capacity *= 2;
+        prog->label_table = (int*) realloc(prog->label_table, prog->labels_capacity * sizeof(int));
+    }
+    prog->label_table[prog->labels_length] = -1;
+    return prog->labels_length++;
+}
+
+void x86_bind(x86_program_t *prog, int label) {
+    prog->label_table[label] = prog->index;
+}
+
+// a rel32 to a label, always the last thing in an instruction
+void x86_rel32(x86_program_t *prog, int label) {
+    if (prog->fixups_length == prog->fixups_capacity) {
+        prog->fixups_capacity *= 2;
+        prog->fixups = (x86_fixup_t*) realloc(prog->fixups, prog->fixups_capacity * sizeof(x86_fixup_t));
+    }
+    prog->fixups[prog->fixups_length++] = (x86_fixup_t){.offset = prog->index, .label = label};
+    x86_imm32(prog, 0);
+}
+
+void x86_resolve(x86_program_t *prog) {
+    for (int i = 0; i < prog->fixups_length; i++) {
+        x86_fixup_t fix = prog->fixups[i];
+        int32_t rel = prog->label_table[fix.label] - (fix.offset + 4);
+        memcpy(prog->code + fix.offset, &rel, 4);
+    }
+}
+
+void x86_rex(x86_program_t *prog, int w, reg_t reg, reg_t index, reg_t base) {
+    uint8_t rex = 0x40 | (w << 3);
+    if (reg   > 7) rex |= 0x4;
+    if (index > 7) rex |= 0x2;
+    if (base  > 7) rex |= 0x1;
+    if (rex != 0x40) x86_byte(prog, rex);
+}
+
+void x86_opcode(x86_program_t *prog, int opcode) {
+    if (opcode > 0xff) x86_byte(prog, opcode >> 8);
+    x86_byte(prog, opcode & 0xff);
+}
+
+// <opcode> reg, rm  (register direct)
+void x86_op_reg(x86_program_t *prog, int w, int opcode, reg_t reg, reg_t rm) {
+    x86_rex(prog, w, reg, X86_NOREG, rm);
+    x86_opcode(prog, opcode);
+    x86_byte(prog, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// <opcode> reg, [base + index*scale + disp]
+void x86_op_mem(x86_program_t *prog, int w, int opcode, reg_t reg,
+                reg_t base, reg_t index, int scale, int32_t disp) {
+    x86_rex(prog, w, reg, index, base);
+    x86_opcode(prog, opcode);
+
+    int mod;
+    if (disp == 0 && (base & 7) != X86_RBP) mod = 0;
+    else if (disp >= -128 && disp <= 127) mod = 1;
+    else mod = 2;
+
+    if (index != X86_NOREG || (base & 7) == X86_RSP) {
+        int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+        int idx = index == X86_NOREG ? 4 : (index & 7);
+        x86_byte(prog, (mod << 6) | ((reg & 7) << 3) | 4);
+        x86_byte(prog, (ss << 6) | (idx << 3) | (base & 7));
+    } else {
+        x86_byte(prog, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    }
+
+    if (mod == 1) x86_byte(prog, disp & 0xff);
+    if (mod == 2) x86_imm32(prog, disp);
+}
+
+void x86_jmp(x86_program_t *prog, int label) {
+    x86_byte(prog, 0xe9);
+    x86_rel32(prog, label);
+}
+
+void x86_jcc(x86_program_t *prog, int cc, int label) {
+    x86_byte(prog, 0x0f);
+    x86_byte(prog, 0x80 | cc);
+    x86_rel32(prog, label);
+}
+
+// lea reg, [rip + label]
+void x86_lea_label(x86_program_t *prog, reg_t reg, int label) {
+    x86_rex(prog, 1, reg, X86_NOREG, X86_NOREG);
+    x86_byte(prog, 0x8d);
+    x86_byte(prog, ((reg & 7) << 3) | 5);
+    x86_rel32(prog, label);
+}
+
+void x86_mov_reg(x86_program_t *prog, reg_t dest, reg_t src) {
+    x86_op_reg(prog, 1, 0x89, src, dest);
+}
+
+void x86_xor_reg32(x86_program_t *prog, reg_t reg) {
+    x86_op_reg(prog, 0, 0x31, reg, reg);
+}
+
+void x86_inc(x86_program_t *prog, reg_t reg) {
+    x86_op_reg(prog, 1, 0xff, 0, reg);
+}
+
+void x86_push(x86_program_t *prog, reg_t reg) {
+    x86_rex(prog, 0, X86_NOREG, X86_NOREG, reg);
+    x86_byte(prog, 0x50 | (reg & 7));
+}
+
+void x86_pop(x86_program_t *prog, reg_t reg) {
+    x86_rex(prog, 0, X86_NOREG, X86_NOREG, reg);
+    x86_byte(prog, 0x58 | (reg & 7));
+}
+
+void x86_jmp_reg(x86_program_t *prog, reg_t reg) {
+    x86_op_reg(prog, 0, 0xff, 4, reg);
+}
+
+// cmp reg, imm32
+void x86_cmp_imm(x86_program_t *prog, int w, reg_t reg, int32_t imm) {
+    x86_op_reg(prog, w, 0x81, 7, reg);
+    x86_imm32(prog, imm);
+}
+
+// return to whoever asked for the current add
+void x86_add_done(x86_program_t *prog) {
+    x86_pop(prog, REG_TMP);
+    x86_jmp_reg(prog, REG_TMP);
+}
+
+// add reg, imm32
+void x86_add_imm(x86_program_t *prog, reg_t reg, int32_t imm) {
+    x86_op_reg(prog, 1, 0x81, 0, reg);
+    x86_imm32(prog, imm);
+}
+
+// mov reg32, imm32
+void x86_mov_imm(x86_program_t *prog, reg_t reg, int32_t imm) {
+    x86_op_reg(prog, 0, 0xc7, 0, reg);
+    x86_imm32(prog, imm);
+}
+
+// mov reg, [base + disp]
+void x86_load(x86_program_t *prog, reg_t reg, reg_t base, reg_t index, int32_t disp) {
+    x86_op_mem(prog, 1, 0x8b, reg, base, index, 1, disp);
+}
+
+// mov [base + disp], reg
+void x86_store(x86_program_t *prog, reg_t reg, reg_t base, reg_t index, int32_t disp) {
+    x86_op_mem(prog, 1, 0x89, reg, base, index, 1, disp);
+}
+
+// run the next thread of the current list, or finish the step.
+// list indices and lengths are in bytes
+void x86_dispatch(x86_program_t *prog, int entry_size, int step_done) {
+    x86_add_imm(prog, REG_CURR_IDX, entry_size);
+    x86_op_reg(prog, 1, 0x39, REG_CURR_LEN, REG_CURR_IDX); // cmp r10, r9
+    x86_jcc(prog, CC_AE, step_done);
+    x86_op_mem(prog, 0, 0xff, 4, REG_CURR_BASE, REG_CURR_IDX, 1, 0); // jmp [r8 + r10]
+}
+
+// mov reg, imm64
+void x86_mov_imm64(x86_program_t *prog, reg_t reg, uint64_t imm) {
+    x86_rex(prog, 1, X86_NOREG, X86_NOREG, reg);
+    x86_byte(prog, 0xb8 | (reg & 7));
+    for (int i = 0; i < 8; i++)
+        x86_byte(prog, (imm >> (8 * i)) & 0xff);
+}
+
+// rax = literal_set_find(set, rdi + rsi, rdi + r12). Only used while the
+// lists are empty and no add is pending, so the stack is 16 byte aligned
+// after the three pushes. Clobbers rcx, rdx, rsi, r9, r10.
+void x86_call_find(x86_program_t *prog, const literal_set_t *set) {
+    x86_push(prog, REG_SPTR);
+    x86_push(prog, REG_CURR_BASE);
+    x86_push(prog, REG_NEXT_BASE);
+    x86_op_mem(prog, 1, 0x8d, X86_RDX, REG_SPTR, REG_LEN, 1, 0); // lea rdx, [rdi + r12]
+    x86_op_mem(prog, 1, 0x8d, X86_RSI, REG_SPTR, REG_MARK, 1, 0); // lea rsi, [rdi + rsi]
+    x86_mov_imm64(prog, X86_RDI, (uint64_t) set);
+    x86_mov_imm64(prog, REG_TMP, (uint64_t) &literal_set_find);
+    x86_op_reg(prog, 0, 0xff, 2, REG_TMP); // call rax
+    x86_pop(prog, REG_NEXT_BASE);
+    x86_pop(prog, REG_CURR_BASE);
+    x86_pop(prog, REG_SPTR);
+}
+
+// where an add of pc really starts: saves don't do anything without captures
+int x86_add_target(vm_program_t *vp, int pc) {
+    while (vp->insts[pc].op == OP_SAVE) pc++;
+    return pc;
+}
+
+// push the address of `label` and jump to the add block for pc
+void x86_call_add(x86_program_t *prog, int label, int add_label) {
+    x86_lea_label(prog, REG_TMP, label);
+    x86_push(prog, REG_TMP);
+    x86_jmp(prog, add_label);
+}
+
+void vm2x86(vm_program_t *vp, x86_program_t *xp, jit_mode_t mode) {
+    xp->capacity = 4096;
+    xp->index = 0;
+    xp->code = (uint8_t*) malloc(xp->capacity);
+    xp->labels_capacity = 64;
+    xp->labels_length = 0;
+    xp->label_table = (int*) malloc(xp->labels_capacity * sizeof(int));
+    xp->fixups_capacity = 64;
+    xp->fixups_length = 0;
+    xp->fixups = (x86_fixup_t*) malloc(xp->fixups_capacity * sizeof(x86_fixup_t));
+
+    bool search = mode == JIT_SEARCH;
+    bool set = mode == JIT_SET || mode == JIT_SET_LEN;
+    bool stream = mode == JIT_STREAM;
+    bool scratch = mode == JIT_MATCH_SCRATCH;
+    bool bounded = mode == JIT_MATCH_LEN || mode == JIT_SET_LEN || scratch;
+    bool runs = (mode == JIT_MATCH || bounded) && !set;
+    int entry_size = search ? 16 : 8;
+
+    // the frame: hist, the two thread lists, then (search only) the
+    // start/end pointers and the best match so far, or (set only) the bitset
+    int N = vp->insts_length;
+    int curr_off = 8 * N;
+    int next_off = curr_off + entry_size * N;
+    int vars_off = next_off + entry_size * N;
+    int frame = vars_off + (search ? 32 : set ? 8 : 0);
+    // stream: started, curr base, next base, curr len and mark live after the lists
+    frame = frame + (16 - (frame % 16));
+
+    int *step_labels = (int*) malloc(N * sizeof(int));
+    int *add_labels = (int*) malloc(N * sizeof(int));
+    for (int i = 0; i < N; i++) {
+        step_labels[i] = x86_new_label(xp);
+        add_labels[i] = x86_new_label(xp);
+    }
+
+    int init_loop = x86_new_label(xp);
+    int start_done = x86_new_label(xp);
+    int step_loop = x86_new_label(xp);
+    int have_char = x86_new_label(xp);
+    int end_char = x86_new_label(xp);
+    int empty = x86_new_label(xp);
+    int step_done = x86_new_label(xp);
+    int swap = x86_new_label(xp);
+    int finish = x86_new_label(xp);
+    int no_start_ptr = x86_new_label(xp);
+    int no_end_ptr = x86_new_label(xp);
+    int match = x86_new_label(xp);
+    int fail = x86_new_label(xp);
+    int fin = x86_new_label(xp);
+    int add_done = x86_new_label(xp);
+    int skip = x86_new_label(xp);
+    int start_thread = x86_new_label(xp);
+    int set_done = x86_new_label(xp);
+    int resume = x86_new_label(xp);
+    int suspend = x86_new_label(xp);
+    int stream_end = x86_new_label(xp);
+
+    // required literals: skip ahead with `prefix` whenever nothing is
+    // running, or give up early if `inner` isn't there at all
+    const literal_set_t *prefix = NULL, *inner = NULL;
+    if (search && vp->prefilter != NULL) {
+        if (vp->prefilter->prefix.length > 0) prefix = &vp->prefilter->prefix;
+        else inner = &vp->prefilter->inner;
+    }
+
+    // prologue
+    x86_push(xp, X86_RBX);
+    if (search) {
+        x86_push(xp, REG_LEN);
+        x86_push(xp, REG_START);
+        x86_push(xp, REG_MATCHED);
+    } else if (set) {
+        x86_push(xp, REG_MATCHED);
+        if (bounded) x86_push(xp, REG_LEN);
+    } else if (stream || bounded) {
+        x86_push(xp, REG_LEN);
+    }
+    if (bounded) x86_mov_reg(xp, REG_LEN, X86_RSI);
+    if (stream) {
+        x86_mov_reg(xp, REG_HIST_BASE, X86_RDI);
+        x86_mov_reg(xp, REG_LEN, X86_RDX);
+        x86_mov_reg(xp, REG_SPTR, X86_RSI);
+        x86_op_mem(xp, 1, 0x81, 7, REG_HIST_BASE, X86_NOREG, 1, vars_off); // cmp qword [rbx + vars], 0
+        x86_imm32(xp, 0);
+        x86_jcc(xp, CC_NE, resume);
+        x86_op_mem(xp, 1, 0xc7, 0, REG_HIST_BASE, X86_NOREG, 1, vars_off); // mov qword [rbx + vars], 1
+        x86_imm32(xp, 1);
+    } else if (scratch) {
+        x86_mov_reg(xp, REG_HIST_BASE, X86_RDX);
+    } else {
+        x86_op_reg(xp, 1, 0x81, 5, X86_RSP); // sub rsp, frame
+        x86_imm32(xp, frame);
+        x86_mov_reg(xp, REG_HIST_BASE, X86_RSP);
+    }
+    if (search) {
+        x86_mov_reg(xp, REG_LEN, X86_RSI);
+        x86_store(xp, X86_RDX, REG_HIST_BASE, X86_NOREG, vars_off);
+        x86_store(xp, X86_RCX, REG_HIST_BASE, X86_NOREG, vars_off + 8);
+        x86_xor_reg32(xp, REG_MATCHED);
+        x86_xor_reg32(xp, REG_START);
+    } else if (set) {
+        // clear the bitset, the second argument or the third with a length
+        int bits = bounded ? X86_RDX : X86_RSI;
+        x86_store(xp, bits, REG_HIST_BASE, X86_NOREG, vars_off);
+        x86_xor_reg32(xp, REG_MATCHED);
+        for (int w = 0; w < SET_WORDS(vp->npatterns); w++) {
+            x86_op_mem(xp, 1, 0xc7, 0, bits, X86_NOREG, 1, 8*w); // mov qword [rsi + 8*w], 0
+            x86_imm32(xp, 0);
+        }
+    }
+    x86_op_mem(xp, 1, 0x8d, REG_CURR_BASE, REG_HIST_BASE, X86_NOREG, 1, curr_off);
+    x86_op_mem(xp, 1, 0x8d, REG_NEXT_BASE, REG_HIST_BASE, X86_NOREG, 1, next_off);
+
+    // set the history to -1
+    x86_xor_reg32(xp, REG_TMP);
+    x86_bind(xp, init_loop);
+    x86_op_mem(xp, 1, 0xc7, 0, REG_HIST_BASE, REG_TMP, 8, 0); // mov qword [rbx + rax*8], -1
+    x86_imm32(xp, -1);
+    x86_inc(xp, REG_TMP);
+    x86_cmp_imm(xp, 1, REG_TMP, N);
+    x86_jcc(xp, CC_B, init_loop);
+
+    // add the first instruction, then make it the current list
+    x86_xor_reg32(xp, REG_MARK);
+    x86_xor_reg32(xp, REG_NEXT_LEN);
+    if (search) {
+        if (inner != NULL) {
+            // no required literal anywhere, no match
+            x86_call_find(xp, inner);
+            x86_op_reg(xp, 1, 0x85, REG_TMP, REG_TMP);
+            x86_jcc(xp, CC_E, fail);
+            x86_xor_reg32(xp, REG_MARK);
+            x86_xor_reg32(xp, REG_NEXT_LEN);
+        }
+        x86_jmp(xp, prefix != NULL ? skip : start_thread);
+    } else {
+        x86_call_add(xp, start_done, add_labels[x86_add_target(vp, 0)]);
+        x86_bind(xp, start_done);
+        x86_jmp(xp, swap);
+    }
+
+    // the main loop
+    x86_bind(xp, step_loop);
+    if (search || stream || bounded) {
+        x86_op_reg(xp, 1, 0x39, REG_LEN, REG_MARK); // cmp rsi, r12
+        x86_jcc(xp, CC_A, stream ? suspend : end_char);
+    }
+    x86_op_mem(xp, 0, 0x0fb6, REG_CHAR, REG_SPTR, REG_MARK, 1, -1); // movzx edx, byte [rdi + rsi - 1]
+    x86_bind(xp, have_char);
+    x86_op_reg(xp, 1, 0x85, REG_CURR_LEN, REG_CURR_LEN);
+    x86_jcc(xp, CC_E, empty);
+    x86_xor_reg32(xp, REG_CURR_IDX);
+    x86_op_mem(xp, 0, 0xff, 4, REG_CURR_BASE, X86_NOREG, 1, 0); // jmp [r8]
+
+    if (search) {
+        x86_bind(xp, end_char);
+        x86_mov_imm(xp, REG_CHAR, CHAR_END);
+        x86_jmp(xp, have_char);
+
+        // nothing left to run: done if we have a match, otherwise try the next start
+        x86_bind(xp, empty);
+        x86_op_reg(xp, 1, 0x85, REG_MATCHED, REG_MATCHED);
+        x86_jcc(xp, CC_NE, finish);
+        x86_jmp(xp, step_done);
+
+        // every thread ran: stop at the end, otherwise start a new thread here
+        x86_bind(xp, step_done);
+        x86_op_reg(xp, 1, 0x39, REG_LEN, REG_MARK);
+        x86_jcc(xp, CC_A, finish);
+        x86_op_reg(xp, 1, 0x85, REG_MATCHED, REG_MATCHED);
+        x86_jcc(xp, CC_NE, swap);
+        if (prefix != NULL) {
+            // nothing running, skip to where a match could start
+            x86_op_reg(xp, 1, 0x85, REG_NEXT_LEN, REG_NEXT_LEN);
+            x86_jcc(xp, CC_NE, start_thread);
+            x86_bind(xp, skip);
+            x86_call_find(xp, prefix);
+            x86_op_reg(xp, 1, 0x85, REG_TMP, REG_TMP);
+            x86_jcc(xp, CC_E, finish);
+            x86_op_reg(xp, 1, 0x29, REG_SPTR, REG_TMP); // sub rax, rdi
+            x86_mov_reg(xp, REG_MARK, REG_TMP);
+            x86_xor_reg32(xp, REG_NEXT_LEN);
+        }
+        x86_bind(xp, start_thread);
+        x86_mov_reg(xp, REG_START, REG_MARK);
+        x86_call_add(xp, swap, add_labels[x86_add_target(vp, 0)]);
+    } else if (stream) {
+        // back in the next call, see resume below
+        x86_bind(xp, empty);
+        x86_jmp(xp, suspend);
+
+        // every thread ran: stop at the end, otherwise swap the lists
+        x86_bind(xp, step_done);
+        x86_cmp_imm(xp, 0, REG_CHAR, CHAR_END);
+        x86_jcc(xp, CC_E, fail);
+    } else {
+        // list is empty -> no possible matches, exit
+        x86_bind(xp, empty);
+        x86_jmp(xp, set ? set_done : fail);
+
+        if (bounded) {
+            x86_bind(xp, end_char);
+            x86_mov_imm(xp, REG_CHAR, CHAR_END);
+            x86_jmp(xp, have_char);
+        }
+
+        // every thread ran: stop at the end, otherwise swap the lists
+        x86_bind(xp, step_done);
+        if (bounded) x86_cmp_imm(xp, 0, REG_CHAR, CHAR_END);
+        else x86_op_reg(xp, 0, 0x85, REG_CHAR, REG_CHAR);
+        x86_jcc(xp, CC_E, set ? set_done : fail);
+    }
+
+    x86_bind(xp, swap);
+    x86_mov_reg(xp, REG_TMP, REG_CURR_BASE);
+    x86_mov_reg(xp, REG_CURR_BASE, REG_NEXT_BASE);
+    x86_mov_reg(xp, REG_NEXT_BASE, REG_TMP);
+    x86_mov_reg(xp, REG_CURR_LEN, REG_NEXT_LEN);
+    x86_xor_reg32(xp, REG_NEXT_LEN);
+    x86_inc(xp, REG_MARK);
+    x86_jmp(xp, step_loop);
+
+    x86_bind(xp, add_done);
+    x86_add_done(xp);
+
+    for (int idx = 0; idx < N; idx++) {
+        vm_inst_t vi = vp->insts[idx];
+
+        // step block (only consuming instructions and match are ever on a list)
+        x86_bind(xp, step_labels[idx]);
+        if (vi.op == OP_LITERAL || vi.op == OP_ANY || vi.op == OP_CLASS) {
+            int next_thread = x86_new_label(xp);
+            if (vi.op == OP_LITERAL) {
+                x86_cmp_imm(xp, 0, REG_CHAR, (uint8_t) vi.literal.str[0]);
+                x86_jcc(xp, CC_NE, next_thread);
+            } else if (search || stream || bounded) {
+                // CHAR_END would be past the end of the bitmap
+                x86_cmp_imm(xp, 0, REG_CHAR, CHAR_END);
+                x86_jcc(xp, CC_E, next_thread);
+            }
+            if (vi.op == OP_CLASS) {
+                x86_mov_imm64(xp, REG_TMP, (uint64_t) &vp->classes[vi.class_index]);
+                x86_op_mem(xp, 0, 0x0fa3, REG_CHAR, REG_TMP, X86_NOREG, 1, 0); // bt [rax], edx
+                x86_jcc(xp, CC_AE, next_thread); // not in the class: CF = 0
+            }
+            int run = vi.op == OP_LITERAL && runs ? vi.literal.length : 1;
+            if (run > X86_RUN_MAX) run = X86_RUN_MAX;
+            if (run > 1) {
+                // the only thread, and the run fits in what's left
+                int one = x86_new_label(xp);
+                x86_cmp_imm(xp, 1, REG_CURR_LEN, entry_size);
+                x86_jcc(xp, CC_NE, one);
+                if (bounded) {
+                    x86_op_mem(xp, 1, 0x8d, REG_TMP, REG_MARK, X86_NOREG, 1, run - 1); // lea rax, [rsi + run - 1]
+                    x86_op_reg(xp, 1, 0x39, REG_LEN, REG_TMP); // cmp rax, r12
+                    x86_jcc(xp, CC_A, one);
+                }
+                // the thread dies at the first byte that differs
+                for (int k = 1; k < run; k++) {
+                    x86_op_mem(xp, 0, 0x80, 7, REG_SPTR, REG_MARK, 1, k - 1); // cmp byte [rdi + rsi + k - 1], imm8
+                    x86_byte(xp, (uint8_t) vi.literal.str[k]);
+                    x86_jcc(xp, CC_NE, next_thread);
+                }
+                x86_add_imm(xp, REG_MARK, run - 1);
+                x86_call_add(xp, next_thread, add_labels[x86_add_target(vp, idx+run)]);
+                x86_bind(xp, one);
+            }
+            if (search) x86_load(xp, REG_START, REG_CURR_BASE, REG_CURR_IDX, 8);
+            x86_call_add(xp, next_thread, add_labels[x86_add_target(vp, idx+1)]);
+            x86_bind(xp, next_thread);
+            x86_dispatch(xp, entry_size, step_done);
+
+        } else if (vi.op == OP_MATCH) {
+            if (search) {
+                // remember the match and drop the lower priority threads
+                x86_load(xp, REG_TMP, REG_CURR_BASE, REG_CURR_IDX, 8);
+                x86_store(xp, REG_TMP, REG_HIST_BASE, X86_NOREG, vars_off + 16);
+                x86_op_mem(xp, 1, 0x8d, REG_TMP, REG_MARK, X86_NOREG, 1, -1); // lea rax, [rsi - 1]
+                x86_store(xp, REG_TMP, REG_HIST_BASE, X86_NOREG, vars_off + 24);
+                x86_mov_imm(xp, REG_MATCHED, 1);
+                x86_jmp(xp, step_done);
+            } else if (set) {
+                // at the end, set the bit and keep going
+                int next_thread = x86_new_label(xp);
+                int id = vi.match_id;
+                if (bounded) x86_cmp_imm(xp, 0, REG_CHAR, CHAR_END);
+                else x86_op_reg(xp, 0, 0x85, REG_CHAR, REG_CHAR);
+                x86_jcc(xp, CC_NE, next_thread);
+                x86_load(xp, REG_TMP, REG_HIST_BASE, X86_NOREG, vars_off);
+                x86_op_mem(xp, 1, 0x0fba, 5, REG_TMP, X86_NOREG, 1, 8*(id/64)); // bts qword [rax + 8*(id/64)], id%64
+                x86_byte(xp, id % 64);
+                x86_mov_imm(xp, REG_MATCHED, 1);
+                x86_bind(xp, next_thread);
+                x86_dispatch(xp, entry_size, step_done);
+            } else if (stream || bounded) {
+                x86_cmp_imm(xp, 0, REG_CHAR, CHAR_END);
+                x86_jcc(xp, CC_E, match);
+                x86_dispatch(xp, entry_size, step_done);
+            } else {
+                x86_op_reg(xp, 0, 0x85, REG_CHAR, REG_CHAR);
+                x86_jcc(xp, CC_E, match);
+                x86_dispatch(xp, entry_size, step_done);
+            }
+        }
+
+        // add block
+        x86_bind(xp, add_labels[idx]);
+        x86_op_mem(xp, 1, 0x39, REG_MARK, REG_HIST_BASE, X86_NOREG, 1, 8*idx); // cmp [rbx + 8*idx], rsi
+        x86_jcc(xp, CC_E, add_done); // already added
+        x86_op_mem(xp, 1, 0x89, REG_MARK, REG_HIST_BASE, X86_NOREG, 1, 8*idx);
+
+        if (vi.op == OP_LITERAL || vi.op == OP_ANY || vi.op == OP_CLASS || vi.op == OP_MATCH) {
+            x86_lea_label(xp, REG_TMP, step_labels[idx]);
+            x86_store(xp, REG_TMP, REG_NEXT_BASE, REG_NEXT_LEN, 0); // mov [r11 + rcx], rax
+            if (search) x86_store(xp, REG_START, REG_NEXT_BASE, REG_NEXT_LEN, 8);
+            x86_add_imm(xp, REG_NEXT_LEN, entry_size);
+            x86_add_done(xp);
+
+        } else if (vi.op == OP_JMP) {
+            x86_jmp(xp, add_labels[x86_add_target(vp, vp->label_table[vi.jmp_label])]);
+
+        } else if (vi.op == OP_SAVE) {
+            x86_jmp(xp, add_labels[x86_add_target(vp, idx+1)]);
+
+        } else if (vi.op == OP_SPLIT) {
+            int pc1 = x86_add_target(vp, vp->label_table[vi.split.label_1]);
+            int pc2 = x86_add_target(vp, vp->label_table[vi.split.label_2]);
+            x86_lea_label(xp, REG_TMP, add_labels[pc2]);
+            x86_push(xp, REG_TMP);
+            x86_jmp(xp, add_labels[pc1]);
+
+        } else {
+            printf("Unsupported\n");
+        }
+    }
+
+    if (search) {
+        // write out the offsets of the match, if there is one
+        x86_bind(xp, finish);
+        x86_op_reg(xp, 1, 0x85, REG_MATCHED, REG_MATCHED);
+        x86_jcc(xp, CC_E, fail);
+        x86_load(xp, X86_RDX, REG_HIST_BASE, X86_NOREG, vars_off);
+        x86_op_reg(xp, 1, 0x85, X86_RDX, X86_RDX);
+        x86_jcc(xp, CC_E, no_start_ptr);
+        x86_load(xp, REG_TMP, REG_HIST_BASE, X86_NOREG, vars_off + 16);
+        x86_store(xp, REG_TMP, X86_RDX, X86_NOREG, 0);
+        x86_bind(xp, no_start_ptr);
+        x86_load(xp, X86_RDX, REG_HIST_BASE, X86_NOREG, vars_off + 8);
+        x86_op_reg(xp, 1, 0x85, X86_RDX, X86_RDX);
+        x86_jcc(xp, CC_E, no_end_ptr);
+        x86_load(xp, REG_TMP, REG_HIST_BASE, X86_NOREG, vars_off + 24);
+        x86_store(xp, REG_TMP, X86_RDX, X86_NOREG, 0);
+        x86_bind(xp, no_end_ptr);
+    }
+
+    if (set) {
+        x86_bind(xp, set_done);
+        x86_mov_reg(xp, X86_RAX, REG_MATCHED);
+        x86_jmp(xp, fin);
+    }
+
+    if (stream) {
+        // out of input: save the lists, return whether anything is still running
+        x86_bind(xp, suspend);
+        x86_store(xp, REG_CURR_BASE, REG_HIST_BASE, X86_NOREG, vars_off + 8);
+        x86_store(xp, REG_NEXT_BASE, REG_HIST_BASE, X86_NOREG, vars_off + 16);
+        x86_store(xp, REG_CURR_LEN, REG_HIST_BASE, X86_NOREG, vars_off + 24);
+        x86_store(xp, REG_MARK, REG_HIST_BASE, X86_NOREG, vars_off + 32);
+        x86_xor_reg32(xp, X86_RAX);
+        x86_op_reg(xp, 1, 0x85, REG_CURR_LEN, REG_CURR_LEN);
+        x86_op_reg(xp, 0, 0x0f95, 0, X86_RAX); // setne al
+        x86_jmp(xp, fin);
+
+        // the next buffer, or the end if there is none
+        x86_bind(xp, resume);
+        x86_load(xp, REG_CURR_BASE, REG_HIST_BASE, X86_NOREG, vars_off + 8);
+        x86_load(xp, REG_NEXT_BASE, REG_HIST_BASE, X86_NOREG, vars_off + 16);
+        x86_load(xp, REG_CURR_LEN, REG_HIST_BASE, X86_NOREG, vars_off + 24);
+        x86_load(xp, REG_MARK, REG_HIST_BASE, X86_NOREG, vars_off + 32);
+        x86_xor_reg32(xp, REG_NEXT_LEN);
+        x86_op_reg(xp, 1, 0x85, REG_SPTR, REG_SPTR);
+        x86_jcc(xp, CC_E, stream_end);
+        x86_op_mem(xp, 1, 0x8d, REG_TMP, REG_MARK, X86_NOREG, 1, -1); // lea rax, [rsi - 1]
+        x86_op_reg(xp, 1, 0x01, REG_TMP, REG_LEN); // add r12, rax
+        x86_op_reg(xp, 1, 0x29, REG_TMP, REG_SPTR); // sub rdi, rax
+        x86_jmp(xp, step_loop);
+
+        x86_bind(xp, stream_end);
+        x86_mov_imm(xp, REG_CHAR, CHAR_END);
+        x86_jmp(xp, have_char);
+    }
+
+    x86_bind(xp, match);
+    x86_mov_imm(xp, X86_RAX, 1);
+    x86_jmp(xp, fin);
+
+    x86_bind(xp, fail);
+    x86_xor_reg32(xp, X86_RAX);
+
+    x86_bind(xp, fin);
+    if (!stream && !scratch) x86_add_imm(xp, X86_RSP, frame);
+    if (search) {
+        x86_pop(xp, REG_MATCHED);
+        x86_pop(xp, REG_START);
+        x86_pop(xp, REG_LEN);
+    } else if (set) {
+        if (bounded) x86_pop(xp, REG_LEN);
+        x86_pop(xp, REG_MATCHED);
+    } else if (stream || bounded) {
+        x86_pop(xp, REG_LEN);
+    }
+    x86_pop(xp, X86_RBX);
+    x86_byte(xp, 0xc3); // ret
+
+    x86_resolve(xp);
+
+    free(step_labels);
+    free(add_labels);
+}
+
+void x86_program_free(x86_program_t *xp) {
+    free(xp->code);
+    free(xp->label_table);
+    free(xp->fixups);
+}
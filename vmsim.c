@@ -1,6 +1,7 @@
 #include "rjit.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 // Some ways to implement the VM, good for prototyping
 // and timing against JIT
@@ -10,56 +11,6 @@ typedef struct {
     uint64_t idx;
 } vm_thread_t;
 
-bool vm_run1(vm_program_t *prog, const char *str) {
-    vm_thread_t thr = {.pc = 0, .idx = 0};
-
-    vm_thread_t *stack = (vm_thread_t*) malloc(4096 * sizeof(vm_thread_t));
-    int stackpos = 0;
-    int stackmax = 0;
-
-    while (true) {
-        printf("pc = %llu, idx = %llu (%c)\n", thr.pc, thr.idx, str[thr.idx]);
-        vm_inst_t inst = prog->insts[thr.pc];
-        if (inst.op == OP_LITERAL) {
-            if (*inst.literal.str == str[thr.idx]) {
-                thr.pc++;
-                thr.idx++;
-                continue;
-            }
-        } else if (inst.op == OP_MATCH) {
-            if (str[thr.idx] == '\0') {
-                printf("Stack max: %d\n", stackmax);
-                return true;
-            }
-        } else if (inst.op == OP_JMP) {
-            thr.pc = prog->label_table[inst.jmp_label];
-            continue;
-        } else if (inst.op == OP_SPLIT) {
-            uint64_t pc1 = prog->label_table[inst.split.label_1];
-            uint64_t pc2 = prog->label_table[inst.split.label_2];
-            stack[stackpos] = (vm_thread_t){.pc = pc2, .idx = thr.idx};
-            stackpos++;
-
-            if (stackpos > stackmax) stackmax = stackpos;
-
-            thr.pc = pc1;
-            continue;
-        }
-
-        // if we fall through we should pop a thread
-        if (stackpos == 0) {
-            printf("Stack max: %d\n", stackmax);
-            return false;
-        }
-
-        thr = stack[stackpos - 1];
-        stackpos--;
-    }
-
-    // unreachable?
-    return false;
-}
-
 int posmod(int i, int n) {
     return (i % n + n) % n;
 }
@@ -85,11 +36,15 @@ bool vm_run2(vm_program_t *prog, const char *str) {
         } else if (inst.op == OP_MATCH) {
             if (str[thr.idx] == '\0') {
                 printf("Stack max: %d\n", stackmax);
+                free(stack);
                 return true;
             }
         } else if (inst.op == OP_JMP) {
             thr.pc = prog->label_table[inst.jmp_label];
             continue;
+        } else if (inst.op == OP_SAVE) {
+            thr.pc++;
+            continue;
         } else if (inst.op == OP_SPLIT) {
             if (stackstart == stackend + 1 || (stackstart == 0 && stackend == sz - 1)) {
                 // too full
@@ -121,6 +76,7 @@ bool vm_run2(vm_program_t *prog, const char *str) {
         // if we fall through we should pop a thread
         if (stackstart == stackend) {
             printf("Stack max: %d\n", stackmax);
+            free(stack);
             return false;
         }
 
@@ -132,37 +88,103 @@ bool vm_run2(vm_program_t *prog, const char *str) {
     return false;
 }
 
-// thompson
-bool vm_run3(vm_program_t *prog, const char *str) {
+// Scratch for vm_run_code() and vm_run_scratch(). The history holds positions counted from
+// the first string run with it, so moving `base` past the last string is all
+// the reset the next one needs.
+vm_scratch_t *vm_scratch_new(vm_program_t *prog) {
     int N = prog->insts_length;
 
-    int histc[N];
-    int histn[N];
+    vm_scratch_t *s = (vm_scratch_t*) malloc(sizeof(vm_scratch_t));
+    s->prog = prog;
+    s->curr = (int*) malloc(N * sizeof(int));
+    s->next = (int*) malloc(N * sizeof(int));
+    s->histc = (size_t*) malloc(N * sizeof(size_t));
+    s->histn = (size_t*) malloc(N * sizeof(size_t));
+    s->base = 0;
+    s->threads = 0;
+    for (int i = 0; i < N; i++)
+        s->histc[i] = s->histn[i] = (size_t) -1;
+
+    return s;
+}
+
+void vm_scratch_free(vm_scratch_t *s) {
+    free(s->curr);
+    free(s->next);
+    free(s->histc);
+    free(s->histn);
+    free(s);
+}
+
+// thompson, over data[0, len). '\0' is just another byte
+bool vm_run_len(vm_program_t *prog, const char *data, size_t len) {
+    int N = prog->insts_length;
+
+    // too big for the stack, callers that care keep a vm_scratch_t around
+    if (N > VM_STACK_MAX_INSTS) {
+        vm_scratch_t *s = vm_scratch_new(prog);
+        bool res = vm_run_code(s, data, len);
+        vm_scratch_free(s);
+        return res;
+    }
+
+    // positions, so they don't wrap on big inputs
+    size_t histc[N];
+    size_t histn[N];
 
     for (int i = 0; i < N; i++)
-        histc[i] = histn[i] = -1;
+        histc[i] = histn[i] = (size_t) -1;
 
     int buf1[N];
     int buf2[N];
 
-    int *curr = buf1, *next = buf2;
+    vm_scratch_t s = {
+        .prog = prog,
+        .curr = buf1, .next = buf2,
+        .histc = histc, .histn = histn,
+        .base = 0, .threads = 0
+    };
+    return vm_run_code(&s, data, len);
+}
+
+// with a switch over prog->insts, what vm_run_code is timed against
+bool vm_run_scratch(vm_scratch_t *s, const char *data, size_t len) {
+    vm_program_t *prog = s->prog;
+    size_t *histc = s->histc, *histn = s->histn;
+    int *curr = s->curr, *next = s->next;
+
+    // positions base .. base+len, the history can hold base+len+1 when we stop
+    size_t base = s->base;
+    s->base += len + 2;
 
     int currlen = 1;
     int nextidx = 0;
     curr[0] = 0;
+    histc[0] = base;
 
-    int g = 0;
-    for (const char *sp = str; ; sp++, g++) {
+    for (size_t g = base; ; g++) {
         if (currlen == 0) return false;
 
-        char c = *sp;
+        // a lone thread in a run of literals takes the whole run in one step
+        while (currlen == 1 && prog->insts[curr[0]].op == OP_LITERAL) {
+            vm_inst_t inst = prog->insts[curr[0]];
+            int n = inst.literal.length;
+            if (n == 1) break;
+            if (len - (g - base) < (size_t) n || memcmp(data + (g - base), inst.literal.str, n) != 0)
+                return false;
+            g += n;
+            curr[0] += n;
+            histc[curr[0]] = g;
+        }
+
+        int c = g - base < len ? (uint8_t) data[g - base] : -1; // -1 at the end
         for (int i = 0; i < currlen; i++) {
             int pc1, pc2;
             int idx = curr[i];
             vm_inst_t inst = prog->insts[idx];
             switch (inst.op) {
             case OP_LITERAL:
-                if (*inst.literal.str == c) {
+                if ((uint8_t) *inst.literal.str == c) {
                     if (histn[idx+1] != g) {
                         next[nextidx++] = idx+1;
                         histn[idx+1] = g;
@@ -177,8 +199,26 @@ bool vm_run3(vm_program_t *prog, const char *str) {
                 }
                 break;
 
+            case OP_CLASS:
+                if (c >= 0 && CHAR_CLASS_HAS(&prog->classes[inst.class_index], c)) {
+                    if (histn[idx+1] != g) {
+                        next[nextidx++] = idx+1;
+                        histn[idx+1] = g;
+                    }
+                }
+                break;
+
             case OP_MATCH:
-                if (c == '\0') return true;
+                if (c < 0) return true;
+                break;
+
+            case OP_SAVE: // no captures here
+                pc1 = idx + 1;
+                if (histc[pc1] != g) {
+                    curr[currlen++] = pc1;
+                    histc[pc1] = g;
+                }
+                break;
 
             case OP_JMP:
                 pc1 = prog->label_table[inst.jmp_label];
@@ -210,12 +250,426 @@ bool vm_run3(vm_program_t *prog, const char *str) {
         currlen = nextidx;
         nextidx = 0;
 
-        if (c == '\0') break;
+        // these are on the list already, don't let a jmp/split add them twice
+        for (int i = 0; i < currlen; i++)
+            histc[curr[i]] = g+1;
+
+        if (c < 0) break;
+    }
+
+    return false;
+}
+
+// vm_run_scratch over prog->code, and direct threaded: every instruction jumps
+// straight to the one for the next thread instead of back to a switch, and
+// targets and literal bytes are in the instruction rather than behind the
+// label table and the pattern.
+bool vm_run_code(vm_scratch_t *s, const char *data, size_t len) {
+    vm_program_t *prog = s->prog;
+    const vm_code_t *code = prog->code;
+    size_t *histc = s->histc, *histn = s->histn;
+    int *curr = s->curr, *next = s->next;
+
+    // in vm_opcode_t order
+    static const void *dispatch[] = {
+        &&op_literal, &&op_any, &&op_jmp, &&op_split, &&op_match, &&op_save, &&op_class
+    };
+
+    // with the closures only consuming instructions and matches go on the
+    // lists, straight to next, without them epsilons go on curr as they come
+    const int *eps = prog->eps, *eps_offsets = prog->eps_offsets;
+
+    size_t base = s->base;
+    s->base += len + 2;
+
+    int currlen = 1;
+    int nextidx = 0;
+    curr[0] = 0;
+    histc[0] = base;
+    if (eps != NULL) {
+        currlen = eps_offsets[1] - eps_offsets[0];
+        memcpy(curr, eps + eps_offsets[0], currlen * sizeof(int));
+    }
+
+    size_t g = base;
+    int c, i, pc;
+    const vm_code_t *inst;
+
+// the next thread on the list, or on to the next byte
+#define VM_DISPATCH() do { \
+        if (i == currlen) goto step; \
+        pc = curr[i++]; \
+        inst = &code[pc]; \
+        goto *dispatch[inst->op]; \
+    } while (0)
+#define VM_ADD(hist, list, len, target) do { \
+        if (hist[target] != g) { \
+            list[len++] = target; \
+            hist[target] = g; \
+        } \
+    } while (0)
+
+    for (;;) {
+        if (currlen == 0) return false;
+
+        // a lone thread in a run of literals takes the whole run in one step
+        while (currlen == 1 && code[curr[0]].op == OP_LITERAL) {
+            int n = code[curr[0]].length;
+            if (n == 1) break;
+            if (len - (g - base) < (size_t) n || memcmp(data + (g - base), prog->bytes + curr[0], n) != 0)
+                return false;
+            g += n;
+            curr[0] += n;
+            histc[curr[0]] = g;
+            if (eps != NULL) {
+                currlen = eps_offsets[curr[0] + 1] - eps_offsets[curr[0]];
+                memcpy(curr, eps + eps_offsets[curr[0]], currlen * sizeof(int));
+            }
+        }
+
+        c = g - base < len ? (uint8_t) data[g - base] : -1; // -1 at the end
+        i = 0;
+        VM_DISPATCH();
+
+    op_literal:
+        if (inst->c == c) goto advance;
+        VM_DISPATCH();
+
+    op_any:
+        if (c >= 0) goto advance;
+        VM_DISPATCH();
+
+    op_class:
+        if (c >= 0 && CHAR_CLASS_HAS(&prog->classes[inst->x], c)) goto advance;
+        VM_DISPATCH();
+
+    advance: // pc consumed c
+        if (eps != NULL) {
+            for (int k = eps_offsets[pc + 1], end = eps_offsets[pc + 2]; k < end; k++)
+                VM_ADD(histn, next, nextidx, eps[k]);
+        } else {
+            VM_ADD(histn, next, nextidx, pc + 1);
+        }
+        VM_DISPATCH();
+
+    op_match:
+        if (c < 0) return true;
+        VM_DISPATCH();
+
+    op_save: // no captures here
+        VM_ADD(histc, curr, currlen, pc + 1);
+        VM_DISPATCH();
+
+    op_jmp:
+        VM_ADD(histc, curr, currlen, inst->x);
+        VM_DISPATCH();
+
+    op_split:
+        VM_ADD(histc, curr, currlen, inst->x);
+        VM_ADD(histc, curr, currlen, inst->y);
+        VM_DISPATCH();
+
+    step:
+        s->threads += currlen; // with any epsilons this step put on
+        int *tmp = next;
+        next = curr;
+        curr = tmp;
+
+        currlen = nextidx;
+        nextidx = 0;
+
+        // these are on the list already, don't let a jmp/split add them twice
+        if (eps == NULL) {
+            for (int k = 0; k < currlen; k++)
+                histc[curr[k]] = g+1;
+        }
+
+        if (c < 0) break;
+        g++;
     }
 
+#undef VM_DISPATCH
+#undef VM_ADD
+
     return false;
 }
 
+bool vm_run3(vm_program_t *prog, const char *str) {
+    return vm_run_len(prog, str, strlen(str));
+}
+
 bool vm_run(vm_program_t *prog, const char *str) {
     return vm_run3(prog, str);
 }
+
+// vm_run_len for a regex_compile_set() program: instead of stopping at the
+// first match, note the id of every match instruction still alive at the end.
+// `matched` gets SET_WORDS(prog->npatterns) words, returns true if any is set.
+// `hist` is 2 positions and `lists` 2 ints per instruction, see vm_run_set_len.
+bool vm_run_set_lists(vm_program_t *prog, const char *data, size_t len, uint64_t *matched,
+                      size_t *hist, int *lists) {
+    int N = prog->insts_length;
+
+    for (int i = 0; i < SET_WORDS(prog->npatterns); i++)
+        matched[i] = 0;
+
+    size_t *histc = hist;
+    size_t *histn = hist + N;
+
+    for (int i = 0; i < N; i++)
+        histc[i] = histn[i] = (size_t) -1;
+
+    int *curr = lists, *next = lists + N;
+
+    int currlen = 1;
+    int nextidx = 0;
+    curr[0] = 0;
+    histc[0] = 0;
+
+    bool any = false;
+    for (size_t g = 0; ; g++) {
+        if (currlen == 0) return false;
+
+        int c = g < len ? (uint8_t) data[g] : -1; // -1 at the end
+        for (int i = 0; i < currlen; i++) {
+            int pc1, pc2;
+            int idx = curr[i];
+            vm_inst_t inst = prog->insts[idx];
+            switch (inst.op) {
+            case OP_LITERAL:
+                if ((uint8_t) *inst.literal.str == c) {
+                    if (histn[idx+1] != g) {
+                        next[nextidx++] = idx+1;
+                        histn[idx+1] = g;
+                    }
+                }
+                break;
+
+            case OP_ANY:
+                if (c >= 0 && histn[idx+1] != g) {
+                    next[nextidx++] = idx+1;
+                    histn[idx+1] = g;
+                }
+                break;
+
+            case OP_CLASS:
+                if (c >= 0 && CHAR_CLASS_HAS(&prog->classes[inst.class_index], c)) {
+                    if (histn[idx+1] != g) {
+                        next[nextidx++] = idx+1;
+                        histn[idx+1] = g;
+                    }
+                }
+                break;
+
+            case OP_MATCH:
+                if (c < 0) {
+                    matched[inst.match_id / 64] |= (uint64_t) 1 << (inst.match_id % 64);
+                    any = true;
+                }
+                break;
+
+            case OP_SAVE:
+                pc1 = idx + 1;
+                if (histc[pc1] != g) {
+                    curr[currlen++] = pc1;
+                    histc[pc1] = g;
+                }
+                break;
+
+            case OP_JMP:
+                pc1 = prog->label_table[inst.jmp_label];
+                if (histc[pc1] != g) {
+                    curr[currlen++] = pc1;
+                    histc[pc1] = g;
+                }
+                break;
+
+            case OP_SPLIT:
+                pc1 = prog->label_table[inst.split.label_1];
+                pc2 = prog->label_table[inst.split.label_2];
+                if (histc[pc1] != g) {
+                    curr[currlen++] = pc1;
+                    histc[pc1] = g;
+                }
+                if (histc[pc2] != g) {
+                    curr[currlen++] = pc2;
+                    histc[pc2] = g;
+                }
+                break;
+            }
+        }
+
+        if (c < 0) break;
+
+        int *tmp = next;
+        next = curr;
+        curr = tmp;
+
+        currlen = nextidx;
+        nextidx = 0;
+
+        for (int i = 0; i < currlen; i++)
+            histc[curr[i]] = g+1;
+    }
+
+    return any;
+}
+
+// over data[0, len), '\0' is just another byte
+bool vm_run_set_len(vm_program_t *prog, const char *data, size_t len, uint64_t *matched) {
+    int N = prog->insts_length;
+
+    // a big set doesn't fit on the stack, like in vm_run_len
+    if (N > VM_STACK_MAX_INSTS) {
+        size_t *hist = (size_t*) malloc(2 * N * sizeof(size_t));
+        int *lists = (int*) malloc(2 * N * sizeof(int));
+        bool res = vm_run_set_lists(prog, data, len, matched, hist, lists);
+        free(hist);
+        free(lists);
+        return res;
+    }
+
+    size_t hist[2 * N];
+    int lists[2 * N];
+    return vm_run_set_lists(prog, data, len, matched, hist, lists);
+}
+
+bool vm_run_set(vm_program_t *prog, const char *str, uint64_t *matched) {
+    return vm_run_set_len(prog, str, strlen(str), matched);
+}
+
+// unanchored search, leftmost-first (like Perl and RE2).
+//
+// Threads are kept in priority order: epsilons are followed depth first when a
+// thread is added, and a thread starting at the current position is added last
+// at every step, so earlier starts always win. When a thread matches, every
+// thread after it on the list is dropped and no new starts are added. The
+// match is decided as soon as the list runs dry.
+typedef struct {
+    int pc;
+    size_t start;
+} vm_search_thread_t;
+
+void vm_search_add(vm_program_t *prog, vm_search_thread_t *list, int *len,
+                   size_t *hist, size_t mark, int *stack, int pc, size_t start) {
+    int sp = 0;
+    stack[sp++] = pc;
+
+    while (sp > 0) {
+        pc = stack[--sp];
+        if (hist[pc] == mark) continue;
+        hist[pc] = mark;
+
+        vm_inst_t inst = prog->insts[pc];
+        switch (inst.op) {
+        case OP_JMP:
+            stack[sp++] = prog->label_table[inst.jmp_label];
+            break;
+
+        case OP_SPLIT:
+            // label_1 has priority, so it goes on top
+            stack[sp++] = prog->label_table[inst.split.label_2];
+            stack[sp++] = prog->label_table[inst.split.label_1];
+            break;
+
+        case OP_SAVE:
+            stack[sp++] = pc + 1;
+            break;
+
+        default:
+            list[(*len)++] = (vm_search_thread_t){.pc = pc, .start = start};
+            break;
+        }
+    }
+}
+
+// `threads` holds both lists, 2 per instruction, and `stack` 2 per instruction
+// and one more, see regex_search
+bool regex_search_lists(vm_program_t *prog, const char *text, size_t len, size_t *start, size_t *end,
+                        size_t *hist, vm_search_thread_t *threads, int *stack) {
+    int N = prog->insts_length;
+
+    for (int i = 0; i < N; i++)
+        hist[i] = (size_t) -1;
+
+    vm_search_thread_t *curr = threads, *next = threads + N;
+    int currlen = 0, nextlen = 0;
+
+    bool matched = false;
+    size_t match_start = 0, match_end = 0;
+
+    // no required literal anywhere, no match
+    const prefilter_t *pf = prog->prefilter;
+    if (pf != NULL && pf->prefix.length == 0 &&
+        literal_set_find(&pf->inner, text, text + len) == NULL)
+        return false;
+
+    for (size_t pos = 0; ; pos++) {
+        // a new thread starting here, with the lowest priority
+        if (!matched) {
+            if (currlen == 0 && pf != NULL && pf->prefix.length > 0) {
+                // nothing running, skip to where a match could start
+                const char *cand = literal_set_find(&pf->prefix, text + pos, text + len);
+                if (cand == NULL) break;
+                pos = cand - text;
+            }
+            vm_search_add(prog, curr, &currlen, hist, pos, stack, 0, pos);
+        } else if (currlen == 0) {
+            break;
+        }
+
+        int c = pos < len ? (uint8_t) text[pos] : -1;
+        for (int i = 0; i < currlen; i++) {
+            vm_search_thread_t thr = curr[i];
+            vm_inst_t inst = prog->insts[thr.pc];
+
+            if ((inst.op == OP_LITERAL && (uint8_t) *inst.literal.str == c) ||
+                (inst.op == OP_ANY && c >= 0) ||
+                (inst.op == OP_CLASS && c >= 0 && CHAR_CLASS_HAS(&prog->classes[inst.class_index], c))) {
+                vm_search_add(prog, next, &nextlen, hist, pos + 1, stack, thr.pc + 1, thr.start);
+
+            } else if (inst.op == OP_MATCH) {
+                matched = true;
+                match_start = thr.start;
+                match_end = pos;
+                break; // cut off the lower priority threads
+            }
+        }
+
+        vm_search_thread_t *tmp = next;
+        next = curr;
+        curr = tmp;
+
+        currlen = nextlen;
+        nextlen = 0;
+
+        if (pos == len) break;
+    }
+
+    if (matched) {
+        if (start) *start = match_start;
+        if (end) *end = match_end;
+    }
+    return matched;
+}
+
+bool regex_search(vm_program_t *prog, const char *text, size_t len, size_t *start, size_t *end) {
+    int N = prog->insts_length;
+
+    // too big for the stack, like in vm_run_len
+    if (N > VM_STACK_MAX_INSTS) {
+        size_t *hist = (size_t*) malloc(N * sizeof(size_t));
+        vm_search_thread_t *threads = (vm_search_thread_t*) malloc(2 * N * sizeof(vm_search_thread_t));
+        int *stack = (int*) malloc((2 * N + 1) * sizeof(int));
+        bool res = regex_search_lists(prog, text, len, start, end, hist, threads, stack);
+        free(hist);
+        free(threads);
+        free(stack);
+        return res;
+    }
+
+    size_t hist[N];
+    vm_search_thread_t threads[2 * N];
+    int stack[2 * N + 1];
+    return regex_search_lists(prog, text, len, start, end, hist, threads, stack);
+}